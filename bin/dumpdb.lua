@@ -30,6 +30,8 @@ function main()
     local opts = {
         "filename",
         csv = true, c = "csv",
+        tsv = true,
+        binary = true, b = "binary",
         verbose = true, v = "verbose",
         table = string, t = "table",
         alltables = true, a = "alltables",
@@ -45,7 +47,9 @@ Syntax: dumpdb.lua [options] <filename>
 Options:
     --output | -o <path>
     --alltables | -a
+    --binary | -b
     --csv | -c
+    --tsv
     --help | -h
     --table | -t <table_name>
     --verbose | -v
@@ -60,7 +64,14 @@ is required if using --csv and --alltables.
 If --csv is specified, outputs to CSV format. Use --table <tableName> if there
 are multiple tables, to select which to output, or use --alltables combined with
 --output <filename> to dump each table to a file named
-<filename>_<table_name>.csv.
+<filename>_<table_name>.csv. The CSV is written out as the records are read,
+rather than being built up in memory first.
+
+If --tsv is specified, behaves as --csv but separates the values with tabs.
+
+If --binary is specified, writes the database in the binary permanent file
+store format used by EPOC devices. This requires --output, and is only
+available when run via the Qt opolua binary.
 ]])
         os.exit()
     end
@@ -80,29 +91,37 @@ are multiple tables, to select which to output, or use --alltables combined with
     db:load(data)
 
     local result
-    if args.csv then
+    if args.csv or args.tsv then
+        local sep = args.tsv and "\t" or ","
+        local ext = args.tsv and "tsv" or "csv"
         if db:tableCount() > 1 and args.table == nil and args.alltables == nil then
             printf("Error: Database has multiple tables; specify --table <name> or --alltables\n")
         end
+        local function writeTable(name, filename)
+            local f = filename and assert(io.open(filename, "wb")) or io.stdout
+            db:writeCsv(name, function(chunk) f:write(chunk) end, sep)
+            if filename then
+                f:close()
+            end
+        end
         if args.alltables then
             assert(args.output, "--output must be specified when using --alltables")
             for i, name in ipairs(db:getTableNames()) do
-                local data = db:tocsv(name)
-                local filename = string.format("%s_%s.csv", args.output, name)
-                local f = assert(io.open(filename, "w"))
-                f:write(data)
-                f:close()
+                writeTable(name, string.format("%s_%s.%s", args.output, name, ext))
             end
         else
-            result = db:tocsv(args.table)
+            writeTable(args.table, args.output)
         end
+    elseif args.binary then
+        assert(args.output, "--output must be specified when using --binary")
+        result = db:saveBinary()
     else
         result = db:save()
     end
 
     if result then
         if args.output then
-            local f = assert(io.open(args.output, "w"))
+            local f = assert(io.open(args.output, "wb"))
             f:write(result)
             f:close()
         else
@@ -0,0 +1,109 @@
+#!/usr/bin/env lua
+
+--[[
+
+Copyright (c) 2021-2026 Jason Morley, Tom Sutcliffe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+]]
+
+dofile(arg[0]:match("^(.-)[a-z]+%.lua$").."cmdline.lua")
+
+function main()
+    local opts = {
+        "filename",
+        "output",
+        binary = true, b = "binary",
+        table = string, t = "table",
+        tsv = true,
+        types = string,
+        help = true, h = "help",
+    }
+    local args = getopt(opts)
+
+    if args.help or not args.filename or not args.output then
+        printf([[
+Syntax: importdb.lua [options] <filename> <output>
+
+Options:
+    --binary | -b
+    --help | -h
+    --table | -t <table_name>
+    --tsv
+    --types <types>
+
+Creates a table from a CSV file and writes it to the database <output>. If
+<output> already exists, the table is added to it (and it is an error if a
+table of that name already exists). The CSV is read a line at a time and the
+database is saved once at the end, so large files can be imported without the
+overhead of appending the records individually.
+
+The first line of the CSV must be a header row giving the field names. Unless
+--types is specified, fields whose names end in %, & or $ are created as
+integer, long or string fields respectively, and all others as string fields.
+
+If --table is not specified, the table is called Table1.
+
+If --tsv is specified, the values are expected to be separated by tabs instead
+of commas.
+
+If --types is specified, it gives the type of each field in turn, as one of the
+letters i (integer), a (long), f (float) or s (string), for example "sif".
+
+If --binary is specified, a new database is written in the binary permanent
+file store format used by EPOC devices, instead of the internal text format
+used by database.lua. This is only available when run via the Qt opolua binary.
+An existing database is always written back in the format it was read in.
+]])
+        os.exit(args.help ~= nil)
+    end
+
+    local database = require("database")
+
+    local types
+    if args.types then
+        local typeLetters = {
+            i = DataTypes.EWord,
+            a = DataTypes.ELong,
+            f = DataTypes.EReal,
+            s = DataTypes.EString,
+        }
+        types = {}
+        for letter in args.types:gmatch(".") do
+            table.insert(types, assert(typeLetters[letter], "Bad type letter "..letter))
+        end
+    end
+
+    local db = database.new(args.output, false)
+    local binary = args.binary
+    local existing = io.open(args.output, "rb")
+    if existing then
+        db:load(existing:read("a"))
+        existing:close()
+        binary = db.binary
+    end
+
+    local count = db:importCsv(args.table or "Table1", io.lines(args.filename), args.tsv and "\t" or ",", types)
+    printf("Imported %d records\n", count)
+
+    writeFile(args.output, binary and db:saveBinary() or db:save())
+end
+
+pcallMain()
@@ -24,6 +24,11 @@ SOFTWARE.
 
 _ENV = module()
 
+local crc = require("crc")
+
+-- Native reader/writer for binary databases (see qt/pfsdb.cpp), if the host provides one
+local pfsdb = package.loaded.pfsdb
+
 KDbmsStoreDatabase = 0x10000069
 
 FieldTypes = enum {
@@ -53,6 +58,103 @@ OplTypeToFieldType = {
     [DataTypes.EString] = FieldTypes.Text,
 }
 
+-- Tables store their records by column: tbl.columns[i] is the array of values of tbl.fields[i] for every record in the
+-- table (and is also available as tbl.columns[fieldName]), and tbl.count is the number of records. This avoids
+-- allocating a table per record. Fields that OPL can't represent have a column containing no values.
+function newTable(name, fields)
+    local tbl = {
+        name = name,
+        fields = {},
+        columns = {},
+        count = 0,
+    }
+    for _, field in ipairs(fields or {}) do
+        addField(tbl, field)
+    end
+    return tbl
+end
+
+function addField(tbl, field)
+    local column = {}
+    table.insert(tbl.fields, field)
+    tbl.fields[field.name] = field
+    table.insert(tbl.columns, column)
+    tbl.columns[field.name] = column
+end
+
+-- Returns a copy of the given record as a table keyed by field name
+function getRecord(tbl, row)
+    local rec = {}
+    for i, field in ipairs(tbl.fields) do
+        rec[field.name] = tbl.columns[i][row]
+    end
+    return rec
+end
+
+function setRecord(tbl, row, rec)
+    for i, field in ipairs(tbl.fields) do
+        tbl.columns[i][row] = rec[field.name]
+    end
+end
+
+-- Returns the row of the new record
+function addRecord(tbl, rec)
+    local row = tbl.count + 1
+    setRecord(tbl, row, rec)
+    tbl.count = row
+    return row
+end
+
+-- Inserts rec so that it becomes the given row, and moves all subsequent records up one
+function insertRecord(tbl, row, rec)
+    local count = tbl.count
+    for i, field in ipairs(tbl.fields) do
+        local column = tbl.columns[i]
+        table.move(column, row, count, row + 1)
+        column[row] = rec[field.name]
+    end
+    tbl.count = count + 1
+end
+
+function removeRecord(tbl, row)
+    local count = tbl.count
+    for _, column in ipairs(tbl.columns) do
+        -- Not table.remove, because columns of unrepresentable fields are empty so the length of a column can't be
+        -- relied on
+        table.move(column, row + 1, count, row)
+        column[count] = nil
+    end
+    tbl.count = count - 1
+end
+
+-- Binary databases don't read the records of a table until they're first needed (see Db:loadBinary()), at which point
+-- requireRecords() calls tbl.loader to read them. If that takes the total size of all such tables over
+-- tableMemoryBudget (measured in values, ie records * fields), tables which haven't been modified and which aren't the
+-- current table of their Db are unloaded again, to be reread from the file if they're ever needed again.
+--
+-- The loaders hold on to the file data (or the native store, which has its own copy of it), so once every table of a
+-- Db is loaded they are dropped to free it. Those tables then stay loaded, since there'd be nothing to reread them from.
+tableMemoryBudget = 1024 * 1024
+
+local loadedTables = setmetatable({}, { __mode = "k" }) -- Maps loaded table to owning Db
+
+local function tableSize(tbl)
+    return tbl.count * #tbl.fields
+end
+
+local function unloadTable(tbl)
+    for i, field in ipairs(tbl.fields) do
+        local column = {}
+        tbl.columns[i] = column
+        tbl.columns[field.name] = column
+    end
+    tbl.count = 0
+    tbl.indexes = nil
+    tbl.trigrams = nil
+    tbl.unloaded = true
+    loadedTables[tbl] = nil
+end
+
 local Db = {
     path = nil,
     modified = false,
@@ -63,16 +165,358 @@ local Db = {
     currentTable = nil,
     pos = nil,
     currentView = nil, -- Array of indexes into currentTable. Might be a different order than currentTable if ORDER BY is in effect.
-    preTransactionTable = nil, -- Clone of currentTable taken by beginTransaction()
-    preTransactionView = nil, -- Clone of currentView
+    viewPositions = nil, -- Inverse of currentView, built by findField() and reset whenever currentView changes
+    undoLog = nil, -- During a transaction, the changes needed to undo it (see Db:logUndo())
     inAppendUpdate = false, -- Prevents Insert/Modify
     inInsert = false,
     inInsertModify = false, -- Prevents Append/Update
+    journal = nil, -- Array of journal entries (see makeJournalEntry) not yet written to disk
+    preTransactionJournalLen = nil,
+    needsSnapshot = true, -- If true, the next save must rewrite the whole file rather than appending the journal
+    snapshotSize = 0, -- Size of the file as of the last full save
+    journalSize = 0, -- Amount of journal written since then
+    binary = nil, -- Set to the store info if the database was loaded from (and so should be saved as) a binary file
+    opaqueFields = false, -- Set if binary has fields OPL can't represent, whose values can't be saved (see saveBinary)
+    saving = false,
 }
 Db.__index = Db
 
+-- Text databases are saved by appending a journal of record-level changes to the end of the file, which is replayed
+-- by loadText(). Each entry is a single line of the form:
+--
+--     :J <crc> <op>\t<table>\t<index>[\t<field>=<value>...]
+--
+-- where op is A (append), U (update record at index) or D (delete record at index), and crc is the CRC16 of everything
+-- after it on the line. Entries which fail the CRC (for example because we crashed part way through writing one) and
+-- anything after them are ignored. Once the journal grows bigger than the rest of the file, the whole thing is
+-- rewritten as a new snapshot (see Runtime:saveDb()).
+--
+-- The first entry after a snapshot is preceded by the KJournalMarker line, which carries the journal format version.
+-- Builds from before the journal existed fail to load any file containing it ("Field not found"), rather than
+-- silently ignoring some of the entries, and this build likewise refuses a marker with a version it doesn't know.
+--
+-- Binary databases can't be appended to like that, so their journal is kept in a sidecar file alongside (see
+-- Db:getJournalPath()) which is replayed by Runtime:newDb(), and folded back in to the binary file (and the sidecar
+-- deleted) whenever the database is rewritten in full.
+KMinCompactionSize = 16 * 1024
+KJournalSuffix = ".jnl"
+KJournalMarker = ":JOURNAL=1"
+
+-- Returns v as it is written to the file. Reals are given as many digits as they need to read back exactly, since
+-- tostring() only manages 14.
+local function encodeValue(field, v)
+    if field.type == DataTypes.EString then
+        return hexEscape(v)
+    elseif math.type(v) ~= "float" then
+        return tostring(v)
+    end
+    local result = string.format("%.15g", v)
+    if tonumber(result) ~= v then
+        result = string.format("%.17g", v)
+    end
+    if result:match("^-?%d+$") then
+        -- So that it's still a float when it's read back in
+        result = result..".0"
+    end
+    return result
+end
+
+function makeJournalEntry(op, tbl, index, rec)
+    local parts = { op, hexEscape(tbl.name), tostring(index or 0) }
+    if rec then
+        for _, field in ipairs(tbl.fields) do
+            local v = rec[field.name]
+            if field.type and v ~= nil then
+                table.insert(parts, string.format("%s=%s", hexEscape(field.name), encodeValue(field, v)))
+            end
+        end
+    end
+    local payload = table.concat(parts, "\t")
+    return string.format(":J %04X %s\n", crc.crc16(payload), payload)
+end
+
+-- Each table can have sort indexes, which are built the first time a view is opened with a particular ORDER BY (see
+-- Db:getIndex()). An index is an array of record indexes into the table in sort order, stored in tbl.indexes keyed by
+-- the canonical form of its sort spec (see indexName()). Indexes are kept up to date as records are appended, updated
+-- and deleted, so opening another view with the same ordering doesn't need to sort the table again. Text databases
+-- save each index after the table's records as a single line of the form:
+--
+--     :INDEX <name>\t<record index>...
+--
+-- Creating an index doesn't by itself cause the file to be rewritten; it's written out with the next snapshot, and
+-- until then just gets rebuilt if the database is reopened.
+
+local function indexName(sortSpec)
+    local parts = {}
+    for i, sortField in ipairs(sortSpec) do
+        parts[i] = string.format("%s %s", sortField.name, sortField.ascending and "ASC" or "DESC")
+    end
+    return table.concat(parts, ",")
+end
+
+-- Returns true if record lidx sorts before record ridx. Records which compare equal are ordered by their position in
+-- the table, so that there is only ever one correct order for an index.
+local function indexLess(tbl, index, lidx, ridx)
+    local columns = tbl.columns
+    for _, sortField in ipairs(index.spec) do
+        local column = columns[sortField.name]
+        local l, r
+        if column then
+            l, r = column[lidx], column[ridx]
+        end
+        if l ~= r then
+            if sortField.ascending then
+                return l < r
+            else
+                return l > r
+            end
+        end
+    end
+    return lidx < ridx
+end
+
+local function newIndex(tbl, sortSpec)
+    local index = {
+        name = indexName(sortSpec),
+        spec = sortSpec,
+    }
+    for i = 1, tbl.count do
+        index[i] = i
+    end
+    table.sort(index, function(lidx, ridx) return indexLess(tbl, index, lidx, ridx) end)
+    return index
+end
+
+local function indexInsert(tbl, index, recordIndex)
+    local lo, hi = 1, #index + 1
+    while lo < hi do
+        local mid = (lo + hi) // 2
+        if indexLess(tbl, index, recordIndex, index[mid]) then
+            hi = mid
+        else
+            lo = mid + 1
+        end
+    end
+    table.insert(index, lo, recordIndex)
+end
+
+-- If renumber is set, the record is being removed from the table so any later records are shifted down one.
+local function indexRemove(index, recordIndex, renumber)
+    local pos
+    for i, idx in ipairs(index) do
+        if idx == recordIndex then
+            pos = i
+        elseif renumber and idx > recordIndex then
+            index[i] = idx - 1
+        end
+    end
+    table.remove(index, assert(pos, "Record missing from index"))
+end
+
+-- Tables can also have a trigram index over the (lower-cased) contents of all their string fields, which is built the
+-- first time Db:findField() is used on the table. tbl.trigrams maps each three-character substring to the set of rows
+-- containing it, so that findField() only has to check the records containing every trigram of the text being searched
+-- for. The index may contain rows that no longer match, but never omits any that do.
+
+local function addTrigrams(trigrams, tbl, row)
+    for i, field in ipairs(tbl.fields) do
+        local text = field.type == DataTypes.EString and tbl.columns[i][row]
+        if text and #text >= 3 then
+            text = text:lower()
+            for j = 1, #text - 2 do
+                local trigram = text:sub(j, j + 2)
+                local rows = trigrams[trigram]
+                if rows == nil then
+                    rows = {}
+                    trigrams[trigram] = rows
+                end
+                rows[row] = true
+            end
+        end
+    end
+end
+
+local function getTrigrams(tbl)
+    if tbl.trigrams == nil then
+        tbl.trigrams = {}
+        for row = 1, tbl.count do
+            addTrigrams(tbl.trigrams, tbl, row)
+        end
+    end
+    return tbl.trigrams
+end
+
+-- Returns the set of rows of tbl which might match glob, or nil if glob doesn't have any literal parts long enough for
+-- the trigram index to help.
+local function trigramCandidates(tbl, glob)
+    local result
+    for literal in glob:lower():gmatch("[^*?]+") do
+        for j = 1, #literal - 2 do
+            local rows = getTrigrams(tbl)[literal:sub(j, j + 2)]
+            if rows == nil then
+                return {}
+            elseif result == nil then
+                result = rows
+            else
+                local intersection = {}
+                for row in pairs(result) do
+                    if rows[row] then
+                        intersection[row] = true
+                    end
+                end
+                result = intersection
+            end
+        end
+    end
+    return result
+end
+
+-- Must be called after the corresponding change to tbl. op is as per makeJournalEntry, and for "A" recordIndex is the
+-- index of the new record. Additionally op "I" means a record has been inserted at recordIndex (by undoing a delete).
+local function updateIndexes(tbl, op, recordIndex)
+    if tbl.trigrams and (op == "D" or op == "I") then
+        -- Renumbering every row in the trigram index would cost about as much as rebuilding it if it's needed again
+        tbl.trigrams = nil
+    elseif tbl.trigrams then
+        -- For "U" this leaves behind the trigrams of the old values, which just means the record might get checked
+        -- unnecessarily
+        addTrigrams(tbl.trigrams, tbl, recordIndex)
+    end
+    if tbl.indexes == nil then
+        return
+    end
+    for _, index in pairs(tbl.indexes) do
+        if op == "A" then
+            indexInsert(tbl, index, recordIndex)
+        elseif op == "U" then
+            indexRemove(index, recordIndex, false)
+            indexInsert(tbl, index, recordIndex)
+        elseif op == "D" then
+            indexRemove(index, recordIndex, true)
+        elseif op == "I" then
+            for i, idx in ipairs(index) do
+                if idx >= recordIndex then
+                    index[i] = idx + 1
+                end
+            end
+            indexInsert(tbl, index, recordIndex)
+        end
+    end
+end
+
+-- Returns nil if the line doesn't describe a valid index for tbl, for example because the file was edited by something
+-- that didn't know about indexes.
+local function parseIndex(tbl, name, keys)
+    local spec = {}
+    for part in name:gmatch("[^,]+") do
+        local fieldName, order = part:match("^(.+) (%u+)$")
+        if not tbl.fields[fieldName] or (order ~= "ASC" and order ~= "DESC") then
+            return nil
+        end
+        table.insert(spec, { name = fieldName, ascending = order == "ASC" })
+    end
+    local index = {
+        name = indexName(spec),
+        spec = spec,
+    }
+    local seen = {}
+    for key in keys:gmatch("%d+") do
+        local recordIndex = tonumber(key)
+        if recordIndex < 1 or recordIndex > tbl.count or seen[recordIndex] then
+            return nil
+        end
+        seen[recordIndex] = true
+        table.insert(index, recordIndex)
+    end
+    if #index ~= tbl.count or index.name ~= name then
+        return nil
+    end
+    return index
+end
+
+-- Returns false if the entry is corrupt
+local function applyJournalEntry(tables, line)
+    local checksum, payload = line:match("^:J (%x%x%x%x) (.*)$")
+    if not checksum or tonumber(checksum, 16) ~= crc.crc16(payload) then
+        return false
+    end
+    local parts = {}
+    for part in payload:gmatch("[^\t]+") do
+        table.insert(parts, part)
+    end
+    local op, tableName, index = parts[1], hexUnescape(parts[2] or ""), tonumber(parts[3])
+    local tbl = tables[tableName]
+    if not tbl or not index then
+        return false
+    end
+    local rec
+    if op == "A" or op == "U" then
+        rec = {}
+        for i = 4, #parts do
+            local k, v = parts[i]:match("([^=]+)=(.*)")
+            local field = k and tbl.fields[hexUnescape(k)]
+            if not field then
+                return false
+            end
+            if field.type == DataTypes.EString then
+                rec[field.name] = hexUnescape(v)
+            else
+                rec[field.name] = tonumber(v)
+            end
+        end
+    end
+    local valid = index >= 1 and index <= tbl.count
+    if op == "A" then
+        index = addRecord(tbl, rec)
+    elseif op == "U" and valid then
+        setRecord(tbl, index, rec)
+    elseif op == "D" and valid then
+        removeRecord(tbl, index)
+    else
+        return false
+    end
+    updateIndexes(tbl, op, index)
+    return true
+end
+
 function new(path, readonly)
-    return setmetatable({ path = path, tables = {}, writeable = not readonly }, Db)
+    return setmetatable({ path = path, tables = {}, writeable = not readonly, journal = {} }, Db)
+end
+
+-- Makes sure the records of tbl have been loaded, and returns tbl.
+function Db:requireRecords(tbl)
+    if not tbl.unloaded then
+        return tbl
+    end
+    tbl.unloaded = nil
+    tbl.loader()
+    loadedTables[tbl] = self
+
+    local total = 0
+    for loadedTbl in pairs(loadedTables) do
+        total = total + tableSize(loadedTbl)
+    end
+    for loadedTbl, db in pairs(loadedTables) do
+        if total <= tableMemoryBudget then
+            break
+        end
+        if loadedTbl ~= tbl and loadedTbl.loader and not loadedTbl.dirty and loadedTbl ~= db.currentTable
+            and not db.saving then
+            total = total - tableSize(loadedTbl)
+            unloadTable(loadedTbl)
+        end
+    end
+
+    local allLoaded = true
+    for _, dbTbl in ipairs(self.tables) do
+        allLoaded = allLoaded and not dbTbl.unloaded
+    end
+    if allLoaded then
+        for _, dbTbl in ipairs(self.tables) do
+            dbTbl.loader = nil
+        end
+    end
+    return tbl
 end
 
 function Db:newView()
@@ -89,6 +533,11 @@ function Db:getPath(path)
     return self.path
 end
 
+-- Returns the path of the file that journal entries are appended to, which is the database itself for text databases.
+function Db:getJournalPath()
+    return self.binary and self.path..KJournalSuffix or self.path
+end
+
 function Db:currentVarsToRecord()
     -- Turn all the vars into a record mapping names and default initialising anything not in the view
     local result = {}
@@ -117,7 +566,7 @@ local function oplValidField(tbl, index)
     error("Index not found")
 end
 
-function Db:setView(tableName, fieldNames, variables, filterPredicate, sortSpec)
+function Db:setView(tableName, fieldNames, variables, filter, sortSpec)
     -- tableName and fieldNames are not guaranteed to be the correct case, so fix them up now (sigh).
     if self.tables[tableName] == nil then
         local nameLower = tableName:lower()
@@ -131,6 +580,7 @@ function Db:setView(tableName, fieldNames, variables, filterPredicate, sortSpec)
 
     local tbl = self.tables[tableName]
     assert(tbl, "No such tableName "..tableName)
+    self:requireRecords(tbl)
 
     if fieldNames and #fieldNames == 1 and fieldNames[1] == "*" then
         -- Equivalent to all the fields in the table, in order
@@ -154,6 +604,20 @@ function Db:setView(tableName, fieldNames, variables, filterPredicate, sortSpec)
         end
     end
 
+    if sortSpec then
+        for _, sortField in ipairs(sortSpec) do
+            if tbl.fields[sortField.name] == nil then
+                local lowerName = sortField.name:lower()
+                for _, field in ipairs(tbl.fields) do
+                    if field.name:lower() == lowerName then
+                        sortField.name = field.name
+                        break
+                    end
+                end
+            end
+        end
+    end
+
     assert(fieldNames == nil or #fieldNames == #variables, KErrInvalidArgs)
     local map = {}
     for i, var in ipairs(variables) do
@@ -170,50 +634,55 @@ function Db:setView(tableName, fieldNames, variables, filterPredicate, sortSpec)
     self.currentTable = tbl
     self.varMap = map
 
-    -- Construct the view on the table. Without a filterPredicate ("WHERE") or sortSpec ("ORDER BY") this is a
-    -- one-to-one mapping to the table records.
-    local view = {}
-    for i = 1, #tbl do
-        if filterPredicate then
-            -- For the purposes of predicate evaluation, all field names must be upper cased (because of reusing the
-            -- compiler.lua parser which uppercases all identifiers)
-            local rec = {}
-            for k, v in pairs(tbl[i]) do
-                rec[k:upper()] = v
-            end
-            if filterPredicate(rec) then
-                table.insert(view, i)
-            end
+    -- Construct the view on the table. Without a filter ("WHERE") or sortSpec ("ORDER BY") this is a one-to-one mapping
+    -- to the table records. With a sortSpec, the records are visited in the order given by the table's index for it, so
+    -- there's no need to sort anything unless this is the first time the index is used. If part of the filter can be
+    -- answered by an index, only the records in the matching range of that index need to be checked.
+    local order = sortSpec and self:getIndex(tbl, sortSpec)
+    local predicate = filter and compileWhere(filter, tbl)
+    local source, first, last = order, 1, tbl.count
+    if predicate then
+        local index, lo, hi = whereIndexRange(tbl, filter, order)
+        if index == nil then
+            -- Nothing for it but to check every record
+        elseif index == order then
+            first, last = lo, hi
         else
-            view[i] = i
+            -- The view must still be in table order
+            source = table.move(index, lo, hi, 1, {})
+            table.sort(source)
+            first, last = 1, #source
         end
     end
-    if sortSpec then
-        table.sort(view, function(lidx, ridx)
-            local lhs = tbl[lidx]
-            local rhs = tbl[ridx]
-            for _, sortField in ipairs(sortSpec) do
-                local fieldName = sortField.name
-                if lhs[fieldName] == rhs[fieldName] then
-                    -- Keep going
-                else
-                    if sortField.ascending then
-                        return lhs[fieldName] < rhs[fieldName]
-                    else
-                        return lhs[fieldName] > rhs[fieldName]
-                    end
-                end
-            end
-            -- If we get here, all fields a tie
-            return false
-        end)
+    local view = {}
+    for i = first, last do
+        local recordIndex = source and source[i] or i
+        if predicate == nil or predicate(recordIndex) then
+            view[#view + 1] = recordIndex
+        end
     end
 
     self.currentView = view
+    self.viewPositions = nil
 
     self:setPos(1)
 end
 
+-- Returns the index of tbl which is sorted according to sortSpec, building it if this is the first time it's been
+-- asked for.
+function Db:getIndex(tbl, sortSpec)
+    if tbl.indexes == nil then
+        tbl.indexes = {}
+    end
+    local name = indexName(sortSpec)
+    local index = tbl.indexes[name]
+    if index == nil then
+        index = newIndex(tbl, sortSpec)
+        tbl.indexes[name] = index
+    end
+    return index
+end
+
 -- pos is an index into currentView, not directly into currentTable.
 function Db:setPos(pos)
     if pos < 0 then
@@ -226,11 +695,12 @@ function Db:setPos(pos)
     end
     self:resetInsertState()
     self.currentVars = self:newView()
-    local rec = self.currentTable[self.currentView[pos]]
-    if rec then
+    local row = self.currentView[pos]
+    if row then
+        local columns = self.currentTable.columns
         for varName, field in pairs(self.varMap) do
-            -- printf("varname %s -> fieldname %s = %s\n", varName, field.name, rec[field.name])
-            self.currentVars[varName](rec[field.name])
+            -- printf("varname %s -> fieldname %s = %s\n", varName, field.name, columns[field.name][row])
+            self.currentVars[varName](columns[field.name][row])
         end
     end
 end
@@ -250,25 +720,25 @@ function Db:getCurrentVal(name)
 end
 
 function Db:inTransaction()
-    return self.preTransactionTable ~= nil
+    return self.undoLog ~= nil
 end
 
 function Db:beginTransaction()
     assert(not self:inTransaction(), "In transaction")
-    self.preTransactionTable = {
-        name = self.currentTable.name,
-        fields = self.currentTable.fields,
-    }
-    for i, record in ipairs(self.currentTable) do
-        local recCopy = {}
-        for k, v in pairs(record) do
-            recCopy[k] = v
-        end
-        self.preTransactionTable[i] = recCopy
-    end
-    self.preTransactionView = {}
-    for i, index in ipairs(self.currentView) do
-        self.preTransactionView[i] = index
+    self.undoLog = {}
+    self.preTransactionJournalLen = #self.journal
+end
+
+-- Records what's needed to undo a change to currentTable, which must be called before the change is made. op is as per
+-- makeJournalEntry, and for "D" pos is the position in currentView of the record being deleted.
+function Db:logUndo(op, row, pos)
+    if self.undoLog then
+        table.insert(self.undoLog, {
+            op = op,
+            row = row,
+            rec = op ~= "A" and getRecord(self.currentTable, row) or nil,
+            pos = pos,
+        })
     end
 end
 
@@ -277,12 +747,37 @@ function Db:endTransaction(commit)
     -- editing a record; you can only commit/rollback complete records.
     assert(self:inTransaction() and not self.inInsertModify and not self.inAppendUpdate, "Not in transaction")
     if not commit then
-        self.currentTable = self.preTransactionTable
-        self.tables[self.currentTable.name] = self.currentTable
-        self.currentView = self.preTransactionView
+        local tbl = self.currentTable
+        local view = self.currentView
+        for i = #self.undoLog, 1, -1 do
+            local entry = self.undoLog[i]
+            if entry.op == "A" then
+                -- Undoing in reverse order means the appended record is always the last one in both tbl and view
+                removeRecord(tbl, entry.row)
+                updateIndexes(tbl, "D", entry.row)
+                table.remove(view)
+            elseif entry.op == "U" then
+                setRecord(tbl, entry.row, entry.rec)
+                updateIndexes(tbl, "U", entry.row)
+            elseif entry.op == "D" then
+                insertRecord(tbl, entry.row, entry.rec)
+                updateIndexes(tbl, "I", entry.row)
+                for j, row in ipairs(view) do
+                    if row >= entry.row then
+                        view[j] = row + 1
+                    end
+                end
+                table.insert(view, entry.pos, entry.row)
+            end
+        end
+        self.viewPositions = nil
+        -- Nothing is saved during a transaction so the changes can simply be dropped from the journal
+        for i = #self.journal, self.preTransactionJournalLen + 1, -1 do
+            self.journal[i] = nil
+        end
     end
-    self.preTransactionTable = nil
-    self.preTransactionView = nil
+    self.undoLog = nil
+    self.preTransactionJournalLen = nil
 end
 
 function Db:resetInsertState()
@@ -316,11 +811,21 @@ function Db:put()
     if self.inInsert then
         -- Inserts still always insert the new record at the end of the file/view
         local newPos = #self.currentView + 1
-        table.insert(self.currentTable, self:currentVarsToRecord())
-        self.currentView[newPos] = newPos
+        local rec = self:currentVarsToRecord()
+        self:logUndo("A", self.currentTable.count + 1)
+        local row = addRecord(self.currentTable, rec)
+        updateIndexes(self.currentTable, "A", row)
+        self:addJournalEntry("A", nil, rec)
+        self.currentView[newPos] = row
+        self.viewPositions = nil
         self:setPos(newPos)
     else
-        self.currentTable[self.currentView[self.pos]] = self:currentVarsToRecord()
+        local recordIndex = self.currentView[self.pos]
+        local rec = self:currentVarsToRecord()
+        self:logUndo("U", recordIndex)
+        setRecord(self.currentTable, recordIndex, rec)
+        updateIndexes(self.currentTable, "U", recordIndex)
+        self:addJournalEntry("U", recordIndex, rec)
     end
     self.inInsertModify = false
 end
@@ -332,6 +837,10 @@ end
 function Db:setModified()
     assert(self.writeable, KErrWrite)
     self.modified = true
+    if self.currentTable then
+        -- Means it mustn't ever be unloaded
+        self.currentTable.dirty = true
+    end
 end
 
 function Db:getPos()
@@ -351,19 +860,66 @@ function Db:isModified()
     return self.modified
 end
 
+function Db:addJournalEntry(op, index, rec)
+    table.insert(self.journal, makeJournalEntry(op, self.currentTable, index, rec))
+end
+
+-- Returns the journal entries that need appending to the file, or nil if a full save is required instead. Either way,
+-- the caller must then call didSave(), or restoreJournal() if the entries couldn't be written.
+function Db:takeJournal()
+    local compact = self.journalSize > math.max(self.snapshotSize, KMinCompactionSize)
+    if self.needsSnapshot or compact then
+        return nil
+    end
+    local result = table.concat(self.journal)
+    self.journal = {}
+    if self.journalSize == 0 and #result > 0 then
+        result = KJournalMarker.."\n"..result
+    end
+    return result
+end
+
+-- Puts back entries from takeJournal() that failed to be appended. Since it isn't known how much of them (or of any
+-- earlier append still queued) made it to the file, the next save has to be a full one.
+function Db:restoreJournal(entries)
+    self.needsSnapshot = true
+    if entries:sub(1, #KJournalMarker + 1) == KJournalMarker.."\n" then
+        entries = entries:sub(#KJournalMarker + 2)
+    end
+    table.insert(self.journal, 1, entries)
+end
+
+function Db:didSave(snapshotSize, journalSize)
+    if snapshotSize then
+        self.snapshotSize = snapshotSize
+        self.journalSize = 0
+        self.needsSnapshot = false
+        self.journal = {}
+    else
+        self.journalSize = self.journalSize + journalSize
+    end
+    self.modified = false
+end
+
 function Db:appendRecord()
     -- inAppendUpdate need not be set here; doing an APPEND without having set any fields at all is permissable
     assert(not self.inInsertModify, "Incompatible update mode")
     self:setModified()
     local newPos = #self.currentView + 1
-    table.insert(self.currentTable, self:currentVarsToRecord())
-    self.currentView[newPos] = newPos
+    local rec = self:currentVarsToRecord()
+    self:logUndo("A", self.currentTable.count + 1)
+    local row = addRecord(self.currentTable, rec)
+    updateIndexes(self.currentTable, "A", row)
+    self:addJournalEntry("A", nil, rec)
+    self.currentView[newPos] = row
+    self.viewPositions = nil
     self:setPos(newPos)
 end
 
 function Db:deleteRecord()
     self:setModified()
     local recordIndex = self.currentView[self.pos]
+    self:logUndo("D", recordIndex, self.pos)
     -- We have to go through the whole of currentView here and update the indexes
     for i, index in ipairs(self.currentView) do
         if index > recordIndex then
@@ -372,7 +928,10 @@ function Db:deleteRecord()
     end
 
     table.remove(self.currentView, self.pos)
-    table.remove(self.currentTable, recordIndex)
+    self.viewPositions = nil
+    removeRecord(self.currentTable, recordIndex)
+    updateIndexes(self.currentTable, "D", recordIndex)
+    self:addJournalEntry("D", recordIndex)
     self:setPos(self.pos)
 end
 
@@ -389,9 +948,17 @@ end
 function Db:load(data)
     self.tables = {}
     self.currentTable = nil
+    self.binary = nil
+    self.opaqueFields = false
     if data:sub(1, 4) == "\x50\x00\x00\x10" then -- KPermanentFileStoreLayoutUid
         -- It's an epoc binary db
         self:loadBinary(data)
+        if self.binary then
+            -- Otherwise it'll be saved as text, which needs a full save
+            self.needsSnapshot = false
+            self.snapshotSize = #data
+            self.journalSize = 0
+        end
     elseif data:sub(1, 15) == "OPLDatabaseFile" then -- Series 3 ODB
         self:loadOdbBinary(data)
     else
@@ -412,14 +979,22 @@ function Db:getTableNames()
 end
 
 function Db:loadText(data)
-    local currentTable, currentRec
+    data = tostring(data) -- In case we were given a mapped buffer
+    local currentTable, currentRow
+    local journalOk = true
     for line in data:gmatch("[^\r\n]+") do
         local tableName = line:match("^:TABLE (.+)")
-        if tableName then
-            currentTable = {
-                name = tableName,
-                fields = {},
-            }
+        if line:match("^:JOURNAL=") then
+            assert(line == KJournalMarker, KErrNotSupported)
+        elseif line:match("^:J ") then
+            if journalOk then
+                journalOk = applyJournalEntry(self.tables, line)
+                if not journalOk then
+                    printf("Db:load(): Ignoring corrupt journal from %s\n", line)
+                end
+            end
+        elseif tableName then
+            currentTable = newTable(tableName)
             table.insert(self.tables, currentTable)
             self.tables[tableName] = currentTable
             if not self.currentTable then
@@ -428,12 +1003,22 @@ function Db:loadText(data)
         elseif line:match("^:FIELD") then
             local type, name = line:match("^:FIELD ([0-9]) (.+)")
             local rawType = assert(OplTypeToFieldType[tonumber(type)])
-            local field = { type = tonumber(type), name = name, rawType = rawType }
-            table.insert(currentTable.fields, field)
-            currentTable.fields[name] = field
+            addField(currentTable, { type = tonumber(type), name = name, rawType = rawType })
         elseif line:match("^:RECORD") then
-            currentRec = {}
-            table.insert(currentTable, currentRec)
+            currentRow = currentTable.count + 1
+            currentTable.count = currentRow
+        elseif line:match("^:INDEX ") then
+            local name, keys = line:match("^:INDEX ([^\t]+)\t?(.*)")
+            local index = name and parseIndex(currentTable, name, keys)
+            if index then
+                if currentTable.indexes == nil then
+                    currentTable.indexes = {}
+                end
+                currentTable.indexes[index.name] = index
+            else
+                -- Not fatal, it'll just get rebuilt next time it's needed
+                printf("Db:load(): Ignoring bad index %s\n", line:sub(1, 80))
+            end
         else
             local k, v = line:match("([^=]+)=(.*)")
             if k then
@@ -443,12 +1028,45 @@ function Db:loadText(data)
                 else
                     v = tonumber(v)
                 end
-                currentRec[k] = v
+                currentTable.columns[k][currentRow] = v
             else
                 printf("Db:load(): Unrecognised line %s\n", line)
             end
         end
     end
+    -- If the journal was bad, make sure the next save rewrites the file so that any subsequent entries aren't lost
+    -- after the bad one.
+    self.needsSnapshot = not journalOk
+    -- The compaction threshold is relative to the snapshot, which doesn't include any journal already in the file
+    local journalStart = data:find("\n"..KJournalMarker.."\n", 1, true) or data:find("\n:J ", 1, true)
+    self.snapshotSize = journalStart or #data
+    self.journalSize = #data - self.snapshotSize
+end
+
+-- Replays the sidecar journal of a binary database (see getJournalPath()).
+function Db:loadJournal(data)
+    data = tostring(data)
+    local ok = true
+    for line in data:gmatch("[^\r\n]+") do
+        if line:match("^:JOURNAL=") then
+            assert(line == KJournalMarker, KErrNotSupported)
+        else
+            -- The tables being changed have to be loaded, and then kept loaded since they no longer match the file
+            local tableName = line:match("^:J %x+ %a\t([^\t]*)")
+            local tbl = tableName and self.tables[hexUnescape(tableName)]
+            if tbl then
+                self:requireRecords(tbl)
+                tbl.dirty = true
+            end
+            ok = applyJournalEntry(self.tables, line)
+            if not ok then
+                printf("Db:loadJournal(): Ignoring corrupt journal from %s\n", line)
+                break
+            end
+        end
+    end
+    self.needsSnapshot = not ok
+    self.journalSize = #data
 end
 
 function Db:save()
@@ -458,6 +1076,7 @@ function Db:save()
         i = i + 1
     end
     for _, tbl in ipairs(self.tables) do
+        self:requireRecords(tbl)
         line(":TABLE %s", tbl.name)
         for _, field in ipairs(tbl.fields) do
             if field.type then
@@ -465,66 +1084,252 @@ function Db:save()
                 line(":FIELD %d %s", field.type, field.name)
             end
         end
-        for _, rec in ipairs(tbl) do
+        for row = 1, tbl.count do
             line(":RECORD")
-            for _, field in ipairs(tbl.fields) do
-                local v = rec[field.name]
-                if field.type == DataTypes.EString then
-                    v = hexEscape(v)
-                end
+            for i, field in ipairs(tbl.fields) do
+                local v = tbl.columns[i][row]
                 if v then
                     -- can be nil for fields OPL can't represent
-                    line("%s=%s", field.name, v)
+                    line("%s=%s", field.name, encodeValue(field, v))
                 end
             end
         end
+        if tbl.indexes then
+            local names = {}
+            for name in pairs(tbl.indexes) do
+                table.insert(names, name)
+            end
+            table.sort(names)
+            for _, name in ipairs(names) do
+                line(":INDEX %s\t%s", name, table.concat(tbl.indexes[name], " "))
+            end
+        end
     end
     line("")
     return table.concat(lines, "\n")
 end
 
-function Db:tocsv(tableName)
+-- Returns the database in the permanent file store format. Only available when the native pfsdb module is.
+function Db:saveBinary()
+    assert(pfsdb, "Saving binary databases is not supported")
+    -- The values of fields that OPL can't represent (such as date/times) aren't loaded, so rewriting the file would
+    -- erase them. Runtime:newDb() doesn't allow such databases to be opened for writing.
+    assert(not self.opaqueFields, KErrNotSupported)
+    -- All the tables have to be loaded at once, so stop requireRecords() unloading any of them
+    self.saving = true
+    local ok, result = pcall(function()
+        for _, tbl in ipairs(self.tables) do
+            self:requireRecords(tbl)
+            for _, field in ipairs(tbl.fields) do
+                if field.rawType == nil then
+                    field.rawType = OplTypeToFieldType[field.type]
+                end
+            end
+        end
+        return pfsdb.save(self.tables, self.binary)
+    end)
+    self.saving = false
+    if not ok then
+        error(result, 0)
+    end
+    return result
+end
+
+KCsvChunkSize = 64 * 1024
+
+local function csvEscape(val, sep)
+    if type(val) == "string" then
+        if val:find('"', 1, true) or val:find(sep, 1, true) or val:match("[\r\n]") then
+            return '"'..val:gsub('"', '""')..'"'
+        else
+            return val
+        end
+    elseif val == nil then
+        return ""
+    else
+        return tostring(val)
+    end
+end
+
+-- Writes the given table as CSV (or using some other separator, such as "\t") by calling write(chunk) with successive
+-- pieces of the output as it walks the records, so that the whole thing never needs to be held in memory. Chunks are
+-- roughly KCsvChunkSize bytes, and each line (including the last) is terminated by "\n".
+function Db:writeCsv(tableName, write, sep)
     if tableName == nil then
         assert(#self.tables == 1, "A table name must be supplied when the database has multiple tables")
         tableName = self.tables[1].name
     end
+    sep = sep or ","
 
     local tbl = self.tables[tableName]
-    assert(tbl, "Table name "..tableName.. "not found")
+    assert(tbl, "Table name "..tableName.." not found")
+    self:requireRecords(tbl)
 
-    local result = {}
+    local chunk, n, size = {}, 0, 0
     local function line(vals)
         local escaped = {}
         for i, val in ipairs(vals) do
-            if type(val) == "string" then
-                if val:match('[",]') then
-                    local escaped = val:gsub('"', '""')
-                    escaped[i] = '"'..escaped..'"'
-                else
-                    escaped[i] = val
-                end
-            else
-                escaped[i] = val
-            end
+            escaped[i] = csvEscape(val, sep)
+        end
+        local str = table.concat(escaped, sep)
+        n = n + 1
+        chunk[n] = str
+        size = size + #str + 1
+        if size >= KCsvChunkSize then
+            n = n + 1
+            chunk[n] = ""
+            write(table.concat(chunk, "\n", 1, n))
+            n, size = 0, 0
         end
-        table.insert(result, table.concat(escaped, ","))
     end
 
     local headings = {}
+    local columns = {}
     for i, field in ipairs(tbl.fields) do
         if field.type then
             table.insert(headings, field.name)
+            table.insert(columns, tbl.columns[i])
         end
     end
     line(headings)
-    for _, record in ipairs(tbl) do
-        local rec = {}
-        for i, fieldName in ipairs(headings) do
-            rec[i] = record[fieldName]
+    local rec = {}
+    for row = 1, tbl.count do
+        for i, column in ipairs(columns) do
+            rec[i] = column[row]
         end
         line(rec)
     end
-    return table.concat(result, "\n")
+    if n > 0 then
+        n = n + 1
+        chunk[n] = ""
+        write(table.concat(chunk, "\n", 1, n))
+    end
+end
+
+function Db:tocsv(tableName, sep)
+    local result = {}
+    self:writeCsv(tableName, function(chunk) table.insert(result, chunk) end, sep)
+    return table.concat(result)
+end
+
+-- Returns an iterator which reads lines by calling nextLine() (for example the result of io.lines()) and returns the
+-- fields of each CSV record in turn, as an array of strings. Quoted fields can contain sep, doubled quotes and line
+-- breaks. Blank lines are skipped.
+function csvRecords(nextLine, sep)
+    sep = sep or ","
+    local function readLine()
+        local line = nextLine()
+        return line and (line:gsub("\r$", ""))
+    end
+    return function()
+        local line = readLine()
+        while line == "" do
+            line = readLine()
+        end
+        if line == nil then
+            return nil
+        end
+        local fields = {}
+        local pos = 1
+        while true do
+            if line:sub(pos, pos) == '"' then
+                local parts = {}
+                pos = pos + 1
+                while true do
+                    local quotePos = line:find('"', pos, true)
+                    if quotePos == nil then
+                        table.insert(parts, line:sub(pos))
+                        table.insert(parts, "\n")
+                        line = readLine()
+                        assert(line, "Unterminated quoted field in CSV data")
+                        pos = 1
+                    elseif line:sub(quotePos + 1, quotePos + 1) == '"' then
+                        table.insert(parts, line:sub(pos, quotePos))
+                        pos = quotePos + 2
+                    else
+                        table.insert(parts, line:sub(pos, quotePos - 1))
+                        pos = quotePos + 1
+                        break
+                    end
+                end
+                table.insert(fields, table.concat(parts))
+                -- Anything between the closing quote and the next separator is ignored
+                local sepPos = line:find(sep, pos, true)
+                if sepPos == nil then
+                    break
+                end
+                pos = sepPos + #sep
+            else
+                local sepPos = line:find(sep, pos, true)
+                if sepPos == nil then
+                    table.insert(fields, line:sub(pos))
+                    break
+                end
+                table.insert(fields, line:sub(pos, sepPos - 1))
+                pos = sepPos + #sep
+            end
+        end
+        return fields
+    end
+end
+
+local csvFieldSuffixes = {
+    ["%"] = DataTypes.EWord,
+    ["&"] = DataTypes.ELong,
+    ["$"] = DataTypes.EString,
+}
+
+local function csvValue(type, str, fieldName)
+    if type == DataTypes.EString then
+        return str
+    elseif str == "" then
+        return 0
+    elseif type == DataTypes.EReal then
+        return assert(tonumber(str), "Bad number for field "..fieldName..": "..str)
+    else
+        return assert(math.tointeger(tonumber(str)), "Bad integer for field "..fieldName..": "..str)
+    end
+end
+
+-- Creates a table called tableName from CSV data read by calling nextLine() until it returns nil (see csvRecords()),
+-- and returns the number of records added. The first record must be a header row naming the fields. If types (an
+-- array of DataTypes) isn't specified, field names ending in %, & or $ are created as word, long or string fields
+-- (with the suffix replaced in the same way as a SIBO-style CREATE) and all others as strings. Records are added
+-- directly to the table, without the journalling that appendRecord() does, so the database must be saved in full
+-- afterwards.
+function Db:importCsv(tableName, nextLine, sep, types)
+    local records = csvRecords(nextLine, sep)
+    local header = assert(records(), "No header row in CSV data")
+    local fieldNames = {}
+    local fieldTypes = {}
+    for i, name in ipairs(header) do
+        local type = types and types[i]
+        if type == nil then
+            local suffix = name:match("[%%&$]$")
+            type = csvFieldSuffixes[suffix] or DataTypes.EString
+            name = name:gsub("[%%&$]$", {
+                ["%"] = "i",
+                ["&"] = "a",
+                ["$"] = "s",
+            })
+        end
+        fieldNames[i] = name
+        fieldTypes[i] = type
+    end
+    self:createTable(tableName, fieldNames, fieldTypes)
+    local tbl = self.tables[tableName]
+    tbl.dirty = true
+
+    local columns = tbl.columns
+    local count = tbl.count
+    for vals in records do
+        count = count + 1
+        for i, type in ipairs(fieldTypes) do
+            columns[i][count] = csvValue(type, vals[i] or "", fieldNames[i])
+        end
+    end
+    tbl.count = count
+    return count
 end
 
 KTableDefinitionHeaderLen = 9
@@ -533,6 +1338,32 @@ KTableDefinitionHeaderLen = 9
 KTocEntryOffset = 0x1E
 
 function Db:loadBinary(data)
+    if pfsdb then
+        local store = pfsdb.open(data)
+        for i, def in ipairs(store:tables()) do
+            local tbl = newTable(def.name)
+            for _, f in ipairs(def.fields) do
+                local oplType = FieldTypeToOplType[f.rawType]
+                addField(tbl, {
+                    type = oplType,
+                    name = f.name,
+                    rawType = f.rawType,
+                    maxLen = f.maxLen,
+                })
+                if oplType == nil then
+                    self.opaqueFields = true
+                end
+            end
+            tbl.unloaded = true
+            tbl.loader = function() store:readRecords(i, tbl) end
+            self.tables[i] = tbl
+            self.tables[tbl.name] = tbl
+        end
+        self.currentTable = self.tables[1]
+        self.binary = store:info()
+        return
+    end
+
     data = depageBinary(data)
     local uid1, uid2, uid3, uidChecksum, pos = string.unpack("<I4I4I4I4", data)
     assert(uid1 == KPermanentFileStoreLayoutUid, "Bad DB UID1 "..tostring(uid1))
@@ -587,13 +1418,13 @@ function Db:loadBinary(data)
         "toc[2] does not appear to point to a table definition")
     self:readTableDefinition(data, toc[2] + KTableDefinitionHeaderLen)
 
-    for i = 1, #self.tables do
-        self:loadTable(data, toc, i)
+    for _, tbl in ipairs(self.tables) do
+        tbl.unloaded = true
+        tbl.loader = function() self:loadTable(data, toc, tbl) end
     end
 end
 
-function Db:loadTable(data, toc, tableIndex)
-    local tbl = self.tables[tableIndex]
+function Db:loadTable(data, toc, tbl)
     local dataSection = tbl.dataIndex
 
     -- Now iterate through the chain of data sections
@@ -636,7 +1467,7 @@ function Db:loadTable(data, toc, tableIndex)
                 local bit = 0
                 while bit < 8 do
                     if fieldMask & (1 << bit) ~= 0 then
-                        local field = assert(self.currentTable.fields[1 + fieldIdx + bit])
+                        local field = assert(tbl.fields[1 + fieldIdx + bit])
                         local val
                         if field.type == DataTypes.EWord then
                             val, pos = string.unpack("<i2", data, pos)
@@ -689,7 +1520,7 @@ function Db:loadTable(data, toc, tableIndex)
                     rec[member.name] = DefaultSimpleTypes[member.type]
                 end
             end
-            table.insert(tbl, rec)
+            addRecord(tbl, rec)
         end
         dataSection = nextSectionIndex
     end
@@ -706,10 +1537,7 @@ function Db:readTableDefinition(data, pos)
     for i = 1, numTables do
         local tableName, numFields
         tableName, pos = readVarLengthString(data, pos)
-        local tbl = {
-            name = tableName,
-            fields = {},
-        }
+        local tbl = newTable(tableName)
         numFields, pos = readCardinality(data, pos)
         for _ = 1, numFields do
             local fieldName
@@ -722,9 +1550,7 @@ function Db:readTableDefinition(data, pos)
                 pos = pos + 1 -- Skip over maxLen
             end
 
-            local field = { type = oplType, name = fieldName, rawType = type }
-            table.insert(tbl.fields, field)
-            tbl.fields[fieldName] = field
+            addField(tbl, { type = oplType, name = fieldName, rawType = type })
         end
         local dataIndex
         dataIndex, pos = string.unpack("<xI4x", data, pos)
@@ -741,19 +1567,15 @@ function Db:createTable(tableName, fieldNames, types)
         error(KErrExists)
     end
     self:setModified()
-    local fields = {}
+    self.needsSnapshot = true
     assert(#fieldNames == #types, "fieldNames and types length mismatch!")
+    local tbl = newTable(tableName)
     for i, fieldName in ipairs(fieldNames) do
-        fields[i] = {
+        addField(tbl, {
             name = fieldName,
             type = types[i],
-        }
-        fields[fieldName] = fields[i]
+        })
     end
-    local tbl = {
-        name = tableName,
-        fields = fields,
-    }
     table.insert(self.tables, tbl)
     self.tables[tableName] = tbl
 end
@@ -765,6 +1587,7 @@ function Db:deleteTable(tableName)
         if tbl.name == tableName then
             table.remove(self.tables, i)
             self.tables[tableName] = nil
+            self.needsSnapshot = true
             return
         end
     end
@@ -887,9 +1710,9 @@ function parseTableSpec(spec)
 
     local tableName = query.FROM or query.TO or "Table1"
 
-    local filterPredicate
+    local filter
     if query.WHERE then
-        filterPredicate = parseWhere(query.WHERE)
+        filter = parseWhereExpression(query.WHERE)
     end
 
     local sortSpec
@@ -914,7 +1737,7 @@ function parseTableSpec(spec)
         end
     end
 
-    return filename, tableName, fieldNames, filterPredicate, sortSpec
+    return filename, tableName, fieldNames, filter, sortSpec
 end
 
 -- Database files appear to have some sort of paging scheme whereby 2 extra bytes are inserted every 0x4000 bytes,
@@ -936,10 +1759,10 @@ local function globToMatch(glob)
     return "^" .. m .. "$"
 end
 
-local function recordContains(tbl, record, matchText, firstField, lastField, caseSensitive)
+local function recordContains(tbl, row, matchText, firstField, lastField, caseSensitive)
     for i, field in ipairs(tbl.fields) do
-        local fieldValue = record[field.name]
-        if i >= firstField and i <= lastField and field.type == FieldTypes.Text then
+        local fieldValue = tbl.columns[i][row]
+        if i >= firstField and i <= lastField and field.type == DataTypes.EString then
             if caseSensitive and fieldValue:match(matchText) then
                 return true
             elseif not caseSensitive and fieldValue:lower():match(matchText) then
@@ -950,16 +1773,23 @@ local function recordContains(tbl, record, matchText, firstField, lastField, cas
     return false
 end
 
+function Db:getViewPositions()
+    if self.viewPositions == nil then
+        self.viewPositions = {}
+        for pos, row in ipairs(self.currentView) do
+            self.viewPositions[row] = pos
+        end
+    end
+    return self.viewPositions
+end
+
 function Db:findField(text, start, num, flags)
+    local tbl = self.currentTable
     local matchText = globToMatch(text)
-    local lastField = num == nil and #self.currentTable.fields or start + num
+    local lastField = num == nil and #tbl.fields or start + num - 1
 
-    local inc
-    if (flags & KFindForwards) ~= 0 then
-        inc = 1
-    else
-        inc = -1
-    end
+    local forwards = (flags & KFindForwards) ~= 0
+    local inc = forwards and 1 or -1
 
     local count = #self.currentView
     local pos
@@ -976,9 +1806,30 @@ function Db:findField(text, start, num, flags)
         matchText = matchText:lower()
     end
 
+    local candidates = trigramCandidates(tbl, text)
+    if candidates then
+        -- Rather than checking every record in the view, check just the ones that might match, in the order they
+        -- appear in the view.
+        local viewPositions = self:getViewPositions()
+        local positions = {}
+        for row in pairs(candidates) do
+            local candidatePos = viewPositions[row]
+            if candidatePos and (candidatePos - pos) * inc >= 0 then
+                table.insert(positions, candidatePos)
+            end
+        end
+        table.sort(positions, function(a, b) return a * inc < b * inc end)
+        for _, candidatePos in ipairs(positions) do
+            if recordContains(tbl, self.currentView[candidatePos], matchText, start, lastField, caseSensitive) then
+                self:setPos(candidatePos)
+                return candidatePos
+            end
+        end
+        return 0
+    end
+
     while pos <= count and pos > 0 do
-        local record = self.currentTable[self.currentView[pos]]
-        if recordContains(self.currentTable, record, matchText, start, lastField, caseSensitive) then
+        if recordContains(tbl, self.currentView[pos], matchText, start, lastField, caseSensitive) then
             self:setPos(pos)
             return pos
         end
@@ -1057,7 +1908,9 @@ sqlWhereLang = {
 }
 
 
-function parseWhere(str)
+-- Returns the expression tree for a WHERE clause. Identifiers in it will be upper cased, because of reusing the
+-- compiler.lua parser which uppercases all identifiers.
+function parseWhereExpression(str)
     local compiler = require("compiler")
     -- print(dump(compiler.lex(str, nil, sqlWhereLang)))
     local tokens = compiler.lex(str, nil, sqlWhereLang)
@@ -1070,79 +1923,245 @@ function parseWhere(str)
         end
     end
 
-    local exp = compiler.parseUntypedExpression(compiler.lex(str, nil, sqlWhereLang))
+    local exp = compiler.parseUntypedExpression(tokens)
     assert(exp.op, "Expected op!")
-    
-    -- Expressions are converted to a function which evaluates against an env. This technically accepts a bunch of
-    -- things that wouldn't be legal SQL but we don't care.
-    local function evalExpression(exp)
+    return exp
+end
+
+-- Returns true plus the value if exp is a literal
+local function whereConstant(exp)
+    if exp.type == "number" then
+        local _, val = require("compiler").literalToNumber(exp.val)
+        return true, val
+    elseif exp.type == "string" then
+        return true, (assert(exp.val:match("^'(.*)'$")):gsub("''", "'"))
+    else
+        return false
+    end
+end
+
+local flippedComparisons = {
+    eq = "eq",
+    neq = "neq",
+    lt = "gt",
+    le = "ge",
+    gt = "lt",
+    ge = "le",
+}
+
+-- If exp compares a field with a literal, returns the field identifier, the comparison op and the literal value, with
+-- the op flipped if necessary so that it reads as <identifier> <op> <value>.
+local function whereComparison(exp)
+    local op = exp.op
+    if not flippedComparisons[op] then
+        return nil
+    end
+    local lhs, rhs = exp[1], exp[2]
+    if lhs.type == "identifier" then
+        local isConstant, value = whereConstant(rhs)
+        if isConstant then
+            return lhs.val, op, value
+        end
+    elseif rhs.type == "identifier" then
+        local isConstant, value = whereConstant(lhs)
+        if isConstant then
+            return rhs.val, flippedComparisons[op], value
+        end
+    end
+    return nil
+end
+
+local function whereField(tbl, identifier)
+    for _, field in ipairs(tbl.fields) do
+        if field.name:upper() == identifier then
+            return field
+        end
+    end
+    return nil
+end
+
+-- Converts a WHERE expression into a function which takes a row of tbl and returns whether that record matches. Field
+-- names are resolved to columns when the expression is compiled, so evaluating it doesn't involve any lookups by name.
+-- This technically accepts a bunch of things that wouldn't be legal SQL but we don't care.
+function compileWhere(exp, tbl)
+    local function fieldColumn(identifier)
+        local field = whereField(tbl, identifier)
+        -- An unknown field evaluates to nil, as it always has
+        return field and tbl.columns[field.name] or {}
+    end
+
+    local function compile(exp)
         local op = exp.op
-        if op then
-            local lhs = evalExpression(exp[1])
-            local rhs = evalExpression(exp[2])
-            local function dbg(fn)
-                -- return function(env)
-                --     printf("%s %s %s\n", op, lhs(env), rhs(env))
-                --     return fn(env)
-                -- end
-                return fn
+        local identifier, cmp, value = whereComparison(exp)
+        if identifier then
+            -- The common case of a field compared against a literal, which can be evaluated without any further calls
+            local column = fieldColumn(identifier)
+            if cmp == "eq" then
+                return function(row) return column[row] == value end
+            elseif cmp == "neq" then
+                return function(row) return column[row] ~= value end
+            elseif cmp == "lt" then
+                return function(row) return column[row] < value end
+            elseif cmp == "le" then
+                return function(row) return column[row] <= value end
+            elseif cmp == "gt" then
+                return function(row) return column[row] > value end
+            elseif cmp == "ge" then
+                return function(row) return column[row] >= value end
             end
+        elseif op == "LIKE" or op == "NOT_LIKE" then
+            local lhs = compile(exp[1])
+            local isConstant, glob = whereConstant(exp[2])
+            local wantMatch = op == "LIKE"
+            if isConstant then
+                local pattern = globToMatch(glob)
+                return function(row) return (lhs(row):match(pattern) ~= nil) == wantMatch end
+            else
+                local rhs = compile(exp[2])
+                return function(row) return (lhs(row):match(globToMatch(rhs(row))) ~= nil) == wantMatch end
+            end
+        elseif op == "NOT" then
+            -- Unary operators have an empty lhs
+            local rhs = compile(exp[2])
+            return function(row) return not rhs(row) end
+        elseif op then
+            local lhs = compile(exp[1])
+            local rhs = compile(exp[2])
             if op == "OR" then
-                return dbg(function(env) return lhs(env) or rhs(env) end)
+                return function(row) return lhs(row) or rhs(row) end
             elseif op == "AND" then
-                return dbg(function(env) return lhs(env) and rhs(env) end)
+                return function(row) return lhs(row) and rhs(row) end
             elseif op == "eq" then
-                return dbg(function(env) return lhs(env) == rhs(env) end)
+                return function(row) return lhs(row) == rhs(row) end
             elseif op == "lt" then
-                return dbg(function(env) return lhs(env) < rhs(env) end)
+                return function(row) return lhs(row) < rhs(row) end
             elseif op == "le" then
-                return dbg(function(env) return lhs(env) <= rhs(env) end)
+                return function(row) return lhs(row) <= rhs(row) end
             elseif op == "gt" then
-                return dbg(function(env) return lhs(env) > rhs(env) end)
+                return function(row) return lhs(row) > rhs(row) end
             elseif op == "ge" then
-                return dbg(function(env) return lhs(env) >= rhs(env) end)
+                return function(row) return lhs(row) >= rhs(row) end
             elseif op == "neq" then
-                return dbg(function(env) return lhs(env) ~= rhs(env) end)
-            elseif op == "NOT" then
-                return dbg(function(env) return not rhs(env) end)
-            elseif op == "LIKE" then
-                return dbg(function(env)
-                    return lhs(env):match(globToMatch(rhs(env))) ~= nil
-                end)
-            elseif op == "NOT_LIKE" then
-                return dbg(function(env)
-                    return lhs(env):match(globToMatch(rhs(env))) == nil
-                end)
+                return function(row) return lhs(row) ~= rhs(row) end
             else
                 error("Unhandled op "..op)
             end
-        elseif exp.type == "number" then
-            return function()
-                local _, val = compiler.literalToNumber(exp.val)
-                return val
-            end
-        elseif exp.type == "string" then
-            return function() return assert(exp.val:match("^'(.*)'$")):gsub("''", "'") end
         elseif exp.type == "identifier" then
-            return function(env)
-                -- printf("ENV[%s]=%s\n", exp.val, env[exp.val])
-                return env[exp.val]
+            local column = fieldColumn(exp.val)
+            return function(row) return column[row] end
+        else
+            local isConstant, value = whereConstant(exp)
+            if not isConstant then
+                error("Unhandled expression "..exp.type)
             end
+            return function() return value end
+        end
+    end
+
+    return compile(exp)
+end
+
+-- Returns a function which evaluates the WHERE clause str against a single record, keyed by upper cased field name.
+function parseWhere(str)
+    local exp = parseWhereExpression(str)
+    local tbl = newTable("")
+    local function addFields(exp)
+        if exp.type == "identifier" and not tbl.fields[exp.val] then
+            addField(tbl, { name = exp.val })
+        end
+        for _, operand in ipairs(exp) do
+            addFields(operand)
+        end
+    end
+    addFields(exp)
+    local predicate = compileWhere(exp, tbl)
+    return function(rec)
+        setRecord(tbl, 1, rec)
+        return predicate(1)
+    end
+end
+
+-- Returns the first position in index at which test(value of fieldName) is true, or #index + 1 if there isn't one.
+-- test must be false for some (possibly empty) initial part of the index and true for all of the rest.
+local function indexSearch(tbl, index, fieldName, test)
+    local lo, hi = 1, #index + 1
+    while lo < hi do
+        local mid = (lo + hi) // 2
+        if test(tbl.columns[fieldName][index[mid]]) then
+            hi = mid
         else
-            error("Unhandled expression "..exp.type)
+            lo = mid + 1
         end
     end
+    return lo
+end
 
-    return evalExpression(exp)
+-- Returns the first and last positions in index of the records whose value for the index's first sort field satisfies
+-- <field> <op> <value>. These are always contiguous, and last will be first - 1 if there aren't any.
+local function indexRange(tbl, index, op, value)
+    local sortField = index.spec[1]
+    local ascending = sortField.ascending
+    -- Everything before equalPos sorts before value (ie is less than it if the index is ascending), everything from
+    -- afterPos onwards sorts after it, and everything in between is equal to it.
+    local equalPos = indexSearch(tbl, index, sortField.name, function(v)
+        if ascending then return v >= value else return v <= value end
+    end)
+    local afterPos = indexSearch(tbl, index, sortField.name, function(v)
+        if ascending then return v > value else return v < value end
+    end)
+    local n = #index
+    if op == "eq" then
+        return equalPos, afterPos - 1
+    end
+    if not ascending then
+        op = flippedComparisons[op]
+    end
+    if op == "lt" then
+        return 1, equalPos - 1
+    elseif op == "le" then
+        return 1, afterPos - 1
+    elseif op == "gt" then
+        return afterPos, n
+    else -- ge
+        return equalPos, n
+    end
+end
+
+-- Looks through the top-level AND terms of exp for a comparison that one of tbl's existing indexes can answer, and
+-- returns that index and the range of it which contains every record that could match (or nil if there isn't one). If
+-- preferred is set, no other index is considered.
+function whereIndexRange(tbl, exp, preferred)
+    local best, bestFirst, bestLast
+    local function consider(exp)
+        if exp.op == "AND" then
+            consider(exp[1])
+            consider(exp[2])
+            return
+        end
+        local identifier, op, value = whereComparison(exp)
+        local field = identifier and op ~= "neq" and whereField(tbl, identifier)
+        -- Can't use an index if the comparison would be between a string and a number
+        if not field or (field.type == DataTypes.EString) ~= (type(value) == "string") then
+            return
+        end
+        for _, index in pairs(preferred and { preferred } or tbl.indexes or {}) do
+            if index.spec[1].name == field.name then
+                local first, last = indexRange(tbl, index, op, value)
+                if best == nil or last - first < bestLast - bestFirst then
+                    best, bestFirst, bestLast = index, first, last
+                end
+            end
+        end
+    end
+    consider(exp)
+    return best, bestFirst, bestLast
 end
 
 local kMergableDataRecordType = 1
 local kFieldRecordType = 2
 
 function Db:loadOdbBinary(data)
-    self.currentTable = {
-        name = "Table1",
-    }
+    self.currentTable = newTable("Table1")
     table.insert(self.tables, self.currentTable)
     self.tables[self.currentTable.name] = self.currentTable
 
@@ -1152,25 +2171,24 @@ function Db:loadOdbBinary(data)
     
     -- HACK: I've no idea what dataStart is, it seems wrong
     local recordStart = 22 --dataStart
+    local haveFields = false
     
     while recordStart < #data do
         local header, pos = string.unpack("<H", data, 1 + recordStart, pos)
         local recordLen = header & 0xFFF
         local recordType = header >> 12
         -- printf("%04X: record len=0x%X, type=%d\n", recordStart, recordLen, recordType)
-        if self.currentTable.fields == nil then
-            self.currentTable.fields = {}
+        if not haveFields then
+            haveFields = true
             assert(recordType == kFieldRecordType)
             for i = 0, recordLen - 1 do
                 local type
                 type, pos = string.unpack("B", data, pos)
-                local field = {
+                addField(self.currentTable, {
                     type = type,
                     name = string.format("Field%d", i + 1),
                     rawType = OplTypeToFieldType[type],
-                }
-                table.insert(self.currentTable.fields, field)
-                self.currentTable.fields[field.name] = field
+                })
                 -- printf("Field %d type %s\n", i + 1, DataTypes[type])
             end
         elseif recordType == kMergableDataRecordType then
@@ -1191,7 +2209,7 @@ function Db:loadOdbBinary(data)
                 end
                 record[field.name] = val
             end
-            table.insert(self.currentTable, record)
+            addRecord(self.currentTable, record)
         else
             printf("Unhandled record type %d\n", recordType)
         end
@@ -164,6 +164,8 @@ local function mapDevicePath(path)
     error("No device path mapping for "..path)
 end
 
+local openFiles = {}
+
 local function fileErrToOpl(errno)
     if errno == 2 then -- ENOENT = 2
         return KErrNotExists
@@ -213,10 +215,10 @@ function fsop(cmd, path, ...)
         else
             return KErrNotReady
         end
-    elseif cmd == "write" then
-        printf("write %s\n", filename)
+    elseif cmd == "write" or cmd == "append" then
+        printf("%s %s\n", cmd, filename)
         local data = ...
-        local f, err, errno = io.open(filename, "wb")
+        local f, err, errno = io.open(filename, cmd == "append" and "ab" or "wb")
         if f then
             f:write(data)
             f:close()
@@ -224,6 +226,9 @@ function fsop(cmd, path, ...)
         else
             return fileErrToOpl(errno)
         end
+    elseif cmd == "flush" then
+        -- Writes are synchronous, so there's never anything outstanding
+        return KErrNone
     elseif cmd == "read" then
         local f, err, errno = io.open(filename, "rb")
         if f then
@@ -233,6 +238,16 @@ function fsop(cmd, path, ...)
         else
             return nil, fileErrToOpl(errno)
         end
+    elseif cmd == "open" then
+        local access = ... or "r"
+        local f, err, errno = io.open(filename, access.."b")
+        if f then
+            local h = #openFiles + 1
+            openFiles[h] = f
+            return h
+        else
+            return nil, fileErrToOpl(errno)
+        end
     elseif cmd == "dir" then
         local h = io.popen(fmt('ls -1 "%s"', filename))
         local data = assert(h:read("a"))
@@ -252,6 +267,51 @@ function fsop(cmd, path, ...)
     end
 end
 
+function fileop(cmd, h, ...)
+    local f = openFiles[h]
+    if not f then
+        if cmd == "read" or cmd == "readline" or cmd == "seek" then
+            return nil, KErrInvalidArgs
+        else
+            return KErrInvalidArgs
+        end
+    end
+    if cmd == "read" then
+        local maxLen = ...
+        return f:read(maxLen) or ""
+    elseif cmd == "readline" then
+        local line = f:read("L")
+        if not line then
+            return nil, KErrEof
+        elseif line:sub(-1) ~= "\n" then
+            return ""
+        end
+        return (line:gsub("\r?\n$", ""))
+    elseif cmd == "write" then
+        local data = ...
+        return f:write(data) and KErrNone or KErrNotReady
+    elseif cmd == "seek" then
+        local whence, offset = ...
+        local pos = f:seek("cur")
+        local size = f:seek("end")
+        local newPos = (whence == "set" and 0 or whence == "cur" and pos or size) + offset
+        if newPos < 0 or newPos > size then
+            f:seek("set", pos)
+            return nil, KErrInvalidArgs
+        end
+        return f:seek("set", newPos)
+    elseif cmd == "truncate" then
+        -- Not supported by the Lua io library
+        return KErrNotSupported
+    elseif cmd == "close" then
+        f:close()
+        openFiles[h] = nil
+        return KErrNone
+    else
+        error("Unrecognised fileop "..cmd)
+    end
+end
+
 function asyncRequest(name, requestTable)
     assert(name == "getevent", "Unknown asyncRequest "..name)
     statusRequests[name] = requestTable
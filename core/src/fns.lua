@@ -652,27 +652,59 @@ end
 
 gLoadBit_dump = numParams_dump
 
+-- Parsed SIBO font files, keyed on path, size and modification time, so that loading the same font again (in this run
+-- or a later one) doesn't mean parsing it and rendering its glyphs all over again. The glyph bitmaps are kept in a
+-- BitmapCache (with the metrics alongside), so that the cache is bounded in the same way as gLOADBIT's.
+local KFontCacheLimit = 1024 * 1024
+local parsedFonts = nil
+
+local function loadFontFile(iohandler, path)
+    local data, err = iohandler.fsop("read", path)
+    assert(data, err)
+    local metrics, bmp = require("font").parseFont(data)
+    bmp.fontMetrics = metrics
+    return data, { bmp }
+end
+
 function gLoadFont(stack, runtime) -- 0x29
     local path = stack:pop()
     if runtime:isSibo() then
         local currentId = runtime:getGraphicsContext().id
-        local data, err = runtime:iohandler().fsop("read", runtime:abs(path))
-        assert(data, err)
+        local iohandler = runtime:iohandler()
+        local absPath = runtime:abs(path)
+        local stat = iohandler.fsop("stat", absPath)
+        -- As per gLOADBIT, files can't be cached if the iohandler doesn't know their modification time
+        local key = stat and stat.lastModified ~= 0
+            and string.format("%s:%s:%s", oplpath.canon(absPath), stat.size, stat.lastModified)
+        local bmp, native
+        if key then
+            if not parsedFonts then
+                parsedFonts = require("mbm").newBitmapCache(KFontCacheLimit)
+            end
+            bmp, native = parsedFonts:getBitmap(key, 0, function() return loadFontFile(iohandler, absPath) end)
+        else
+            local _, bitmaps = loadFontFile(iohandler, absPath)
+            bmp = bitmaps[1]
+            native = bmp:toNative()
+        end
 
-        local font, bmp = require("font").parseFont(data)
+        local font = {}
+        for k, v in pairs(bmp.fontMetrics) do
+            font[k] = v
+        end
         font.height = font.charh -- parseFont returns the JSON names
         font.descent = font.height - font.ascent
         local fonts = runtime:getResource("fonts")
         if not fonts then
             fonts = { loaded = {} }
-            self:setResource("fonts", fonts)
+            runtime:setResource("fonts", fonts)
         end
 
         table.insert(fonts.loaded, font)
         font.uid = #fonts.loaded + 1000
-        font.id = runtime:gCREATEBIT(bmp.width, bmp.height, KColorgCreate2GrayMode)
+        font.id = runtime:gCREATEBIT(native.width, native.height, KColorgCreate2GrayMode)
         fonts[font.uid] = font
-        runtime:drawCmd("bitblt", { bitmap = bmp:toNative(), mode = KtModeReplace })
+        runtime:drawCmd("bitblt", { bitmap = native, mode = KtModeReplace })
         -- gCREATEBIT sets currrent context, which we don't want
         runtime:gUSE(currentId)
         stack:push(font.uid)
@@ -304,6 +304,9 @@ local kEpoc8bitPalette = {
     0xFFFFFF, -- FF
 }
 
+-- Native decoder, see qt/mbmcodec.cpp. Optional, everything also works (more slowly) without it.
+local mbmcodec = package.loaded.mbmcodec
+
 local string_byte, string_char, string_rep, string_sub = string.byte, string.char, string.rep, string.sub
 local string_pack, string_packsize, string_unpack = string.pack, string.packsize, string.unpack
 local table_insert = table.insert
@@ -370,6 +373,9 @@ local function byteWidth(pixelWidth, bpp)
 end
 
 function Bitmap:getImageData(expandToBitDepth, resultStride)
+    if mbmcodec and expandToBitDepth then
+        return mbmcodec.getImageData(self, expandToBitDepth, resultStride)
+    end
     local imgData = decodeBitmap(self)
     if expandToBitDepth == 8 then
         if resultStride == nil then
@@ -414,7 +420,7 @@ function Bitmap:getImageData(expandToBitDepth, resultStride)
                 local b = ((value >> 8) & 0xF) * 17
                 local g = ((value >> 4) & 0xF) * 17
                 local r = (value & 0xF) * 17
-                return string_char(r & 0xFF, g & 0xFF, b & 0xFF)
+                return string_char(r & 0xFF, g & 0xFF, b & 0xFF)..alphaByte
             elseif self.bpp == 16 then
                 local pos = 1 + (y * self.stride + x * 2)
                 local value = string.unpack("<I2", bytes, pos)
@@ -536,6 +542,64 @@ local ModeToBpp = GCreateModeToBpp
 
 local SEpocBitmapHeader = "<I4I4I4I4I4I4I4I4I4I4"
 
+-- Returns the pixel data for bitmap as it should appear in an MBM, and the compression used
+local function encodeBitmapPixels(bitmap, bpp, isColor)
+    local stride = byteWidth(bitmap.width, bpp)
+    local pixels = {}
+    local compression = ENoBitmapCompression
+    local function copyPixels832()
+        local pixelSz = (bpp // 8)
+        local padSz = stride - (pixelSz * bitmap.width)
+        assert(padSz >= 0)
+        local pad = string_rep("\0", padSz)
+        for y = 0, bitmap.height - 1 do
+            pixels[y + 1] = bitmap.normalizedImgData:sub(1 + bitmap.width * y * pixelSz, bitmap.width * (y + 1) * pixelSz) .. pad
+        end
+    end
+    local function copyPixelsPacked()
+        local pixelsPerByte = 8 // bpp
+        local rshift = 8 - bpp
+        for y = 0, bitmap.height - 1 do
+            local offset = bitmap.width * y
+            local line = string_sub(bitmap.normalizedImgData, 1 + offset, offset + bitmap.width)..string_rep("\0", pixelsPerByte)
+            local x = 0
+            while x < bitmap.width do
+                local packedByte = 0
+                for i = 1, pixelsPerByte do
+                    local px = string_byte(line, x + i)
+                    packedByte = packedByte | ((px >> rshift) << ((i-1) * bpp))
+                end
+                table_insert(pixels, string_char(packedByte))
+                x = x + pixelsPerByte
+            end
+            table_insert(pixels, string.rep("\0", stride - (bitmap.width + pixelsPerByte - 1) // pixelsPerByte))
+        end
+    end
+    if (bpp == 8 and not isColor) or bpp == 32 then
+        if bpp == 8 then 
+            compression = EByteRLECompression
+        end
+        copyPixels832()
+    elseif bpp < 8 then
+        compression = EByteRLECompression
+        copyPixelsPacked()
+    else
+        unimplemented("mbm.makeMbm.mode"..tostring(bitmap.mode))
+    end
+
+    local paddedData = table.concat(pixels)
+    if compression == EByteRLECompression then
+        paddedData = rleEncode(paddedData, 1)
+    elseif compression == ESixteenBitRLECompression then
+        paddedData = rleEncode(paddedData, 2)
+    elseif compression == ETwentyFourBitRLECompression then
+        paddedData = rleEncode(paddedData, 3)
+    elseif compression == ETwelveBitRLECompression then
+        unimplemented("mbm.makeMbm.rle12")
+    end
+    return paddedData, compression
+end
+
 function makeMbm(uid2, bitmaps)
     local parts = { n = 0 }
     local function add(data)
@@ -551,6 +615,9 @@ function makeMbm(uid2, bitmaps)
     addf("<I4", 0) -- parts[2] = trailerOffset, will be replaced at end
     local bitmapOffsets = {}
 
+    -- This does the expensive part for all the bitmaps at once, if it can
+    local encoded = mbmcodec and mbmcodec.encodeBitmaps(bitmaps)
+
     for i, bitmap in ipairs(bitmaps) do
         bitmapOffsets[i] = parts.n
         local headerLen = string_packsize(SEpocBitmapHeader)
@@ -559,58 +626,12 @@ function makeMbm(uid2, bitmaps)
         -- with zero line padding
         local isColor = bitmap.mode >= KColorgCreate16ColorMode
         local bpp = ModeToBpp[bitmap.mode]
-        local stride = byteWidth(bitmap.width, bpp)
-        local pixels = {}
-        local compression = ENoBitmapCompression
-        local function copyPixels832()
-            local pixelSz = (bpp // 8)
-            local padSz = stride - (pixelSz * bitmap.width)
-            assert(padSz >= 0)
-            local pad = string_rep("\0", padSz)
-            for i = 0, bitmap.width - 1 do
-                pixels[i + 1] = bitmap.normalizedImgData:sub(1 + bitmap.width * i * pixelSz, bitmap.width * (i + 1) * pixelSz) .. pad
-            end
-        end
-        local function copyPixelsPacked()
-            local pixelsPerByte = 8 // bpp
-            local rshift = 8 - bpp
-            for y = 0, bitmap.height - 1 do
-                local offset = bitmap.width * y
-                local line = string_sub(bitmap.normalizedImgData, 1 + offset, offset + bitmap.width).."\0\0\0\0"
-                local x = 0
-                while x < bitmap.width do
-                    local packedByte = 0
-                    for i = 1, pixelsPerByte do
-                        local px = string_byte(line, x + i)
-                        packedByte = packedByte | ((px >> rshift) << ((i-1) * bpp))
-                    end
-                    table_insert(pixels, string_char(packedByte))
-                    x = x + pixelsPerByte
-                end
-                table_insert(pixels, string.rep("\0", stride - (bitmap.width + pixelsPerByte - 1) // pixelsPerByte))
-            end
-        end
-        if (bpp == 8 and not isColor) or bpp == 32 then
-            if bpp == 8 then 
-                compression = EByteRLECompression
-            end
-            copyPixels832()
-        elseif bpp < 8 then
-            compression = EByteRLECompression
-            copyPixelsPacked()
+        local paddedData, compression
+        if encoded and encoded[i] then
+            paddedData = encoded[i].data
+            compression = encoded[i].compression
         else
-            unimplemented("mbm.makeMbm.mode"..tostring(bitmap.mode))
-        end
-
-        local paddedData = table.concat(pixels)
-        if compression == EByteRLECompression then
-            paddedData = rleEncode(paddedData, 1)
-        elseif compression == ESixteenBitRLECompression then
-            paddedData = rleEncode(paddedData, 2)
-        elseif compression == ETwentyFourBitRLECompression then
-            paddedData = rleEncode(paddedData, 3)
-        elseif compression == ETwelveBitRLECompression then
-            unimplemented("mbm.makeMbm.rle12")
+            paddedData, compression = encodeBitmapPixels(bitmap, bpp, isColor)
         end
         addf(SEpocBitmapHeader,
             #paddedData + headerLen, -- len
@@ -675,6 +696,9 @@ function parseRomBitmap(data, offset)
 end
 
 function decodeBitmap(bitmap)
+    if mbmcodec then
+        return mbmcodec.decode(bitmap)
+    end
     local data = bitmap.data
     local imgData
     local pos = 1 + bitmap.imgStart
@@ -743,6 +767,9 @@ function rleDecode(data, pos, len, pixelSize)
 end
 
 function rleEncode(data, pixelSize)
+    if mbmcodec then
+        return mbmcodec.rleEncode(data, pixelSize)
+    end
     local result = {}
     local current = nil -- nil if currently in a raw block, non-nil if in a run block of that character
     local prev = nil -- previous raw-block byte
@@ -922,6 +949,86 @@ function Bitmap:toBmp()
     return fileHeader..bmpHeader..pixels..pad
 end
 
+-- A cache of parsed MBM files and the bitmaps decoded from them, used by gLOADBIT so that loading the same bitmap
+-- again (or another bitmap from the same file) doesn't reread, reparse or redecode anything. Keys should identify the
+-- file contents, eg by including the file's size and modification time as well as its path. Once the total size of the
+-- file data and decoded bitmaps exceeds limit bytes, the least recently used files are discarded.
+KDefaultBitmapCacheLimit = 16 * 1024 * 1024
+
+BitmapCache = class {}
+
+function newBitmapCache(limit)
+    return BitmapCache {
+        limit = limit or KDefaultBitmapCacheLimit,
+        entries = {},
+        count = 0,
+        size = 0,
+        hits = 0,
+        misses = 0,
+        useCount = 0,
+    }
+end
+
+-- Returns the bitmap at (zero-based) index in the file identified by key, and the result of calling toNative() on it.
+-- If the file isn't already cached, load() is called, and must return the file data and the parsed bitmaps. Returns
+-- nil if there's no such index.
+function BitmapCache:getBitmap(key, index, load)
+    local entry = self.entries[key]
+    if entry == nil then
+        local data, bitmaps = load()
+        entry = { bitmaps = bitmaps, natives = {}, size = #data }
+        self.entries[key] = entry
+        self.count = self.count + 1
+        self.size = self.size + entry.size
+    end
+    self.useCount = self.useCount + 1
+    entry.lastUse = self.useCount
+
+    local bitmap = entry.bitmaps[1 + index]
+    if bitmap == nil then
+        return nil
+    end
+    local native = entry.natives[1 + index]
+    if native then
+        self.hits = self.hits + 1
+    else
+        self.misses = self.misses + 1
+        native = bitmap:toNative()
+        entry.natives[1 + index] = native
+        entry.size = entry.size + #native.normalizedImgData
+        self.size = self.size + #native.normalizedImgData
+        self:trim(entry)
+    end
+    return bitmap, native
+end
+
+-- Discards least recently used entries other than keep until the cache is within its limit
+function BitmapCache:trim(keep)
+    while self.size > self.limit do
+        local oldestKey, oldest
+        for key, entry in pairs(self.entries) do
+            if entry ~= keep and (oldest == nil or entry.lastUse < oldest.lastUse) then
+                oldestKey, oldest = key, entry
+            end
+        end
+        if oldest == nil then
+            break
+        end
+        self.entries[oldestKey] = nil
+        self.count = self.count - 1
+        self.size = self.size - oldest.size
+    end
+end
+
+function BitmapCache:getStats()
+    return {
+        entries = self.count,
+        size = self.size,
+        hits = self.hits,
+        misses = self.misses,
+    }
+end
+
 function Bitmap:getMetadata()
     local result = {
         width = self.width,
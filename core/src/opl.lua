@@ -624,12 +624,12 @@ function gCREATEBIT(w, h, mode)
 end
 
 function gLOADBIT(path, writable, index)
-    -- We implement this in 3 phases:
+    -- If the iohandler supports it, it loads the bitmap straight into a new drawable itself. Otherwise we implement
+    -- this in 3 phases:
     -- (1) Get the mbm data and decode it
     -- (2) Tell iohandler to create an empty bitmap
     -- (3) Tell iohandler to blit the decoded MBM data into it
 
-    -- (1)
     -- printf("gLOADBIT %s index=%d", path, 1 + index)
     local iohandler = runtime:iohandler()
     local absPath = runtime:abs(path)
@@ -637,34 +637,66 @@ function gLOADBIT(path, writable, index)
         -- It's allowed to omit the .pic
         absPath = absPath .. ".PIC"
     end
-    local data, err = iohandler.fsop("read", absPath)
-    assert(data, err)
-
     local gSetOffset = runtime:getResource("gSetOpenAddress")
     if gSetOffset then
-        data = data:sub(1 + gSetOffset)
         -- I assume we should clear it now...?
         runtime:setResource("gSetOpenAddress", nil)
     end
 
-    local bitmaps
-    -- Apparently loading an AIF file is allowed using gLOADBIT!
-    -- https://github.com/inseven/opolua/issues/443
-    local uid1, uid2, uid3, checksum = string.unpack("<I4I4I4I4", data)
-    if uid1 == KUidDirectFileStore and uid2 == KUidAppInfoFile8 then
-        bitmaps = require("aif").parseAif(data).icons
-    else
-        bitmaps = mbm.parseMbmHeader(data)
+    if iohandler.loadBitmap then
+        -- The size and mode aren't known until the bitmap is loaded, so fill them in afterwards
+        local ctx = runtime:newGraphicsContext(0, 0, false, 0)
+        local info = iohandler.loadBitmap(ctx.id, absPath, index, gSetOffset)
+        if info then
+            ctx.width = info.width
+            ctx.height = info.height
+            ctx.displayMode = info.mode
+            gUSE(ctx.id)
+            return ctx.id
+        end
+        -- Not a format the iohandler understands, or some other problem that the code below will report properly
+        runtime:closeGraphicsContext(ctx.id)
     end
 
-    assert(bitmaps, KErrGenFail)
-    local bitmap = bitmaps[1 + index]
+    -- (1)
+
+    local function load()
+        local data, err = iohandler.fsop("read", absPath, "map")
+        assert(data, err)
+        -- Always take a copy, since the bitmaps are cached and a mapped buffer would keep the file mapped (and on
+        -- Windows, locked) for as long as they are.
+        data = data:sub(1 + (gSetOffset or 0))
+
+        local bitmaps
+        -- Apparently loading an AIF file is allowed using gLOADBIT!
+        -- https://github.com/inseven/opolua/issues/443
+        local uid1, uid2, uid3, checksum = string.unpack("<I4I4I4I4", data)
+        if uid1 == KUidDirectFileStore and uid2 == KUidAppInfoFile8 then
+            bitmaps = require("aif").parseAif(data).icons
+        else
+            bitmaps = mbm.parseMbmHeader(data)
+        end
+        assert(bitmaps, KErrGenFail)
+        return data, bitmaps
+    end
+
+    local bitmap, native
+    local stat = iohandler.fsop("stat", absPath)
+    -- Not all iohandlers can report a modification time, and without one there's no telling if the file has changed
+    if stat and stat.lastModified ~= 0 then
+        local key = string.format("%s:%s:%s:%d", oplpath.canon(absPath), stat.size, stat.lastModified, gSetOffset or 0)
+        bitmap, native = runtime:getBitmapCache():getBitmap(key, index, load)
+    else
+        local _, bitmaps = load()
+        bitmap = bitmaps[1 + index]
+        native = bitmap and bitmap:toNative()
+    end
     assert(bitmap, KErrNotExists)
     -- (2)
     local id = gCREATEBIT(bitmap.width, bitmap.height, bitmap.mode)
     -- printf(" %dx%d drawableid=%d\n", bitmap.width, bitmap.height, id)
     -- (3)
-    runtime:drawCmd("bitblt", { bitmap = bitmap:toNative(), mode = KtModeReplace })
+    runtime:drawCmd("bitblt", { bitmap = native, mode = KtModeReplace })
     -- runtime:flushGraphicsOps()
     return id
 end
@@ -1622,6 +1654,43 @@ function RMDIR(path)
     end
 end
 
+-- Used by IOOPEN when the iohandler supports fileop, in which case the file contents are read and written on demand
+-- rather than being held in f.data for the lifetime of the handle.
+local function openFileStream(iohandler, path, mode)
+    local openMode = mode & KIoOpenModeMask
+    local access
+    if openMode == KIoOpenModeOpen or openMode == KIoOpenModeAppend then
+        access = (mode & KIoOpenAccessUpdate > 0) and "r+" or "r"
+    elseif openMode == KIoOpenModeCreate then
+        if EXIST(path) then
+            return nil, KErrExists
+        end
+        mode = mode | KIoOpenAccessUpdate
+        access = "w+"
+    else -- KIoOpenModeReplace, KIoOpenModeUnique
+        mode = mode | KIoOpenAccessUpdate
+        access = "w+"
+    end
+
+    local stream, err = iohandler.fsop("open", path, access)
+    if not stream then
+        return nil, err
+    end
+    if openMode == KIoOpenModeAppend then
+        iohandler.fileop("seek", stream, "end", 0)
+    end
+
+    local f = runtime:newFileHandle()
+    f.path = path
+    f.stream = stream
+    f.mode = mode
+    if openMode == KIoOpenModeUnique then
+        return f.h, nil, path
+    else
+        return f.h
+    end
+end
+
 function IOOPEN(path, mode)
     if path == "TIM:" then
         local f = runtime:newFileHandle()
@@ -1652,6 +1721,11 @@ function IOOPEN(path, mode)
         return nil, err
     end
 
+    local iohandler = runtime:iohandler()
+    if iohandler.fileop then
+        return openFileStream(iohandler, path, mode)
+    end
+
     local data
 
     if openMode == KIoOpenModeOpen or openMode == KIoOpenModeAppend then
@@ -1686,7 +1760,24 @@ function IOREAD(h, maxLen)
     if not f then
         return nil, KErrInvalidArgs
     end
-    assert(f.pos, "Cannot IOREAD a non-file handle!")
+    assert(f.pos or f.stream, "Cannot IOREAD a non-file handle!")
+
+    if f.stream then
+        local fileop = runtime:iohandler().fileop
+        if f.mode & KIoOpenFormatText > 0 then
+            local data, err = fileop("readline", f.stream)
+            if data and #data > maxLen then
+                return data:sub(1, maxLen), KErrRecord
+            end
+            return data, err
+        else
+            local data, err = fileop("read", f.stream, maxLen)
+            if data and #data == 0 and maxLen > 0 then
+                return nil, KErrEof
+            end
+            return data, err
+        end
+    end
 
     if f.pos > #f.data then
         return nil, KErrEof
@@ -1726,7 +1817,13 @@ function IOWRITE(h, data)
     end
     -- What's the right actual error code for this? KErrWrite? KOplErrReadOnly? KErrAccess?
     assert(f.mode & KIoOpenAccessUpdate > 0, "Cannot write to a readonly file handle!")
-    assert(f.pos, "Cannot IOWRITE a non-file handle!")
+    assert(f.pos or f.stream, "Cannot IOWRITE a non-file handle!")
+    if f.stream then
+        if f.mode & KIoOpenFormatText > 0 then
+            data = data.."\r\n"
+        end
+        return runtime:iohandler().fileop("write", f.stream, data)
+    end
     -- printf("IOWRITE h=%d pos=%d len=%d data='%s'\n", h, f.pos, #data, hexEscape(data))
     -- Not the most efficient operation, oh well
     f.data = f.data:sub(1, f.pos - 1)..data..f.data:sub(f.pos + #data)
@@ -1745,9 +1842,29 @@ function IOSEEK(h, mode, offset)
         return KErrInvalidArgs
     end
     assert(f.mode & KIoOpenAccessRandom > 0, KErrInvalidArgs)
-    assert(f.pos, "Cannot IOSEEK a non-file handle!")
+    assert(f.pos or f.stream, "Cannot IOSEEK a non-file handle!")
     local newPos
     -- printf("IOSEEK(%d, %d, %d)\n", h, mode, offset)
+    if f.stream then
+        local whence
+        if mode == KIoSeekFromStart or mode == 0 then
+            whence = "set"
+        elseif mode == KIoSeekFromEnd then
+            whence = "end"
+        elseif mode == KIoSeekFromCurrent then
+            whence = "cur"
+        elseif mode == KIoSeekFirstRecord then
+            whence, offset = "set", 0
+        else
+            error("Unknown mode to IOSEEK!")
+        end
+        local err
+        newPos, err = runtime:iohandler().fileop("seek", f.stream, whence, offset)
+        if not newPos then
+            return err
+        end
+        return KErrNone, newPos
+    end
     if mode == KIoSeekFromStart or mode == 0 then
         newPos = 1 + offset
     elseif mode == KIoSeekFromEnd then
@@ -1772,7 +1889,9 @@ function IOCLOSE(h)
     local err = KErrNone
     local f = runtime:getFile(h)
     if f then
-        if f.pos and f.mode & KIoOpenAccessUpdate > 0 then
+        if f.stream then
+            err = runtime:iohandler().fileop("close", f.stream)
+        elseif f.pos and f.mode & KIoOpenAccessUpdate > 0 then
             err = runtime:iohandler().fsop("write", f.path, f.data)
         end
         IOCANCEL(h)
@@ -1786,6 +1905,8 @@ end
 
 local KFnTimerRelative = 1
 local KFnTimerAbsolute = 2
+local KFnFileRead = 1
+local KFnFileWrite = 2
 local KConsoleRequestHandle = -2
 local KIoConsoleRequestSense = 8
 local KIoConsoleRequestInquire = 12
@@ -1836,11 +1957,43 @@ function IOA(h, fn, stat, a, b)
     end
 
     local f = runtime:getFile(h)
-    if not f or (not f.timer and not f.sound) then
+    if not f or (not f.timer and not f.sound and not f.stream) then
         return KErrInvalidArgs
     end
     
-    if f.timer then
+    if f.stream then
+        -- a is the buffer and b the length word, which for reads is updated with the number of bytes read
+        assert(f.stat == nil or not f.stat:isPending(), "Cannot have 2 outstanding requests on a file at once!")
+        local lenVar = b:asVariable(DataTypes.EWord)
+        local isText = f.mode & KIoOpenFormatText > 0
+        if fn == KFnFileRead then
+            local maxLen = lenVar()
+            local function completion(code, data)
+                data = data or ""
+                if #data > maxLen then
+                    data = data:sub(1, maxLen)
+                    code = KErrRecord
+                end
+                a:write(data)
+                lenVar(#data)
+                stat(code)
+            end
+            stat(KErrFilePending)
+            runtime:iohandler().asyncRequest("fileop", stat:getAddress(), completion,
+                isText and "readline" or "read", f.stream, maxLen)
+        elseif fn == KFnFileWrite then
+            assert(f.mode & KIoOpenAccessUpdate > 0, "Cannot write to a readonly file handle!")
+            local data = a:read(lenVar())
+            if isText then
+                data = data.."\r\n"
+            end
+            stat(KErrFilePending)
+            runtime:iohandler().asyncRequest("fileop", stat:getAddress(), stat, "write", f.stream, data)
+        else
+            return KErrNotSupported
+        end
+        f.stat = stat
+    elseif f.timer then
         assert(f.stat == nil or not f.stat:isPending(), "Cannot have 2 outstanding timer requests at once!")
         a = a:asVariable(DataTypes.ELong)
         if fn == KFnTimerRelative then
@@ -1916,11 +2069,11 @@ end
 
 function IOCANCEL(h)
     local f = runtime:getFile(h)
-    if not f or not f.timer then
+    if not f or (not f.timer and not f.stream) then
         return KErrInvalidArgs
     end
 
-    if f.timer and f.stat and f.stat:isPending() then
+    if f.stat and f.stat:isPending() then
         runtime:cancelRequest(f.stat)
     end
     return KErrNone
@@ -1946,7 +2099,7 @@ end
 function LoadRsc(path)
     -- printf("LoadRsc(%s)\n", path)
     path = runtime:abs(path)
-    local data, err = runtime:iohandler().fsop("read", path)
+    local data, err = runtime:iohandler().fsop("read", path, "map")
     assert(data, err)
     local resourceFile = require("rsc").parseRsc(data)
     local loadedResources = runtime:getResource("rsc")
@@ -24,6 +24,7 @@ SOFTWARE.
 
 _ENV = module()
 
+local database = require("database")
 local fns = require("fns")
 local fmt = string.format
 local Word, Long, Real, String = DataTypes.EWord, DataTypes.ELong, DataTypes.EReal, DataTypes.EString
@@ -1505,6 +1506,16 @@ function Copy(stack, runtime) -- 0xA4
     end
     err = runtime:iohandler().fsop("write", dest, data)
     assert(err == KErrNone, err)
+    local journal = runtime:getDbJournalPath(src)
+    local destJournal = runtime:getDbJournalPath(dest)
+    if journal then
+        data = assert(runtime:iohandler().fsop("read", journal))
+        err = runtime:iohandler().fsop("write", dest..database.KJournalSuffix, data)
+    elseif destJournal then
+        -- Otherwise it would be replayed on top of the copy
+        err = runtime:iohandler().fsop("delete", destJournal)
+    end
+    assert(err == KErrNone, err)
 end
 
 local function parseOpenOrCreate(runtime)
@@ -1575,6 +1586,10 @@ function Delete(stack, runtime) -- 0xA7
     if err ~= 0 then
         error(err)
     end
+    local journal = runtime:getDbJournalPath(filename)
+    if journal then
+        runtime:iohandler().fsop("delete", journal)
+    end
 end
 
 function Erase(stack, runtime) -- 0xA8
@@ -1736,6 +1751,10 @@ function Rename(stack, runtime) -- 0xBA
     if err ~= 0 then
         error(err)
     end
+    local journal = runtime:getDbJournalPath(src)
+    if journal then
+        runtime:iohandler().fsop("rename", journal, dest..database.KJournalSuffix)
+    end
 end
 
 function Stop(stack, runtime) -- 0xBB
@@ -2820,7 +2839,10 @@ end
 
 function Compact(stack, runtime) -- 0x12A
     local path = stack:pop()
-    printf("COMPACT(%s)\n", path)
+    -- Rewriting the file folds any journal into the snapshot
+    local db = runtime:newDb(runtime:abs(path), "Open")
+    db.needsSnapshot = true
+    runtime:saveDb(db)
 end
 
 function BeginTrans(stack, runtime) -- 0x12B
@@ -85,7 +85,7 @@ function DbGetFieldName(stack, runtime) -- 7
     local db = runtime:newDb(path, nil)
     local tbl = db.tables[tblName]
     assert(tbl, KErrInvalidArgs) -- Probably?
-    local field = tbl[fieldNum] -- fieldNum is 1 based
+    local field = tbl.fields[fieldNum] -- fieldNum is 1 based
     assert(field, KErrInvalidArgs) -- Probably?
     stack:push(field.name)
 end
@@ -95,7 +95,7 @@ function DbGetFieldType(stack, runtime) -- 8
     local db = runtime:newDb(path, nil)
     local tbl = db.tables[tblName]
     assert(tbl, KErrInvalidArgs) -- Probably?
-    local field = tbl[fieldNum]
+    local field = tbl.fields[fieldNum]
     assert(field, KErrInvalidArgs) -- Probably?
     stack:push(field.rawType)
 end
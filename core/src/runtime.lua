@@ -665,6 +665,10 @@ function Runtime:restoreGraphicsState(state)
     self:setGraphicsAutoFlush(state.flush)
 end
 
+-- Font metrics by uid. Fonts are identified by uid alone so these can be shared by every runtime (and run) in this Lua
+-- state, whereas the drawables holding their glyphs belong to a single runtime.
+local fontMetricsCache = {}
+
 function Runtime:getFont(fontId)
     if fontId == nil then
         fontId = self:getGraphicsContext().fontUid
@@ -686,20 +690,33 @@ function Runtime:getFont(fontId)
         return fonts[uid]
     end
 
+    -- The iohandler only has to send the metrics the first time a given font is loaded
+    local metrics = fontMetricsCache[uid]
     local ctx = self:newGraphicsContext(1, 1, false, KColorgCreate2GrayMode)
-    local metrics, err = self:iohandler().graphicsop("loadfont", ctx.id, uid)
-    if metrics == nil then
+    local result, err = self:iohandler().graphicsop("loadfont", ctx.id, uid, metrics ~= nil)
+    if result == nil then
         self:closeGraphicsContext(ctx.id)
         return nil
+    elseif type(result) == "table" then
+        metrics = result
+        fontMetricsCache[uid] = metrics
     end
 
     ctx.width = metrics.maxwidth * 32
     ctx.height = metrics.height * 8
-    metrics.id = ctx.id
-    metrics.uid = uid
 
-    fonts[uid] = metrics
-    return metrics
+    local font = {
+        id = ctx.id,
+        uid = uid,
+        name = metrics.name,
+        height = metrics.height,
+        ascent = metrics.ascent,
+        descent = metrics.descent,
+        maxwidth = metrics.maxwidth,
+        widths = metrics.widths, -- shared, never modified
+    }
+    fonts[uid] = font
+    return font
 end
 
 function Runtime:drawCmd(type, op)
@@ -853,9 +870,18 @@ function Runtime:newDb(path, op)
 
     local db = database.new(path, readonly)
     -- See if db already exists
-    local dbData, err = self.ioh.fsop("read", path)
+    local dbData, err = self.ioh.fsop("read", path, "map")
     if dbData then
         db:load(dbData)
+        -- Changes to such a database can't be saved without losing the values OPL can't represent (see
+        -- Db:saveBinary()), so it can only be read.
+        assert(readonly or not db.opaqueFields, KErrNotSupported)
+        if db.binary then
+            local journal = self.ioh.fsop("read", db:getJournalPath())
+            if journal then
+                db:loadJournal(journal)
+            end
+        end
     elseif err == KErrNotExists and isCreate then
         -- This is fine
     else
@@ -867,12 +893,12 @@ end
 function Runtime:openDb(logName, tableSpec, variables, op)
     assert(self.dbs.open[logName] == nil, KErrOpen)
     printf("parseTableSpec: %s\n", tableSpec)
-    local path, tableName, fieldNames, filterPredicate, sortSpec
+    local path, tableName, fieldNames, filter, sortSpec
     if self:isSibo() then
         path = tableSpec
         tableName = "Table1"
     else
-        path, tableName, fieldNames, filterPredicate, sortSpec = database.parseTableSpec(tableSpec)
+        path, tableName, fieldNames, filter, sortSpec = database.parseTableSpec(tableSpec)
     end
     path = self:abs(path)
 
@@ -900,7 +926,7 @@ function Runtime:openDb(logName, tableSpec, variables, op)
         db:createTable(tableName, fieldNames, types)
     end
 
-    db:setView(tableName, fieldNames, variables, filterPredicate, sortSpec)
+    db:setView(tableName, fieldNames, variables, filter, sortSpec)
     self.dbs.open[logName] = db
     self.dbs.current = logName
 end
@@ -917,15 +943,66 @@ function Runtime:useDb(logName)
 end
 
 function Runtime:closeDb()
-    self:saveDbIfModified()
+    local db = self:getDb()
+    if db.binary and db:isWriteable() and db.journalSize > 0 and not db:inTransaction() then
+        -- Don't leave the sidecar journal lying around, so that the file is complete for anything else reading it
+        self:saveDb(db, true)
+    else
+        self:saveDbIfModified()
+    end
+    -- Writes may complete after fsop returns, so this is the last chance to find out whether they actually worked
+    local function flush()
+        local err = self.ioh.fsop("flush", db:getPath())
+        if err == KErrNone and db:getJournalPath() ~= db:getPath() then
+            err = self.ioh.fsop("flush", db:getJournalPath())
+        end
+        return err
+    end
+    local err = flush()
+    if err ~= KErrNone then
+        -- Everything is still in memory, so try again with a full save
+        self:saveDb(db, true)
+        err = flush()
+    end
+    assert(err == KErrNone, err)
     self.dbs.open[self.dbs.current] = nil
     self.dbs.current = nil
 end
 
-function Runtime:saveDb(db)
-    local data = db:save()
+function Runtime:saveDb(db, full)
+    -- Journal entries are only meaningful if nothing else is modifying the file behind our back
+    local cpath = oplpath.canon(db:getPath())
+    for _, otherDb in pairs(self.dbs.open) do
+        if otherDb ~= db and oplpath.canon(otherDb:getPath()) == cpath then
+            full = true
+            break
+        end
+    end
+
+    local journal = not full and db:takeJournal()
+    if journal then
+        local err = #journal > 0 and self.ioh.fsop("append", db:getJournalPath(), journal) or KErrNone
+        if err == KErrNone then
+            db:didSave(nil, #journal)
+            return
+        end
+        -- Otherwise (including if an earlier queued write to the file failed) fall back to doing a full save, which
+        -- will include everything that was in the journal. The entries are kept in case that fails too.
+        db:restoreJournal(journal)
+    end
+
+    local data = db.binary and db:saveBinary() or db:save()
     local err = self.ioh.fsop("write", db:getPath(), data)
     assert(err == KErrNone, err)
+    local journalPath = db:getJournalPath()
+    if journalPath ~= db:getPath() and self.ioh.fsop("exists", journalPath) == KErrNone then
+        -- The sidecar journal must stay until what it's been folded in to is definitely on disk
+        err = self.ioh.fsop("flush", db:getPath())
+        assert(err == KErrNone, err)
+        err = self.ioh.fsop("delete", journalPath)
+        assert(err == KErrNone, err)
+    end
+    db:didSave(#data)
 end
 
 function Runtime:saveDbIfModified()
@@ -962,6 +1039,13 @@ function Runtime:getResource(name)
     return self.resources[name]
 end
 
+function Runtime:getBitmapCache()
+    if not self.bitmapCache then
+        self.bitmapCache = require("mbm").newBitmapCache()
+    end
+    return self.bitmapCache
+end
+
 function Runtime:newOplModule(moduleName)
     local module = newModuleInstance(moduleName)
     -- All "OPL modules" get the OPL API imported
@@ -1518,11 +1602,35 @@ end
 function Runtime:ls(path)
     local contents, err = self.ioh.fsop("dir", oplpath.join(path, ""))
     if contents then
+        -- Leave out the sidecar journals of binary databases
+        local present = {}
+        for _, item in ipairs(contents) do
+            present[oplpath.canon(item)] = true
+        end
+        local suffix = oplpath.canon(database.KJournalSuffix)
+        for i = #contents, 1, -1 do
+            local dbPath = contents[i]:sub(1, -#suffix - 1)
+            if oplpath.canon(contents[i]:sub(-#suffix)) == suffix and present[oplpath.canon(dbPath)]
+                and self:getDbJournalPath(dbPath) then
+                table.remove(contents, i)
+            end
+        end
         table.sort(contents, function(lhs, rhs) return oplpath.canon(lhs) < oplpath.canon(rhs) end)
     end
     return contents, err
 end
 
+-- Binary databases can have a sidecar journal (see Db:getJournalPath()), which is hidden from ls() and has to follow
+-- the database around when it is copied, renamed or deleted. Returns the path of the sidecar if path has one.
+function Runtime:getDbJournalPath(path)
+    local journalPath = path..database.KJournalSuffix
+    local data = self.ioh.fsop("read", journalPath)
+    if data and data:sub(1, #database.KJournalMarker) == database.KJournalMarker then
+        return journalPath
+    end
+    return nil
+end
+
 function Runtime:isdir(path)
     local stat = self.ioh.fsop("stat", path)
     return stat and stat.isDir
@@ -1805,6 +1913,7 @@ function Runtime:getDebugInfo()
         frames = frames,
         modules = modules,
         drawables = drawables,
+        bitmapCache = self.bitmapCache and self.bitmapCache:getStats(),
     }
 end
 
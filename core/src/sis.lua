@@ -578,7 +578,7 @@ end
 function installSis(filename, data, iohandler, includeStub, verbose, stubs)
     if data == nil then
         -- Assume filename is a psion path
-        data = assert(iohandler.fsop("read", filename))
+        data = assert(iohandler.fsop("read", filename, "map"))
     end
 
     local sisfile = parseSisFile(data, verbose)
@@ -0,0 +1,277 @@
+#!/usr/bin/env lua
+
+--[[
+
+Copyright (c) 2021-2026 Jason Morley, Tom Sutcliffe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+]]
+
+-- Micro-benchmarks for database.lua. Run with, for example:
+--     lua tbench_database.lua --records 1000 --records 100000
+-- Each benchmark is repeated until it has taken at least --time seconds of CPU time, and the results are printed as a
+-- JSON array with one entry per benchmark and database size. peakMemoryKB is the largest Lua heap size seen between
+-- operations, so includes whatever was allocated by generating and loading the database.
+
+dofile(arg[0]:match("^(.-)[a-z_]+%.lua$").."cmdline.lua")
+
+local words = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel", "india", "juliet", "kilo", "lima",
+    "mike", "november", "oscar", "papa", "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey",
+}
+
+local fields = {
+    { name = "name", type = DataTypes.EString },
+    { name = "qty", type = DataTypes.EWord },
+    { name = "total", type = DataTypes.ELong },
+    { name = "price", type = DataTypes.EReal },
+    { name = "notes", type = DataTypes.EString },
+}
+
+local seed
+local function random(n)
+    -- A simple LCG, so that the same databases are generated on every run and every Lua version
+    seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF
+    return 1 + (seed >> 8) % n
+end
+
+local function makeRecord()
+    local notes = {}
+    for i = 1, random(6) - 1 do
+        notes[i] = words[random(#words)]
+    end
+    return {
+        name = words[random(#words)].." "..words[random(#words)],
+        qty = random(1000) - 1,
+        total = random(1000000) - 1,
+        price = random(100000) / 100,
+        notes = table.concat(notes, " "),
+    }
+end
+
+local function generate(numRecords)
+    seed = numRecords
+    local db = database.new("C:\\bench.db")
+    local names, types = {}, {}
+    for i, field in ipairs(fields) do
+        names[i] = field.name
+        types[i] = field.type
+    end
+    db:createTable("Table1", names, types)
+    local tbl = db.tables.Table1
+    for i = 1, numRecords do
+        database.addRecord(tbl, makeRecord())
+    end
+    return db:save()
+end
+
+-- An iohandler with just enough of fsop to support Runtime:newDb() and Runtime:saveDb(), which maps every device
+-- path to a file of the same name in dir, and which doesn't log every operation like defaultiohandler does.
+local function makeIoHandler(dir)
+    local function hostPath(path)
+        return dir.."/"..oplpath.basename(path)
+    end
+    local fsop = function(cmd, path, data)
+        if cmd == "read" then
+            local f = io.open(hostPath(path), "rb")
+            if f == nil then
+                return nil, KErrNotExists
+            end
+            local result = f:read("a")
+            f:close()
+            return result
+        elseif cmd == "write" or cmd == "append" then
+            local f = io.open(hostPath(path), cmd == "append" and "ab" or "wb")
+            if f == nil then
+                return KErrNotReady
+            end
+            f:write(data)
+            f:close()
+            return KErrNone
+        else
+            error("Unsupported fsop "..cmd)
+        end
+    end
+    return { fsop = fsop }
+end
+
+local function makeVariables()
+    local result = {}
+    for i, field in ipairs(fields) do
+        local var = database.makeVar(field.type)
+        var.name = "A."..field.name
+        result[i] = var
+    end
+    return result
+end
+
+local function setSpecView(db, variables, spec)
+    local _, tableName, fieldNames, filter, sortSpec = database.parseTableSpec(spec)
+    db:setView(tableName, fieldNames, variables, filter, sortSpec)
+end
+
+local kSelectAll = "C:\\bench.db SELECT name, qty, total, price, notes FROM Table1"
+
+local results = {}
+local minTime
+
+-- Calls fn repeatedly until it has taken at least minTime, with setup (if specified) called before each call to fn
+-- but not included in the time.
+local function bench(name, numRecords, fn, setup)
+    collectgarbage("collect")
+    local peak = collectgarbage("count")
+    local ops, elapsed = 0, 0
+    repeat
+        if setup then
+            setup()
+        end
+        local start = os.clock()
+        fn()
+        elapsed = elapsed + (os.clock() - start)
+        ops = ops + 1
+        peak = math.max(peak, collectgarbage("count"))
+    until elapsed >= minTime
+    table.insert(results, json.Dict {
+        name = name,
+        records = numRecords,
+        ops = ops,
+        seconds = elapsed,
+        opsPerSec = ops / elapsed,
+        peakMemoryKB = math.floor(peak),
+    })
+end
+
+local function runBenchmarks(dir, numRecords)
+    local path = string.format("C:\\bench%d.db", numRecords)
+    local data = generate(numRecords)
+    local ioh = makeIoHandler(dir)
+    assert(ioh.fsop("write", path, data) == KErrNone)
+
+    bench("load", numRecords, function()
+        database.new(path, true):load(data)
+    end)
+
+    local db = database.new(path, true)
+    db:load(data)
+    local variables = makeVariables()
+
+    bench("setView", numRecords, function()
+        setSpecView(db, variables, kSelectAll)
+    end)
+
+    bench("setView.where", numRecords, function()
+        setSpecView(db, variables, kSelectAll.." WHERE qty < 100 AND name LIKE 'a*'")
+    end)
+
+    bench("setView.orderBy", numRecords, function()
+        setSpecView(db, variables, kSelectAll.." ORDER BY total DESC")
+    end)
+
+    bench("setView.orderBy.cold", numRecords, function()
+        setSpecView(db, variables, kSelectAll.." ORDER BY total DESC")
+    end, function()
+        db.tables.Table1.indexes = nil
+    end)
+
+    setSpecView(db, variables, kSelectAll)
+    bench("findField", numRecords, function()
+        db:findField("*victor whiskey*", 1, nil, KFindForwardsFromStart)
+    end)
+
+    bench("findField.uncached", numRecords, function()
+        db:findField("*victor whiskey*", 1, nil, KFindForwardsFromStart)
+    end, function()
+        db.tables.Table1.trigrams = nil
+    end)
+
+    bench("tocsv", numRecords, function()
+        db:writeCsv("Table1", function(chunk) end)
+    end)
+
+    -- The remaining benchmarks modify the database, via a Runtime so that they're saved the same way OPL does
+    local runtime = require("runtime")
+    local rt = runtime.newRuntime(ioh)
+    local rwDb = rt:newDb(path, "Open")
+    rt.dbs.open.A = rwDb
+    rt.dbs.current = "A"
+    rwDb:setView("Table1", nil, variables)
+
+    local function appendRecord()
+        for name, val in pairs(makeRecord()) do
+            rwDb:getCurrentVar("A."..name)(val)
+        end
+        rwDb:appendRecord()
+    end
+
+    bench("append", numRecords, function()
+        appendRecord()
+        rt:saveDbIfModified()
+    end)
+
+    bench("transaction.commit", numRecords, function()
+        rwDb:beginTransaction()
+        for i = 1, 10 do
+            appendRecord()
+        end
+        rwDb:endTransaction(true)
+        rt:saveDbIfModified()
+    end)
+
+    bench("transaction.rollback", numRecords, function()
+        rwDb:beginTransaction()
+        for i = 1, 10 do
+            appendRecord()
+        end
+        rwDb:endTransaction(false)
+        rt:saveDbIfModified()
+    end)
+
+    os.remove(dir.."/"..oplpath.basename(path))
+end
+
+function main()
+    local args = getopt({
+        records = table, r = "records",
+        time = string, t = "time",
+        dir = string, d = "dir",
+    })
+    database = require("database")
+    require("runtime") -- For database.makeVar
+    minTime = tonumber(args.time or "0.5")
+
+    local dir = args.dir
+    if dir == nil then
+        dir = os.tmpname()
+        os.remove(dir)
+        assert(os.execute(string.format('mkdir "%s"', dir)))
+    end
+
+    local sizes = #args.records > 0 and args.records or { "1000", "10000", "100000" }
+    for _, numRecords in ipairs(sizes) do
+        runBenchmarks(dir, math.tointeger(tonumber(numRecords)))
+    end
+
+    if args.dir == nil then
+        os.remove(dir)
+    end
+    print(json.encode(results))
+end
+
+pcallMain()
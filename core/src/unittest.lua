@@ -160,6 +160,208 @@ function main()
     assertEquals(likeExp({FOO="doom%"}), true)
     assertEquals(likeExp({FOO="dom%"}), false)
 
+    likeExp = database.parseWhere("foo NOT LIKE 'd*'")
+    assertEquals(likeExp({FOO="doom"}), false)
+    assertEquals(likeExp({FOO="abc"}), true)
+
+    local whereTbl = database.newTable("Table1", {
+        { name = "Name", type = DataTypes.EString },
+        { name = "n", type = DataTypes.ELong },
+    })
+    for i = 1, 10 do
+        database.addRecord(whereTbl, { Name = "r"..i, n = (i * 7) % 10 })
+    end
+    -- Compiled against whereTbl, field names are matched case-insensitively and the predicate takes a row
+    exp = database.compileWhere(database.parseWhereExpression("name LIKE 'r1*' AND NOT (n = 0)"), whereTbl)
+    assertEquals(exp(1), true)
+    assertEquals(exp(2), false)
+    assertEquals(exp(10), false)
+
+    local function whereRange(where)
+        local index, first, last = database.whereIndexRange(whereTbl, database.parseWhereExpression(where))
+        return index and { table.unpack(index, first, last) }
+    end
+    assertEquals(whereRange("n > 3"), nil) -- No index yet
+    database.new("C:\\where.db", true):getIndex(whereTbl, { { name = "n", ascending = false } })
+    assertEquals(whereRange("3 < n AND n <= 7"), { 7, 4, 1, 8, 5, 2 })
+    assertEquals(whereRange("n = 5"), { 5 })
+    assertEquals(whereRange("n < 2 OR n > 8"), nil)
+    assertEquals(whereRange("n = '5'"), nil)
+
+    local findDb = database.new("C:\\find.db", true)
+    findDb:load(":TABLE Table1\n:FIELD 3 name\n:RECORD\nname=Alice Smith\n:RECORD\nname=Bob Jones\n:RECORD\nname=Carol Smithson\n")
+    findDb.varMap = {}
+    findDb.currentView = { 3, 2, 1 }
+    findDb:setPos(1)
+    assertEquals(findDb:findField("*smith*", 1, nil, KFindForwardsFromStart), 1)
+    assert(findDb.currentTable.trigrams["smi"], "Trigram index not built")
+    assertEquals(findDb:findField("*SMITH", 1, nil, KFindBackwardsFromEnd), 3)
+    assertEquals(findDb:findField("*smith*", 1, nil, KFindForwardsFromStart | KFindCaseDependent), 0)
+    -- Too short to use the trigram index
+    assertEquals(findDb:findField("B?b*", 1, nil, KFindForwardsFromStart), 2)
+
+    -- Tables with a loader aren't read until needed, and can be unloaded again if they're clean and over budget
+    local lazyDb = database.new("C:\\lazy.db", true)
+    local loads = 0
+    for i = 1, 2 do
+        local tbl = database.newTable("Table"..i, { { name = "n", type = DataTypes.ELong } })
+        tbl.unloaded = true
+        tbl.loader = function()
+            loads = loads + 1
+            for j = 1, 10 do
+                database.addRecord(tbl, { n = j })
+            end
+        end
+        lazyDb.tables[i] = tbl
+        lazyDb.tables[tbl.name] = tbl
+    end
+    local oldBudget = database.tableMemoryBudget
+    database.tableMemoryBudget = 15
+    assertEquals(lazyDb.tables.Table1.count, 0)
+    lazyDb:requireRecords(lazyDb.tables.Table1)
+    lazyDb:requireRecords(lazyDb.tables.Table1)
+    assertEquals(loads, 1)
+    assertEquals(lazyDb.tables.Table1.count, 10)
+    lazyDb:requireRecords(lazyDb.tables.Table2)
+    assertEquals(lazyDb.tables.Table1.count, 0)
+    assertEquals(lazyDb.tables.Table2.count, 10)
+    database.tableMemoryBudget = oldBudget
+    -- Once every table is loaded, the loaders (and so whatever file data they hold on to) are released
+    assert(lazyDb.tables.Table2.loader, "Loader released too soon")
+    lazyDb:requireRecords(lazyDb.tables.Table1)
+    assertEquals(loads, 3)
+    assertEquals(lazyDb.tables.Table1.loader, nil)
+    assertEquals(lazyDb.tables.Table2.loader, nil)
+
+    -- Columns of fields that OPL can't represent are empty, which mustn't upset removing records
+    local columnTbl = database.newTable("Table1", { { name = "a", type = DataTypes.ELong }, { name = "b" } })
+    for i = 1, 3 do
+        database.addRecord(columnTbl, { a = i })
+    end
+    database.removeRecord(columnTbl, 2)
+    assertEquals(columnTbl.count, 2)
+    assertEquals(columnTbl.columns.a, { 1, 3 })
+    assertEquals(database.getRecord(columnTbl, 2), { a = 3 })
+
+    local snapshot = ":TABLE Table1\n:FIELD 3 name\n:FIELD 1 n\n:RECORD\nname=a\nn=1\n:RECORD\nname=b\nn=2\n"
+    local tbl = {
+        name = "Table1",
+        fields = {
+            { name = "name", type = DataTypes.EString },
+            { name = "n", type = DataTypes.ELong },
+        },
+    }
+    local journal = database.KJournalMarker.."\n"
+        .. database.makeJournalEntry("A", tbl, nil, { name = "c\td=", n = 3 })
+        .. database.makeJournalEntry("U", tbl, 1, { name = "A", n = 10 })
+        .. database.makeJournalEntry("D", tbl, 2)
+    local function loadRecords(data)
+        local db = database.new("C:\\test.db", true)
+        db:load(data)
+        local result = {}
+        local tbl = db:requireRecords(db.tables.Table1)
+        for row = 1, tbl.count do
+            local rec = database.getRecord(tbl, row)
+            result[row] = { rec.name, rec.n }
+        end
+        return result, db
+    end
+    assertEquals(loadRecords(snapshot..journal), { { "A", 10 }, { "c\td=", 3 } })
+    -- A journal that's already in the file counts towards the next compaction, rather than towards the snapshot size
+    local _, journalledDb = loadRecords(snapshot..journal)
+    assertEquals(journalledDb.snapshotSize, #snapshot)
+    assertEquals(journalledDb.journalSize, #journal)
+    -- A torn final entry is ignored, and forces the next save to be a full one
+    local records, db = loadRecords(snapshot..journal:sub(1, -5))
+    assertEquals(records, { { "A", 10 }, { "b", 2 }, { "c\td=", 3 } })
+    assertEquals(db:takeJournal(), nil)
+    -- A journal format this build doesn't know about is refused rather than partially applied
+    assert(not pcall(loadRecords, snapshot..":JOURNAL=2\n"), "Unknown journal version accepted")
+
+    -- The first entries appended after a snapshot are preceded by the marker, and reals survive both the journal and
+    -- the snapshot exactly, without integral ones turning into integers
+    local realSnapshot = ":TABLE Table1\n:FIELD 2 r\n"
+    local realDb = database.new("C:\\real.db")
+    realDb:load(realSnapshot)
+    local reals = { 0.1 + 0.2, 1 / 3, -1e300, 2.0 }
+    for _, r in ipairs(reals) do
+        database.addRecord(realDb:requireRecords(realDb.tables.Table1), { r = r })
+        realDb:addJournalEntry("A", nil, { r = r })
+    end
+    local realJournal = realDb:takeJournal()
+    assertEquals(realJournal:sub(1, #database.KJournalMarker + 1), database.KJournalMarker.."\n")
+    realDb:didSave(nil, #realJournal)
+    for _, data in ipairs({ realSnapshot..realJournal, realDb:save() }) do
+        local reloaded = database.new("C:\\real.db", true)
+        reloaded:load(data)
+        local realTbl = reloaded:requireRecords(reloaded.tables.Table1)
+        for i, r in ipairs(reals) do
+            local v = database.getRecord(realTbl, i).r
+            assertEquals(v, r)
+            assertEquals(math.type(v), "float")
+        end
+    end
+
+    -- Rolling back a transaction undoes exactly the changes made during it, including to the view and indexes
+    local txDb = database.new("C:\\tx.db")
+    txDb:load(snapshot)
+    txDb.varMap = {}
+    txDb.currentView = { 2, 1 }
+    txDb:getIndex(txDb.currentTable, { { name = "name", ascending = true } })
+    txDb:setPos(1)
+    txDb:beginTransaction()
+    txDb:appendRecord()
+    txDb:setPos(1)
+    txDb:deleteRecord()
+    txDb:endTransaction(false)
+    assertEquals(loadRecords(txDb:save()), { { "a", 1 }, { "b", 2 } })
+    assertEquals(txDb.currentView, { 2, 1 })
+    assertEquals({ table.unpack(txDb.currentTable.indexes["name ASC"]) }, { 1, 2 })
+    assertEquals(txDb.journal, {})
+
+    -- Sort indexes are saved with the snapshot, and kept up to date while replaying the journal
+    db:load(snapshot)
+    local nIndex = db:getIndex(db.tables.Table1, { { name = "n", ascending = false } })
+    assertEquals({ table.unpack(nIndex) }, { 2, 1 })
+    -- Building an index doesn't force the next save to rewrite the whole file
+    assertEquals(db:takeJournal(), "")
+    local indexedSnapshot = db:save()
+    assert(indexedSnapshot:match(":INDEX n DESC\t2 1\n"), "Index not saved")
+    local _, indexedDb = loadRecords(indexedSnapshot..journal)
+    assertEquals({ table.unpack(indexedDb.tables.Table1.indexes["n DESC"]) }, { 1, 2 })
+
+    -- CSV import and export, including values that need quoting and a quoted line break
+    local csvDb = database.new("C:\\csv.db")
+    local csv = 'name$,age%,notes\nAlice,30,"Says ""hi"", often"\n"Bob\r\nJr",,x\n'
+    assertEquals(csvDb:importCsv("People", csv:gmatch("([^\n]*)\n")), 2)
+    local people = csvDb.tables.People
+    assertEquals(database.getRecord(people, 1), { names = "Alice", agei = 30, notes = 'Says "hi", often' })
+    assertEquals(database.getRecord(people, 2), { names = "Bob\nJr", agei = 0, notes = "x" })
+    assertEquals(csvDb:tocsv("People"), 'names,agei,notes\nAlice,30,"Says ""hi"", often"\n"Bob\nJr",0,x\n')
+    local tsv = csvDb:tocsv("People", "\t")
+    csvDb:importCsv("Copy", tsv:gmatch("([^\n]*)\n"), "\t", { DataTypes.EString, DataTypes.EWord, DataTypes.EString })
+    assertEquals(database.getRecord(csvDb.tables.Copy, 2), database.getRecord(people, 2))
+
+    if package.loaded.pfsdb then
+        -- Enough records to need multiple clusters, and for the file to span several pages
+        db:load(snapshot)
+        for i = 1, 500 do
+            database.addRecord(db.tables.Table1, { name = string.rep("x", i % 200), n = -i })
+        end
+        local expected = loadRecords(db:save())
+        local binaryData = db:saveBinary()
+        local binaryRecords, binaryDb = loadRecords(binaryData)
+        assertEquals(binaryRecords, expected)
+        assert(binaryDb.binary, "Binary database should be saved as binary")
+
+        -- Binary databases are journalled to a sidecar file, which is replayed on top of what's in the binary file
+        assertEquals(binaryDb:getJournalPath(), "C:\\test.db.jnl")
+        assertEquals(binaryDb:takeJournal(), "")
+        binaryDb:loadJournal(database.makeJournalEntry("D", binaryDb.tables.Table1, 1))
+        assertEquals(binaryDb.tables.Table1.count, #expected - 1)
+        assertEquals(database.getRecord(binaryDb.tables.Table1, 1).name, expected[2][1])
+    end
+
     local mbm = require("mbm")
     local rleEncode = mbm.rleEncode
     local function rleDecode(data, pixelSize)
@@ -190,6 +392,172 @@ function main()
     checkRle(string.rep("aa", 130), "\127aa\1aa", 2)
     checkRle(string.rep("aa", 131).."bb", "\127aa\2aa\255bb", 2)
 
+    -- Decoding (natively, if mbmcodec is available) gives back what makeMbm() encoded
+    local grey = "\0\85\170\255\255\170\85\0\0\0\255\255\85\85\85\85"
+    for _, mode in ipairs({ KColorgCreate4GrayMode, KColorgCreate256GrayMode }) do
+        local bitmap = mbm.parseMbmHeader(mbm.makeMbm(KUidMultiBitmapFileImage, {
+            { width = 4, height = 4, mode = mode, normalizedImgData = grey },
+        }))[1]
+        assertEquals(bitmap:getImageData(8), grey)
+        assertEquals(bitmap:getImageData(32, 20):sub(17, 28), "\0\0\0\0\255\255\255\255\170\170\170\255")
+    end
+
+    -- Non-square bitmaps, and widths that don't fill the last byte of a row
+    for _, mode in ipairs({ KColorgCreate2GrayMode, KColorgCreate256GrayMode }) do
+        local pixels = "\0\255\255\0\255\0"
+        local bitmap = mbm.parseMbmHeader(mbm.makeMbm(KUidMultiBitmapFileImage, {
+            { width = 3, height = 2, mode = mode, normalizedImgData = pixels },
+        }))[1]
+        assertEquals(bitmap:getImageData(8), pixels)
+    end
+
+    -- Colour conversions to 32bpp: the 4 and 8 bit palettes, 12 bit pixels (which are big-endian), 16 bit 565 pixels
+    -- (with the top bits repeated to fill each channel) and 24 bit ones. The native results must match the Lua ones,
+    -- which come from a copy of the mbm module loaded without mbmcodec.
+    local function colorBitmap(module, bpp, width, data)
+        local stride = ((width * (bpp == 12 and 16 or bpp) + 31) // 32) * 4
+        data = data..string.rep("\0", stride - #data)
+        return module.Bitmap {
+            data = data,
+            len = #data,
+            width = width,
+            height = 1,
+            bpp = bpp,
+            isColor = true,
+            stride = stride,
+            paletteSz = 0,
+            compression = module.ENoBitmapCompression,
+            imgStart = 0,
+            imgLen = #data,
+        }
+    end
+    local palette = {}
+    for i = 0, 255 do
+        palette[1 + i] = string.char(i)
+    end
+    local colorFixtures = {
+        { 4, 3, "\x95\x0F", "\0\0\xFF\xFF\xFF\0\0\xFF\xFF\xFF\xFF\xFF" },
+        { 8, 3, "\x05\x0B\xFF", "\0\0\xFF\xFF\0\x33\xFF\xFF\xFF\xFF\xFF\xFF" },
+        { 8, 256, table.concat(palette) },
+        { 12, 3, "\x0F\x00\x00\xF0\x01\x23", "\0\0\xFF\xFF\0\xFF\0\xFF\x33\x22\x11\xFF" },
+        { 16, 3, "\x00\xF8\xE0\x07\x01\x08", "\0\0\xFF\xFF\0\xFF\0\xFF\x08\0\x08\xFF" },
+        { 24, 3, "\1\2\3\4\5\6\7\8\9", "\1\2\3\xFF\4\5\6\xFF\7\8\9\xFF" },
+    }
+    local nativeCodec = package.loaded.mbmcodec
+    package.loaded.mbmcodec = nil
+    package.loaded.mbm = nil
+    local luaMbm = require("mbm")
+    package.loaded.mbmcodec = nativeCodec
+    package.loaded.mbm = mbm
+    for _, fixture in ipairs(colorFixtures) do
+        local bpp, width, data, expected = table.unpack(fixture)
+        local luaResult = colorBitmap(luaMbm, bpp, width, data):getImageData(32)
+        if expected then
+            assertEquals(hexEscape(luaResult), hexEscape(expected))
+        end
+        assertEquals(hexEscape(colorBitmap(mbm, bpp, width, data):getImageData(32)), hexEscape(luaResult))
+    end
+
+    -- Likewise the native RLE encoder must match the Lua one byte for byte, in particular around the 128 pixel limit on
+    -- the length of runs and raw blocks
+    for pixelSize = 1, 3 do
+        local function pixel(i)
+            return string.rep(string.char(i & 0xFF), pixelSize)
+        end
+        for n = 127, 130 do
+            local run = string.rep(pixel(0), n)
+            local raw = {}
+            for i = 1, n do
+                raw[i] = pixel(i)
+            end
+            raw = table.concat(raw)
+            for _, data in ipairs({ run, raw, run..raw, raw..run, raw..pixel(n), pixel(1)..run..pixel(2) }) do
+                assertEquals(hexEscape(mbm.rleEncode(data, pixelSize)), hexEscape(luaMbm.rleEncode(data, pixelSize)))
+            end
+        end
+    end
+
+    -- The bitmap cache only loads and decodes each file once, and evicts the least recently used file
+    local grey4 = mbm.makeMbm(KUidMultiBitmapFileImage, {
+        { width = 4, height = 4, mode = KColorgCreate256GrayMode, normalizedImgData = grey },
+    })
+    local loads = 0
+    local function load()
+        loads = loads + 1
+        return grey4, mbm.parseMbmHeader(grey4)
+    end
+    local cache = mbm.newBitmapCache(#grey4 + #grey)
+    local _, native = cache:getBitmap("a", 0, load)
+    assertEquals(native.normalizedImgData, grey)
+    assertEquals(select(2, cache:getBitmap("a", 0, load)), native)
+    assertEquals(cache:getBitmap("a", 1, load), nil)
+    assertEquals(loads, 1)
+    assertEquals(cache:getStats(), { entries = 1, size = #grey4 + #grey, hits = 1, misses = 1 })
+    cache:getBitmap("b", 0, load)
+    assertEquals(loads, 2)
+    assertEquals(cache:getStats(), { entries = 1, size = #grey4 + #grey, hits = 1, misses = 2 })
+    cache:getBitmap("a", 0, load)
+    assertEquals(loads, 3)
+
+    -- IOOPEN handles stream through the iohandler's fileop rather than buffering the whole file
+    local ioh = require("defaultiohandler")
+    local tmpName = os.tmpname()
+    ioh.fsmap("C:\\", tmpName.."_")
+    local rt = require("runtime").newRuntime(ioh)
+    rt:setCwd("C:\\")
+    local h = assert(rt:IOOPEN("io.txt", KIoOpenModeReplace | KIoOpenFormatText))
+    assertEquals(rt:IOWRITE(h, "one"), KErrNone)
+    assertEquals(rt:IOWRITE(h, "two"), KErrNone)
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    h = assert(rt:IOOPEN("io.txt", KIoOpenModeOpen | KIoOpenFormatText))
+    assertEquals({ rt:IOREAD(h, 255) }, { "one" })
+    assertEquals({ rt:IOREAD(h, 2) }, { "tw", KErrRecord })
+    assertEquals({ rt:IOREAD(h, 255) }, { nil, KErrEof })
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    h = assert(rt:IOOPEN("io.txt", KIoOpenModeOpen | KIoOpenAccessUpdate | KIoOpenAccessRandom))
+    assertEquals({ rt:IOSEEK(h, KIoSeekFromStart, 5) }, { KErrNone, 5 })
+    assertEquals({ rt:IOREAD(h, 3) }, { "two" })
+    assertEquals({ rt:IOSEEK(h, KIoSeekFromCurrent, -3) }, { KErrNone, 5 })
+    assertEquals(rt:IOWRITE(h, "TWO"), KErrNone)
+    assertEquals({ rt:IOSEEK(h, KIoSeekFromEnd, -2) }, { KErrNone, 8 })
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    h = assert(rt:IOOPEN("io.txt", KIoOpenModeAppend | KIoOpenAccessUpdate))
+    assertEquals(rt:IOWRITE(h, "three"), KErrNone)
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    h = assert(rt:IOOPEN("io.txt", KIoOpenModeOpen))
+    assertEquals({ rt:IOREAD(h, 255) }, { "one\r\nTWO\r\nthree" })
+    assertEquals({ rt:IOREAD(h, 255) }, { nil, KErrEof })
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    -- Replace truncates the file as soon as it's opened, as on a real device
+    h = assert(rt:IOOPEN("io.txt", KIoOpenModeReplace))
+    assertEquals(rt.ioh.fsop("stat", "C:\\io.txt").size, 0)
+    assertEquals(rt:IOCLOSE(h), KErrNone)
+    os.remove(tmpName.."_io.txt")
+
+    -- Sidecar journals of binary databases are hidden from directory listings, but files that merely look like them
+    -- aren't
+    assertEquals(rt.ioh.fsop("mkdir", "C:\\jnl\\"), KErrNone)
+    local jnlFiles = {
+        ["test.db"] = "",
+        ["test.db.jnl"] = database.KJournalMarker.."\n",
+        ["notes.txt.jnl"] = "notes",
+        ["other.jnl"] = database.KJournalMarker.."\n",
+    }
+    for name, data in pairs(jnlFiles) do
+        assertEquals(rt.ioh.fsop("write", "C:\\jnl\\"..name, data), KErrNone)
+    end
+    assertEquals(rt.ioh.fsop("write", "C:\\jnl\\notes.txt", ""), KErrNone)
+    assertEquals(rt:ls("C:\\jnl"), { "C:\\jnl\\notes.txt", "C:\\jnl\\notes.txt.jnl", "C:\\jnl\\other.jnl",
+        "C:\\jnl\\test.db" })
+    assertEquals(rt:getDbJournalPath("C:\\jnl\\test.db"), "C:\\jnl\\test.db.jnl")
+    assertEquals(rt:getDbJournalPath("C:\\jnl\\notes.txt"), nil)
+    for name in pairs(jnlFiles) do
+        os.remove(tmpName.."_jnl/"..name)
+    end
+    os.remove(tmpName.."_jnl/notes.txt")
+    os.remove(tmpName.."_jnl")
+    os.remove(tmpName)
+
     local dialog = require("dialog")
     -- For simplicity, test assuming a monospaced font where all characters are one unit wide
     local widthFn = function(text) return #text end
@@ -382,6 +382,10 @@ public class PsiLuaEnv {
                 return 1
             }
             op = .rename(dest)
+        case "flush":
+            // Writes are synchronous, so there's never anything outstanding
+            L.push(0)
+            return 1
         default:
             print("Unimplemented fsop \(cmd)!")
             L.push(Fs.Err.notReady.rawValue)
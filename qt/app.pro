@@ -59,6 +59,7 @@ DEFINES += OPOLUA_VERSION=$$VERSION OPOLUA_BUILD_NUM=$$BUILD_NUMBER
 
 HEADERS += \
     aboutwindow.h \
+    appindex.h \
     asynchandle.h \
     audioplayer.h \
     codeview.h \
@@ -73,6 +74,8 @@ HEADERS += \
     linenumberarea.h \
     logwindow.h \
     luasupport.h \
+    mappedbuffer.h \
+    mbmcodec.h \
     luatokenizer.h \
     mainwindow.h \
     oplapplication.h \
@@ -82,6 +85,8 @@ HEADERS += \
     oplruntimegui.h \
     oplscreenwidget.h \
     opltokenizer.h \
+    pfsdb.h \
+    pixelscaler.h \
     stackmodel.h \
     stackview.h \
     tokenizer.h \
@@ -89,6 +94,7 @@ HEADERS += \
 
 SOURCES += \
     aboutwindow.cpp \
+    appindex.cpp \
     asynchandle.cpp \
     audioplayer.cpp \
     codeview.cpp \
@@ -103,6 +109,8 @@ SOURCES += \
     logwindow.cpp \
     lua.cpp \
     luasupport.cpp \
+    mappedbuffer.cpp \
+    mbmcodec.cpp \
     luatokenizer.cpp \
     main.cpp \
     mainwindow.cpp \
@@ -112,6 +120,8 @@ SOURCES += \
     oplruntimegui.cpp \
     oplscreenwidget.cpp \
     opltokenizer.cpp \
+    pfsdb.cpp \
+    pixelscaler.cpp \
     stackmodel.cpp \
     stackview.cpp \
     updownlineedit.cpp \
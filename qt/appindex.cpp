@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "appindex.h"
+
+#include "mbmcodec.h"
+#include "pfsdb.h"
+
+#include <QBitmap>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QMutexLocker>
+#include <QPixmap>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QTextCodec>
+#include <QThreadPool>
+#include <QtEndian>
+
+static const quint32 KCacheMagic = 0x58444941; // "AIDX"
+static const qint32 KCacheVersion = 1;
+static const quint16 KLangEnglish = 1; // en_GB, see sis.Locales
+
+AppIndex::AppIndex(QObject* parent)
+    : QObject(parent)
+    , mWatcher(new QFileSystemWatcher)
+{
+    auto cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!cacheDir.isEmpty() && QDir().mkpath(cacheDir + "/apps")) {
+        mCacheDir = cacheDir + "/apps";
+    }
+
+    connect(mWatcher.get(), &QFileSystemWatcher::directoryChanged, this, [this](const QString& path) {
+        QMutexLocker lock(&mMutex);
+        invalidateListingsLocked(path);
+        if (!QFileInfo(path).isDir()) {
+            // The watcher stops watching directories that are deleted
+            mWatchedPaths.remove(path);
+        }
+        // Entries are checked against the file's size and mtime anyway, this is just so deleted apps don't linger
+        for (auto i = mEntries.begin(); i != mEntries.end(); ) {
+            if (!QFileInfo::exists(i.key())) {
+                i = mEntries.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    });
+}
+
+AppIndex::~AppIndex()
+{
+}
+
+void AppIndex::invalidateListingsLocked(const QString& nativeDir)
+{
+    mInvalidations++;
+    const QString prefix = nativeDir + "|";
+    for (auto i = mListings.begin(); i != mListings.end(); ) {
+        if (i.key().startsWith(prefix)) {
+            i = mListings.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+static QImage decodeIcon(const MbmBitmapInfo& info, const char* data, qint64 len)
+{
+    if (info.width == 0 || info.height == 0) {
+        return QImage();
+    }
+    const QByteArray decoded = MbmCodec::decode(info, data, len);
+    if (decoded.isNull()) {
+        return QImage();
+    }
+    QImage result(info.width, info.height, info.isColor ? QImage::Format_RGB32 : QImage::Format_Grayscale8);
+    result.fill(0);
+    if (!MbmCodec::imageData(info, decoded, info.isColor ? 32 : 8, result.bits(), result.bytesPerLine())) {
+        return QImage();
+    }
+    return result;
+}
+
+bool AppIndex::parseAif(const QByteArray& contents, AppIndexEntry& result)
+{
+    static QTextCodec* codec = QTextCodec::codecForName("Windows-1252");
+    const char* data = contents.constData();
+    const qint64 len = contents.size();
+    const quint8* bytes = reinterpret_cast<const quint8*>(data);
+    auto u16 = [bytes](qint64 pos) { return qFromLittleEndian<quint16>(bytes + pos); };
+    auto u32 = [bytes](qint64 pos) { return qFromLittleEndian<quint32>(bytes + pos); };
+    result = AppIndexEntry();
+
+    if (len >= 21 && memcmp(data, "OPLObjectFile**\0", 16) == 0) {
+        // Series 3 OPA, which (if it has a PIC header after the source name) has its AIF metadata built in
+        const qint64 pos = 21 + bytes[20];
+        if (pos + 6 > len || memcmp(data + pos + 2, "PIC\xDC", 4) != 0) {
+            return false;
+        }
+        const qint64 picDataPos = pos + 2;
+        const qint64 picLen = std::min<qint64>(u16(pos), len - picDataPos);
+        const qint64 infoPos = picDataPos + picLen;
+        if (infoPos + 2 + 14 > len) {
+            return false;
+        }
+        // This is actually the default filename, but that seems to be constructed from the APP name plus EXT
+        QByteArray name(data + infoPos + 2, (int)qstrnlen(data + infoPos + 2, 14));
+        const int dot = name.lastIndexOf('.');
+        if (dot >= 0) {
+            name.truncate(dot);
+        }
+        result.appName = codec->toUnicode(name);
+        for (const auto& info : MbmCodec::parse(data + picDataPos, picLen)) {
+            auto img = decodeIcon(info, data + picDataPos, picLen);
+            if (!img.isNull()) {
+                result.icons.append({ img, QImage() });
+            }
+        }
+        result.valid = true;
+        return true;
+    }
+
+    if (len < 20 || u32(0) != MbmCodec::KUidDirectFileStore || u32(4) != MbmCodec::KUidAppInfoFile8
+        || u32(12) != PfsDatabase::uidsChecksum(data)) {
+        return false;
+    }
+    result.uid = u32(8);
+    qint64 pos = u32(16); // trailerOffset
+    if (pos >= len) {
+        return false;
+    }
+    const int nCaptions = bytes[pos++] / 2;
+    bool haveEnglish = false;
+    for (int i = 0; i < nCaptions; i++, pos += 6) {
+        if (pos + 6 > len) {
+            return false;
+        }
+        const qint64 offset = u32(pos);
+        const quint16 langCode = u16(pos + 4);
+        if (offset >= len) {
+            return false;
+        }
+        const qint64 captionLen = std::min<qint64>(std::max(0, (bytes[offset] - 2) / 4), len - offset - 1);
+        // Prefer en_GB, otherwise use whichever comes first
+        if (langCode == KLangEnglish || (i == 0 && !haveEnglish)) {
+            result.appName = codec->toUnicode(data + offset + 1, (int)captionLen);
+            haveEnglish = langCode == KLangEnglish;
+        }
+    }
+
+    if (pos >= len) {
+        return false;
+    }
+    const int nIcons = bytes[pos++] / 2;
+    for (int i = 0; i < nIcons; i++, pos += 6) {
+        if (pos + 6 > len) {
+            return false;
+        }
+        MbmBitmapInfo bitmap;
+        if (!MbmCodec::parseBitmap(data, len, u32(pos), bitmap)) {
+            return false;
+        }
+        auto img = decodeIcon(bitmap, data, len);
+        if (img.isNull()) {
+            continue;
+        }
+        MbmBitmapInfo mask;
+        QImage maskImg;
+        if (MbmCodec::parseBitmap(data, len, bitmap.imgStart + bitmap.imgLen, mask)) {
+            maskImg = decodeIcon(mask, data, len);
+        }
+        result.icons.append({ img, maskImg });
+    }
+    result.valid = true;
+    return true;
+}
+
+static bool readCacheFile(const QString& path, qint64 size, qint64 mtime, AppIndexEntry& result)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_5_15);
+    quint32 magic = 0;
+    qint32 version = 0;
+    qint64 cachedSize = -1, cachedMtime = -1;
+    stream >> magic >> version >> cachedSize >> cachedMtime;
+    if (magic != KCacheMagic || version != KCacheVersion || cachedSize != size || cachedMtime != mtime) {
+        return false;
+    }
+    AppIndexEntry entry;
+    stream >> entry.valid >> entry.appName >> entry.uid >> entry.icons;
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+    result = entry;
+    return true;
+}
+
+static void writeCacheFile(const QString& path, qint64 size, qint64 mtime, const AppIndexEntry& entry)
+{
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << KCacheMagic << KCacheVersion << size << mtime;
+    stream << entry.valid << entry.appName << entry.uid << entry.icons;
+    f.commit();
+}
+
+AppIndexEntry AppIndex::loadEntry(const QString& nativePath, qint64 size, qint64 mtime, const QString& cacheDir)
+{
+    AppIndexEntry result;
+    QString cachePath;
+    if (!cacheDir.isEmpty()) {
+        auto hash = QCryptographicHash::hash(nativePath.toUtf8(), QCryptographicHash::Sha1).toHex();
+        cachePath = cacheDir + "/" + QString::fromLatin1(hash);
+        if (readCacheFile(cachePath, size, mtime, result)) {
+            return result;
+        }
+    }
+
+    QFile f(nativePath);
+    if (!f.open(QIODevice::ReadOnly)) {
+        // Don't cache this, it might just be a permissions thing
+        return result;
+    }
+    if (!parseAif(f.readAll(), result)) {
+        qDebug("Failed to parse %s", qPrintable(nativePath));
+    }
+    if (!cachePath.isEmpty()) {
+        writeCacheFile(cachePath, size, mtime, result);
+    }
+    return result;
+}
+
+QVector<AppIndexEntry> AppIndex::getEntries(const QStringList& nativePaths)
+{
+    const int n = nativePaths.count();
+    QVector<AppIndexEntry> result(n);
+    QVector<CachedEntry> stats(n);
+    for (int i = 0; i < n; i++) {
+        QFileInfo info(nativePaths[i]);
+        stats[i].size = info.size();
+        stats[i].mtime = info.lastModified().toMSecsSinceEpoch();
+    }
+
+    QVector<int> needed;
+    {
+        QMutexLocker lock(&mMutex);
+        for (int i = 0; i < n; i++) {
+            auto it = mEntries.constFind(nativePaths[i]);
+            if (it != mEntries.constEnd() && it->size == stats[i].size && it->mtime == stats[i].mtime) {
+                result[i] = it->entry;
+            } else {
+                needed.append(i);
+            }
+        }
+    }
+    if (needed.isEmpty()) {
+        return result;
+    }
+
+    const QString cacheDir = mCacheDir;
+    if (needed.count() == 1) {
+        const int i = needed[0];
+        result[i] = loadEntry(nativePaths[i], stats[i].size, stats[i].mtime, cacheDir);
+    } else {
+        QThreadPool pool;
+        for (int i : needed) {
+            pool.start([&nativePaths, &stats, &result, &cacheDir, i] {
+                result[i] = loadEntry(nativePaths[i], stats[i].size, stats[i].mtime, cacheDir);
+            });
+        }
+        pool.waitForDone();
+    }
+
+    QMutexLocker lock(&mMutex);
+    for (int i : needed) {
+        mEntries.insert(nativePaths[i], { stats[i].size, stats[i].mtime, result[i] });
+    }
+    return result;
+}
+
+QIcon AppIndex::makeIcon(const AppIndexEntry& entry)
+{
+    QIcon icon;
+    for (const auto& bitmapAndMask : entry.icons) {
+        QPixmap img = QPixmap::fromImage(bitmapAndMask.first);
+        if (!bitmapAndMask.second.isNull()) {
+            img.setMask(QBitmap::fromImage(bitmapAndMask.second));
+        }
+        icon.addPixmap(img);
+    }
+    return icon;
+}
+
+QStringList AppIndex::entryList(const QString& nativeDir, const QStringList& nameFilters, QDir::Filters filters)
+{
+    const QString key = nativeDir + "|" + QString::number((int)filters) + "|" + nameFilters.join("|");
+    QMutexLocker lock(&mMutex);
+    auto it = mListings.constFind(key);
+    if (it != mListings.constEnd()) {
+        return *it;
+    }
+
+    // The watch has to be in place before the directory is listed, otherwise a change in between would be missed.
+    // QFileSystemWatcher isn't thread-safe and lives on the main thread, so adding it has to be queued, which means
+    // it may well not be in place yet: so as soon as it is, anything listed before then is thrown away. Likewise the
+    // listing isn't cached if anything was invalidated while it was being made.
+    if (!nativeDir.startsWith(":") && !mWatchedPaths.contains(nativeDir)) {
+        mWatchedPaths.insert(nativeDir);
+        auto watcher = mWatcher.get();
+        QMetaObject::invokeMethod(watcher, [this, watcher, nativeDir] {
+            watcher->addPath(nativeDir);
+            QMutexLocker lock(&mMutex);
+            invalidateListingsLocked(nativeDir);
+        }, Qt::QueuedConnection);
+    }
+
+    const quint64 invalidations = mInvalidations;
+    lock.unlock();
+    const QStringList result = QDir(nativeDir).entryList(nameFilters, filters);
+    lock.relock();
+    if (mInvalidations == invalidations) {
+        mListings.insert(key, result);
+    }
+    return result;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef APPINDEX_H
+#define APPINDEX_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QHash>
+#include <QIcon>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QPair>
+#include <QScopedPointer>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+
+class QFileSystemWatcher;
+
+// Finds out the names and icons of installed apps, by parsing their AIFs (or the metadata built in to Series 3 OPAs)
+// natively rather than via parseAifToNative() in aif.lua, so that it doesn't need a Lua interpreter and can parse lots
+// of them in parallel. Results are cached in memory and on disk, keyed by native path and checked against the file's
+// size and modification time, and directory listings are cached until the filesystem watcher reports a change. All
+// the public functions may be called from any thread.
+
+struct AppIndexEntry {
+    bool valid = false;
+    QString appName;
+    uint32_t uid = 0;
+    QVector<QPair<QImage, QImage>> icons; // Bitmap and mask (which may be null) of each icon
+};
+
+class AppIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit AppIndex(QObject* parent = nullptr);
+    ~AppIndex();
+
+    // Parses an AIF or OPA file, like parseAif() in aif.lua. Returns false if data isn't one.
+    static bool parseAif(const QByteArray& data, AppIndexEntry& result);
+
+    // Returns entries for each of the given native paths, in the same order. Any that aren't already cached (or whose
+    // files have changed since) are parsed in parallel.
+    QVector<AppIndexEntry> getEntries(const QStringList& nativePaths);
+
+    // Returns the icon made from an entry's icons, ready for use in an OplAppInfo.
+    static QIcon makeIcon(const AppIndexEntry& entry);
+
+    // Like QDir(nativeDir).entryList(nameFilters, filters), but cached until something in nativeDir changes.
+    QStringList entryList(const QString& nativeDir, const QStringList& nameFilters, QDir::Filters filters);
+
+private:
+    struct CachedEntry {
+        qint64 size;
+        qint64 mtime;
+        AppIndexEntry entry;
+    };
+    static AppIndexEntry loadEntry(const QString& nativePath, qint64 size, qint64 mtime, const QString& cacheDir);
+    void invalidateListingsLocked(const QString& nativeDir);
+
+private:
+    QScopedPointer<QFileSystemWatcher> mWatcher;
+    QString mCacheDir; // Empty if there's nowhere to cache to
+    QMutex mMutex;
+    //// BEGIN protected by mMutex
+    QHash<QString, CachedEntry> mEntries;
+    QHash<QString, QStringList> mListings; // Keyed by dir, filters and nameFilters
+    quint64 mInvalidations = 0; // Count of invalidateListingsLocked() calls, so entryList() can tell if it raced one
+    QSet<QString> mWatchedPaths;
+    //// END protected by mMutex
+};
+
+#endif // APPINDEX_H
@@ -4,8 +4,13 @@
 #include "asynchandle.h"
 #include "oplruntime.h"
 
+#include <QAtomicInteger>
+
+// Handles are created on both the main and Lua threads
+static QAtomicInteger<quint64> nextId;
+
 AsyncHandle::AsyncHandle(QObject *parent, uint32_t ref, Type type)
-    : QObject(parent), mType(type), mRef(ref)
+    : QObject(parent), mType(type), mRef(ref), mId(++nextId)
 {
 }
 
@@ -19,6 +24,11 @@ AsyncHandle::Type AsyncHandle::type() const
     return mType;
 }
 
+quint64 AsyncHandle::id() const
+{
+    return mId;
+}
+
 void AsyncHandle::finished(int code)
 {
     static_cast<OplRuntime*>(parent())->asyncFinished(this, code);
@@ -17,17 +17,21 @@ public:
         after,
         at,
         playsound,
+        fileop,
     };
 
     explicit AsyncHandle(QObject *parent, uint32_t ref, Type type);
 
     uint32_t ref() const;
     Type type() const;
+    // Unique for the lifetime of the process, unlike ref (which is reused) or the handle's address (which can be)
+    quint64 id() const;
     void finished(int code);
 
 private:
     Type mType;
     uint32_t mRef;
+    quint64 mId;
 };
 
 #endif // ASYNCHANDLE_H
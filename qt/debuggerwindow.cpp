@@ -91,6 +91,8 @@ DebuggerWindow::DebuggerWindow(OplRuntime* runtime, QWidget *parent)
 
     mStatusLabel = new QLabel(this);
     ui->statusbar->addWidget(mStatusLabel);
+    mBitmapCacheLabel = new QLabel(this);
+    ui->statusbar->addPermanentWidget(mBitmapCacheLabel);
 
     // Stack info dock widget (do this last as it triggers a debugInfoUpdated)
 
@@ -130,6 +132,17 @@ void DebuggerWindow::debugInfoUpdated()
 {
     const auto info = mRuntime->getDebugInfo();
 
+    if (info.bitmapCache.has_value()) {
+        const auto& cache = *info.bitmapCache;
+        mBitmapCacheLabel->setText(QString("Bitmap cache: %1 entries, %2 KB, %3 hits, %4 misses")
+            .arg(cache.entries)
+            .arg(cache.size / 1024)
+            .arg(cache.hits)
+            .arg(cache.misses));
+    } else {
+        mBitmapCacheLabel->clear();
+    }
+
     if (info.frames.count() == 0) {
         clearBreaks();
         mPauseState = std::nullopt;
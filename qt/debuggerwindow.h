@@ -64,6 +64,7 @@ private:
 private:
     Ui::DebuggerWindow *ui;
     QLabel* mStatusLabel;
+    QLabel* mBitmapCacheLabel;
     OplRuntime* mRuntime;
     QVector<opl::Module> mShownModules;
     QVector<opl::Drawable> mShownDrawables;
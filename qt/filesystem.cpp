@@ -18,17 +18,47 @@
 
 #include "filesystem.h"
 #include "luasupport.h"
+#include "mappedbuffer.h"
 
 #include <QDateTime>
 #include <QDebug>
 #include <QFileInfo>
 #include <QMutexLocker>
+#include <QSaveFile>
 #include <QString>
 
 FileSystemIoHandler::FileSystemIoHandler(QTextCodec& stringCodec)
-    : mSimulatedDrive(0)
+    : mWatcher(new QFileSystemWatcher)
+    , mSimulatedDrive(0)
     , mStringCodec(&stringCodec)
+    , mLastFileHandle(0)
+    , mStopWriter(false)
+    , mWriterThread(nullptr)
 {
+    // Catches anything that changes a cached directory behind our back, such as the user copying files in from the
+    // host. Our own fsops invalidate the cache directly.
+    QObject::connect(mWatcher.get(), &QFileSystemWatcher::directoryChanged, mWatcher.get(), [this](const QString& path) {
+        QMutexLocker lock(&mMutex);
+        if (!QFileInfo(path).isDir()) {
+            // The watcher stops watching directories that are deleted
+            mWatchedPaths.removeOne(path);
+        }
+        invalidateListingLocked(path);
+    });
+
+    mWriterThread = QThread::create([this] { writerThreadFn(); });
+    mWriterThread->start();
+}
+
+FileSystemIoHandler::~FileSystemIoHandler()
+{
+    // The writer drains anything still queued before exiting
+    QMutexLocker lock(&mWriteMutex);
+    mStopWriter = true;
+    mWriteQueued.wakeAll();
+    lock.unlock();
+    mWriterThread->wait();
+    delete mWriterThread;
 }
 
 void FileSystemIoHandler::addMapping(char drive, const QDir& path, bool writable)
@@ -36,14 +66,18 @@ void FileSystemIoHandler::addMapping(char drive, const QDir& path, bool writable
     removeMapping(drive);
     QMutexLocker lock(&mMutex);
     // qDebug("mapping: %c -> %s writable=%d", drive, qPrintable(path.absolutePath()), (int)writable);
-    mPaths[drive] = { writable, false, path.absolutePath() };
+    mPaths[drive] = { writable, false, path.absolutePath(), QSharedPointer<DirNode>::create() };
 }
 
 void FileSystemIoHandler::removeMapping(char drive)
 {
     // qDebug("remove mapping: %c", drive);
     QMutexLocker lock(&mMutex);
-    mPaths.remove(drive);
+    auto iter = mPaths.find(drive);
+    if (iter != mPaths.end()) {
+        unwatchLocked(iter->path);
+        mPaths.erase(iter);
+    }
     if (drive == mSimulatedDrive) {
         mSimulatedDrive = 0;
         mSimulatedPaths.clear();
@@ -54,6 +88,9 @@ void FileSystemIoHandler::removeAllMappings()
 {
     // qDebug("removeAllMappings");
     QMutexLocker lock(&mMutex);
+    for (const Drive& drive : mPaths) {
+        unwatchLocked(drive.path);
+    }
     mPaths.clear();
     mSimulatedDrive = 0;
     mSimulatedPaths.clear();
@@ -89,29 +126,32 @@ void FileSystemIoHandler::makeFsIoHandlerBridge(lua_State *L) const
     lua_pushlightuserdata(L, (void*)this);
     luaL_Reg fns[] = {
         { "fsop", fsop },
+        { "fileop", fileop },
         { nullptr, nullptr },
     };
     luaL_setfuncs(L, fns, 1);
 }
 
+// Every watched directory costs a file descriptor on some platforms (kqueue), so only this many of the most recently
+// listed directories are watched, and older listings are dropped from the cache when their watch is.
+static constexpr int KMaxWatchedDirs = 64;
+
+// Below this it's cheaper to just copy the data
+static constexpr qint64 KMinMappedFileSize = 64 * 1024;
+
 enum EpocError {
     KErrNone = 0,
+    KErrInvalidArgs = -2,
     KErrNotExists = -33,
+    KErrEof = -36,
     KErrAccess = -39,
+    KErrIOCancelled = -48,
     KErrNotReady = -62,
 };
 
-QMap<QString, QString> getEntryListLowerMap(QDir& dir)
-{
-    QMap<QString, QString> result;
-    for (const QString& entry : dir.entryList()) {
-        result[entry.toLower()] = entry;
-    }
-    return result;
-}
-
 QString FileSystemIoHandler::getNativePath(const QString& devicePath, bool* writable) const
 {
+    flushWrites(devicePath);
     QMutexLocker lock(&mMutex);
     const Drive* mapping = nullptr;
     auto result = getNativePathLocked(devicePath, mapping);
@@ -141,45 +181,186 @@ QString FileSystemIoHandler::getNativePathLocked(const QString& devicePath, cons
     mapping = (drvIter == mPaths.end()) ? nullptr : &*drvIter;
     if (mapping) {
 
-        QDir dir(mapping->path);
+        QString path = mapping->path;
+        DirNode* node = mapping->dirCache.data();
 
-        // Now walk through components[1...] doing case-insensitive corrections where necessary
+        // Now walk through components[1...] doing case-insensitive corrections where necessary, using (and filling
+        // in) the directory cache as we go.
         const int n = components.count();
-        if (n == 1) {
-            return mapping->path;
-        }
         for (int i = 1; i < n; i++) {
             const QString& component = components[i];
             QString foundEntry;
-            if (dir.exists(component)) {
-                // qDebug() << dir;
-                // qDebug("Entry %s exists with correct case", qPrintable(component));
-                foundEntry = component;
-            } else {
-                // Try a case-insensitive match
-                auto map = getEntryListLowerMap(dir);
-                foundEntry = map.value(component.toLower());
+            if (node) {
+                populateLocked(node, path);
+                // Prefer an exact match, in case there are entries differing only by case
+                const QStringList candidates = node->entries.value(component.toLower());
+                if (candidates.contains(component)) {
+                    foundEntry = component;
+                } else if (!candidates.isEmpty()) {
+                    foundEntry = candidates.first();
+                }
+                if (foundEntry.isEmpty() || i == n - 1) {
+                    node = nullptr;
+                } else {
+                    // component must be a directory
+                    auto& child = node->children[foundEntry];
+                    if (!child) {
+                        child = QSharedPointer<DirNode>::create();
+                    }
+                    node = child.data();
+                }
             }
 
             if (foundEntry.isEmpty()) {
-                // Just go with whatever was requested
+                // Just go with whatever was requested (and for any subsequent components too, since they can't exist)
                 // qDebug("Entry not found, using %s", qPrintable(component));
                 foundEntry = component;
-            } else {
-                // qDebug("Found %s for component %s", qPrintable(foundEntry), qPrintable(component));
             }
+            path = QDir(path).filePath(foundEntry);
+        }
+        return path;
+    }
+    return QString();
+}
+
+void FileSystemIoHandler::populateLocked(DirNode* node, const QString& nativeDirPath) const
+{
+    if (node->populated) {
+        return;
+    }
+
+    QDir dir(nativeDirPath);
+    if (!dir.exists()) {
+        // Leave it unpopulated, so that it gets listed if something subsequently creates it
+        node->entries.clear();
+        node->children.clear();
+        return;
+    }
+
+    node->entries.clear();
+    const auto names = dir.entryList(QDir::Dirs | QDir::Files | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
+    for (const QString& name : names) {
+        node->entries[name.toLower()].append(name);
+    }
+    // Any subdirectories which have gone away since we last looked must not keep their listings
+    for (auto i = node->children.begin(); i != node->children.end(); ) {
+        if (node->entries.value(i.key().toLower()).contains(i.key())) {
+            ++i;
+        } else {
+            i = node->children.erase(i);
+        }
+    }
+    node->populated = true;
+    watchLocked(nativeDirPath);
+}
+
+// Drives may be nested inside one another, so the same directory can be cached under more than one of them.
+QVector<FileSystemIoHandler::DirNode*> FileSystemIoHandler::findDirNodesLocked(const QString& nativeDirPath) const
+{
+    QVector<DirNode*> result;
+    for (const Drive& drive : mPaths) {
+        DirNode* node = drive.dirCache.data();
+        const QString prefix = drive.path.endsWith('/') ? drive.path : drive.path + "/";
+        if (nativeDirPath != drive.path) {
+            if (!nativeDirPath.startsWith(prefix)) {
+                continue;
+            }
+            const auto components = nativeDirPath.mid(prefix.size()).split('/', Qt::SkipEmptyParts);
+            for (const QString& component : components) {
+                node = node->children.value(component).data();
+                if (!node) {
+                    break;
+                }
+            }
+        }
+        if (node) {
+            result.append(node);
+        }
+    }
+    return result;
+}
 
-            if (i == n - 1) {
-                // That's the full path
-                return dir.filePath(foundEntry);
-            } else {
-                // component must be a directory
-                dir = QDir(dir.filePath(foundEntry));
-                // and continue
+// Called when nativePath has been created, deleted or renamed. It's the parent's listing that's now out of date, plus
+// any cached subtree under nativePath itself.
+void FileSystemIoHandler::invalidateLocked(const QString& nativePath, bool includeAncestors) const
+{
+    QFileInfo info(nativePath);
+    QString dirPath = info.absolutePath();
+    for (DirNode* parent : findDirNodesLocked(dirPath)) {
+        parent->populated = false;
+        parent->children.remove(info.fileName());
+    }
+
+    if (includeAncestors) {
+        // For mkdir, which may have created any number of intermediate directories
+        while (true) {
+            QString up = QFileInfo(dirPath).absolutePath();
+            if (up == dirPath) {
+                break;
             }
+            dirPath = up;
+            invalidateListingLocked(dirPath);
         }
     }
-    return QString();
+}
+
+void FileSystemIoHandler::invalidateListingLocked(const QString& nativeDirPath) const
+{
+    for (DirNode* node : findDirNodesLocked(nativeDirPath)) {
+        node->populated = false;
+    }
+}
+
+// QFileSystemWatcher isn't thread-safe and lives on the main thread, whereas this may be called from the interpreter
+// thread, hence the queued invocations. Anything which changes between the directory being listed and the watch being
+// added wouldn't be noticed, so the listing is thrown away again once the watch is in place.
+void FileSystemIoHandler::watchLocked(const QString& nativeDirPath) const
+{
+    if (nativeDirPath.startsWith(":")) {
+        // Resources can't change
+        return;
+    }
+    if (mWatchedPaths.removeOne(nativeDirPath)) {
+        // Already watched, just make it the most recent
+        mWatchedPaths.append(nativeDirPath);
+        return;
+    }
+    mWatchedPaths.append(nativeDirPath);
+    auto watcher = mWatcher.get();
+    QMetaObject::invokeMethod(watcher, [this, watcher, nativeDirPath] {
+        watcher->addPath(nativeDirPath);
+        QMutexLocker lock(&mMutex);
+        invalidateListingLocked(nativeDirPath);
+    }, Qt::QueuedConnection);
+
+    if (mWatchedPaths.count() > KMaxWatchedDirs) {
+        const QString oldest = mWatchedPaths.takeFirst();
+        // Without a watch, the listing can't be trusted any more
+        invalidateListingLocked(oldest);
+        QMetaObject::invokeMethod(watcher, [watcher, oldest] {
+            watcher->removePath(oldest);
+        }, Qt::QueuedConnection);
+    }
+}
+
+void FileSystemIoHandler::unwatchLocked(const QString& nativeDirPath) const
+{
+    const QString prefix = nativeDirPath.endsWith('/') ? nativeDirPath : nativeDirPath + "/";
+    QStringList paths;
+    for (auto i = mWatchedPaths.begin(); i != mWatchedPaths.end(); ) {
+        if (*i == nativeDirPath || i->startsWith(prefix)) {
+            paths.append(*i);
+            i = mWatchedPaths.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    if (!paths.isEmpty()) {
+        auto watcher = mWatcher.get();
+        QMetaObject::invokeMethod(watcher, [watcher, paths] {
+            watcher->removePaths(paths);
+        }, Qt::QueuedConnection);
+    }
 }
 
 int FileSystemIoHandler::fsop(lua_State* L)
@@ -188,7 +369,8 @@ int FileSystemIoHandler::fsop(lua_State* L)
     QString cmd(lua_tostring(L, 1));
     QString path(self->tolocalstring(L, 2));
 
-    const bool cmdReturnsResult = cmd == "read" || cmd == "dir" || cmd == "stat" || cmd == "disks" || cmd == "getNativePath";
+    const bool cmdReturnsResult = cmd == "read" || cmd == "dir" || cmd == "stat" || cmd == "disks" || cmd == "getNativePath"
+        || cmd == "open";
     auto err = [L, cmdReturnsResult](int err) {
         if (cmdReturnsResult) {
             lua_pushnil(L);
@@ -200,6 +382,23 @@ int FileSystemIoHandler::fsop(lua_State* L)
         }
     };
 
+    // Anything which might observe a file must wait for queued writes to it to land first
+    if (cmd == "dir" || cmd == "rmdir") {
+        self->flushWrites();
+    } else if (cmd != "write" && cmd != "append" && cmd != "mkdir" && cmd != "disks") {
+        self->flushWrites(path);
+        if (cmd == "rename") {
+            // A write still queued for the destination would otherwise land on top of the renamed file
+            self->flushWrites(self->tolocalstring(L, 3));
+        }
+    }
+
+    if (cmd == "flush") {
+        // fsop("flush", path) waits for any queued writes to path to be committed, and returns the error from the most
+        // recent one which failed.
+        return err(self->takeWriteError(path));
+    }
+
     QMutexLocker lock(&self->mMutex);
     if (self->mSimulatedDrive && path == QString(QChar(self->mSimulatedDrive)) + ":\\") {
         // Some special cases required here
@@ -225,13 +424,15 @@ int FileSystemIoHandler::fsop(lua_State* L)
         return err(KErrNotReady);
     }
 
-    bool isWriteOp = cmd == "write" || cmd == "delete" || cmd == "mkdir" || cmd == "rmdir" || cmd == "rename";
+    const bool openForWrite = cmd == "open" && QByteArray(luaL_optstring(L, 3, "r")) != "r";
+    bool isWriteOp = cmd == "write" || cmd == "append" || cmd == "delete" || cmd == "mkdir" || cmd == "rmdir"
+        || cmd == "rename" || openForWrite;
     if (isWriteOp && !mapping->writable) {
         return err(KErrAccess);
     }
 
     // We delay auto-creating the mapping dir until the first time something tries to write to it
-    if ((cmd == "write" || cmd == "mkdir") && !mapping->createChecked) {
+    if ((cmd == "write" || cmd == "append" || cmd == "mkdir" || openForWrite) && !mapping->createChecked) {
         mapping->createChecked = true;
         QFileInfo info(mapping->path);
         if (!info.exists()) {
@@ -242,6 +443,13 @@ int FileSystemIoHandler::fsop(lua_State* L)
     mapping = nullptr; // Make sure it's not used after unlocking
 
     if (cmd == "read") {
+        // fsop("read", path, "map") may return a MappedBuffer instead of a string, for callers which only need
+        // sub/byte/unpack access to large files.
+        if (lua_type(L, 3) == LUA_TSTRING && QByteArray(lua_tostring(L, 3)) == "map"
+                && QFileInfo(nativePath).size() >= KMinMappedFileSize && !self->isOpenForWrite(nativePath)
+                && pushMappedBuffer(L, nativePath)) {
+            return 1;
+        }
         QFile f(nativePath);
         if (!f.open(QFile::ReadOnly)) {
             return err(KErrNotExists);
@@ -290,32 +498,45 @@ int FileSystemIoHandler::fsop(lua_State* L)
         }
         pushValue(L, result);
         return 1;
-    } else if (cmd == "write") {
-        QFile f(nativePath);
-        if (!f.open(QFile::ReadWrite)) {
-            // TODO should do accessdenied for readonly
+    } else if (cmd == "write" || cmd == "append") {
+        // The write itself happens on the writer thread, so check up front for the errors that can be predicted
+        QFileInfo info(nativePath);
+        if (info.isDir() || !info.dir().exists()) {
             return err(KErrNotReady);
         }
+        // Any failure of an earlier write to this file is reported here (or by flush) since the write itself couldn't
+        // report it. A full write replaces whatever went missing, but an append would be on top of a gap so the
+        // caller needs to know to rewrite the file instead.
+        int pendingErr = self->takeWriteError(path);
+        if (pendingErr != KErrNone && cmd == "append") {
+            return err(pendingErr);
+        }
         size_t sz = 0;
         const char* data = lua_tolstring(L, 3, &sz);
-        auto bytes = QByteArray::fromRawData(data, sz);
-        auto written = f.write(bytes);
-        if ((size_t)written != sz) {
-            return err(KErrNotReady);
-        }
+        detachMappedBuffers(nativePath);
+        self->queueWrite(path, nativePath, QByteArray(data, sz), cmd == "append");
         lua_pushinteger(L, KErrNone);
         return 1;
     } else if (cmd == "mkdir") {
         QFileInfo info(nativePath);
-        if (info.dir().mkpath(info.fileName())) {
+        bool ok = info.dir().mkpath(info.fileName());
+        lock.relock();
+        self->invalidateLocked(nativePath, true);
+        lock.unlock();
+        if (ok) {
             lua_pushinteger(L, KErrNone);
         } else {
             lua_pushinteger(L, KErrNotReady);
         }
         return 1;
     } else if (cmd == "delete") {
+        detachMappedBuffers(nativePath);
         QFile f(nativePath);
-        if (f.remove()) {
+        bool ok = f.remove();
+        lock.relock();
+        self->invalidateLocked(nativePath);
+        lock.unlock();
+        if (ok) {
             lua_pushinteger(L, KErrNone);
         } else {
             lua_pushinteger(L, KErrNotReady);
@@ -331,14 +552,52 @@ int FileSystemIoHandler::fsop(lua_State* L)
         } else if (!destWritable) {
             return err(KErrAccess);
         }
+        detachMappedBuffers(nativePath);
+        detachMappedBuffers(destNative);
         QFile f(nativePath);
-        if (f.rename(destNative)) {
+        bool ok = f.rename(destNative);
+        lock.relock();
+        self->invalidateLocked(nativePath);
+        self->invalidateLocked(destNative);
+        lock.unlock();
+        if (ok) {
             lua_pushinteger(L, KErrNone);
             return 1;
         } else {
             qDebug("Failed to rename %s to %s", qPrintable(path), qPrintable(dest));
             return err(KErrNotReady);
         }
+    } else if (cmd == "open") {
+        // fsop("open", path, access) where access is "r", "r+" or "w+" with the same meanings as for io.open().
+        // Returns a handle to be used with fileop().
+        QString access(luaL_optstring(L, 3, "r"));
+        QIODevice::OpenMode openMode;
+        if (access == "r") {
+            openMode = QFile::ReadOnly;
+        } else if (access == "r+") {
+            openMode = QFile::ReadWrite | QFile::ExistingOnly;
+        } else if (access == "w+") {
+            openMode = QFile::ReadWrite | QFile::Truncate;
+        } else {
+            return luaL_error(L, "Bad access mode '%s' for fsop open", qPrintable(access));
+        }
+        if (openForWrite) {
+            detachMappedBuffers(nativePath);
+        }
+        auto f = QSharedPointer<OpenFile>::create(nativePath, openForWrite);
+        const bool existed = f->file.exists();
+        if (!f->file.open(openMode)) {
+            return err(existed ? KErrNotReady : KErrNotExists);
+        }
+        lock.relock();
+        int h = ++self->mLastFileHandle;
+        self->mOpenFiles.insert(h, f);
+        if (!existed) {
+            self->invalidateLocked(nativePath);
+        }
+        lock.unlock();
+        lua_pushinteger(L, h);
+        return 1;
     } else if (cmd == "getNativePath") {
         // Extension for launcher.lua
         pushValue(L, nativePath);
@@ -350,6 +609,253 @@ int FileSystemIoHandler::fsop(lua_State* L)
 
 }
 
+// fileop(cmd, handle, ...) operates on a handle returned by fsop("open"):
+//   fileop("read", h, maxLen) -> data (empty at end of file)
+//   fileop("readline", h) -> line (without its terminator), or nil, KErrEof
+//   fileop("write", h, data) -> err
+//   fileop("seek", h, whence, offset) -> newPos, where whence is "set", "cur" or "end" and newPos is zero-based
+//   fileop("truncate", h, size) -> err
+//   fileop("close", h) -> err
+int FileSystemIoHandler::fileop(lua_State* L)
+{
+    auto self = reinterpret_cast<const FileSystemIoHandler*>(lua_touserdata(L, lua_upvalueindex(1)));
+    QString cmd(lua_tostring(L, 1));
+    int h = lua_tointeger(L, 2);
+
+    QMutexLocker lock(&self->mMutex);
+    QSharedPointer<OpenFile> f = cmd == "close" ? self->mOpenFiles.take(h) : self->mOpenFiles.value(h);
+    lock.unlock();
+
+    const bool cmdReturnsResult = cmd == "read" || cmd == "readline" || cmd == "seek";
+    auto err = [L, cmdReturnsResult](int err) {
+        if (cmdReturnsResult) {
+            lua_pushnil(L);
+            lua_pushinteger(L, err);
+            return 2;
+        } else {
+            lua_pushinteger(L, err);
+            return 1;
+        }
+    };
+
+    if (!f) {
+        return err(KErrInvalidArgs);
+    }
+
+    if (cmd == "read" || cmd == "readline") {
+        QByteArray data;
+        int result = cmd == "read" ? readFile(*f, luaL_checkinteger(L, 3), data) : readFileLine(*f, data);
+        if (result == KErrEof && cmd == "read") {
+            // Plain reads report end of file by returning no data
+            result = KErrNone;
+        }
+        if (result != KErrNone) {
+            return err(result);
+        }
+        pushValue(L, data);
+        return 1;
+    } else if (cmd == "write") {
+        size_t sz = 0;
+        const char* data = luaL_checklstring(L, 3, &sz);
+        return err(writeFile(*f, QByteArray::fromRawData(data, sz)));
+    } else if (cmd == "seek") {
+        QString whence(luaL_checkstring(L, 3));
+        qint64 offset = luaL_checkinteger(L, 4);
+        QMutexLocker fileLock(&f->mutex);
+        qint64 newPos;
+        if (whence == "set") {
+            newPos = offset;
+        } else if (whence == "cur") {
+            newPos = f->file.pos() + offset;
+        } else if (whence == "end") {
+            newPos = f->file.size() + offset;
+        } else {
+            fileLock.unlock();
+            return luaL_error(L, "Bad whence '%s' for fileop seek", qPrintable(whence));
+        }
+        if (newPos < 0 || newPos > f->file.size() || !f->file.seek(newPos)) {
+            return err(KErrInvalidArgs);
+        }
+        lua_pushinteger(L, newPos);
+        return 1;
+    } else if (cmd == "truncate") {
+        qint64 size = luaL_checkinteger(L, 3);
+        QMutexLocker fileLock(&f->mutex);
+        return err(f->file.resize(size) ? KErrNone : KErrNotReady);
+    } else if (cmd == "close") {
+        QMutexLocker fileLock(&f->mutex);
+        f->file.close();
+        return err(KErrNone);
+    }
+
+    return luaL_error(L, "Unknown fileop '%s'", qPrintable(cmd));
+}
+
+QSharedPointer<FileSystemIoHandler::OpenFile> FileSystemIoHandler::openFile(int handle) const
+{
+    QMutexLocker lock(&mMutex);
+    return mOpenFiles.value(handle);
+}
+
+// A file which can be modified through an open handle mustn't be mapped, since the mapping couldn't be detached first
+bool FileSystemIoHandler::isOpenForWrite(const QString& nativePath) const
+{
+    QMutexLocker lock(&mMutex);
+    for (const auto& f : mOpenFiles) {
+        if (f->writable && f->file.fileName() == nativePath) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int FileSystemIoHandler::readFile(OpenFile& f, qint64 maxLen, QByteArray& result)
+{
+    QMutexLocker lock(&f.mutex);
+    if (maxLen > 0 && f.file.atEnd()) {
+        return KErrEof;
+    }
+    result = f.file.read(maxLen);
+    return KErrNone;
+}
+
+int FileSystemIoHandler::readFileLine(OpenFile& f, QByteArray& result)
+{
+    QMutexLocker lock(&f.mutex);
+    if (f.file.atEnd()) {
+        return KErrEof;
+    }
+    result = f.file.readLine();
+    if (result.endsWith("\r\n")) {
+        result.chop(2);
+    } else if (result.endsWith('\n')) {
+        result.chop(1);
+    } else {
+        // Unterminated data at the end of a text file has never been returned as a record
+        result.clear();
+    }
+    return KErrNone;
+}
+
+int FileSystemIoHandler::writeFile(OpenFile& f, const QByteArray& data, const std::function<bool()>& cancelled)
+{
+    QMutexLocker lock(&f.mutex);
+    if (cancelled && cancelled()) {
+        return KErrIOCancelled;
+    }
+    if (f.file.write(data) != data.size()) {
+        return KErrNotReady;
+    }
+    return KErrNone;
+}
+
+void FileSystemIoHandler::queueWrite(const QString& devicePath, const QString& nativePath, const QByteArray& data,
+    bool append) const
+{
+    QMutexLocker lock(&mWriteMutex);
+    const QString key = writeKey(devicePath);
+    auto iter = mPendingWrites.find(key);
+    if (append && iter != mPendingWrites.end()) {
+        // Tack it on to whatever is already waiting to be written (which may itself be a write or an append)
+        iter->data.append(data);
+    } else {
+        mPendingWrites.insert(key, { nativePath, data, append });
+    }
+    mWriteQueued.wakeAll();
+}
+
+void FileSystemIoHandler::flushWrites(const QString& devicePath) const
+{
+    QMutexLocker lock(&mWriteMutex);
+    if (devicePath.isEmpty()) {
+        while (!mPendingWrites.isEmpty() || !mCommittingPath.isEmpty()) {
+            mWriteCommitted.wait(&mWriteMutex);
+        }
+    } else {
+        const QString key = writeKey(devicePath);
+        while (mPendingWrites.contains(key) || mCommittingPath == key) {
+            mWriteCommitted.wait(&mWriteMutex);
+        }
+    }
+}
+
+int FileSystemIoHandler::takeWriteError(const QString& devicePath) const
+{
+    QMutexLocker lock(&mWriteMutex);
+    return mWriteErrors.take(writeKey(devicePath)); // Which is KErrNone if there isn't one
+}
+
+QString FileSystemIoHandler::writeKey(const QString& devicePath)
+{
+    // Device paths are case-insensitive, and "." and ".." components end up being resolved by the native filesystem,
+    // so all the different ways of naming a file must map to the same key.
+    return QDir::cleanPath(QString(devicePath).replace('\\', '/')).toLower();
+}
+
+void FileSystemIoHandler::writerThreadFn()
+{
+    QMutexLocker lock(&mWriteMutex);
+    while (true) {
+        while (mPendingWrites.isEmpty() && !mStopWriter) {
+            mWriteQueued.wait(&mWriteMutex);
+        }
+        if (mPendingWrites.isEmpty()) {
+            break;
+        }
+        auto iter = mPendingWrites.begin();
+        mCommittingPath = iter.key();
+        PendingWrite write = iter.value();
+        mPendingWrites.erase(iter);
+        lock.unlock();
+
+        bool ok = commitWrite(write);
+
+        lock.relock();
+        if (!ok) {
+            mWriteErrors.insert(mCommittingPath, KErrNotReady);
+        } else if (!write.append) {
+            // A successful write supersedes anything that went wrong earlier (whereas an append doesn't)
+            mWriteErrors.remove(mCommittingPath);
+        }
+        mCommittingPath.clear();
+        mWriteCommitted.wakeAll();
+    }
+}
+
+bool FileSystemIoHandler::commitWrite(const PendingWrite& write)
+{
+    // QSaveFile writes to a temporary file and only renames it over the original once everything (including the
+    // sync to disk) has succeeded, so a failure part way through never leaves a truncated or half-updated file.
+    // Appends can't be done that way, so it's up to whatever format is being appended to to cope with that (see the
+    // database journal for example).
+    const bool existed = QFileInfo::exists(write.nativePath);
+    bool ok;
+    if (write.append) {
+        QFile f(write.nativePath);
+        ok = f.open(QFile::WriteOnly | QFile::Append) && f.write(write.data) == write.data.size() && f.flush();
+        if (!ok) {
+            qWarning("Failed to append to %s: %s", qPrintable(write.nativePath), qPrintable(f.errorString()));
+        }
+    } else {
+        QSaveFile f(write.nativePath);
+        ok = f.open(QFile::WriteOnly) && f.write(write.data) == write.data.size() && f.commit();
+        if (!ok) {
+            qWarning("Failed to write %s: %s", qPrintable(write.nativePath), qPrintable(f.errorString()));
+        }
+    }
+    if (!existed) {
+        QMutexLocker lock(&mMutex);
+        invalidateLocked(write.nativePath);
+    }
+    return ok;
+}
+
+void FileSystemIoHandler::closeAllFiles()
+{
+    QMutexLocker lock(&mMutex);
+    mOpenFiles.clear();
+}
+
 void FileSystemIoHandler::setStringCodec(QTextCodec& codec)
 {
     QMutexLocker lock(&mMutex);
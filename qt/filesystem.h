@@ -21,42 +21,119 @@
 
 #include "luasupport.h"
 
+#include <QDir>
+#include <QFile>
+#include <QFileSystemWatcher>
+#include <QHash>
 #include <QMap>
 #include <QMutex>
-#include <QDir>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QStringList>
 #include <QTextCodec>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <functional>
 
 class FileSystemIoHandler {
 
 public:
     explicit FileSystemIoHandler(QTextCodec& stringCodec);
+    ~FileSystemIoHandler();
     void addMapping(char drive, const QDir& to, bool writable=false);
     void addSimulatedDrive(char drive, const QVector<QString>& files);
     void removeMapping(char drive);
     void removeAllMappings();
     bool isWritable(char drive) const;
     void setStringCodec(QTextCodec& codec);
+    void closeAllFiles();
+    // Blocks until any queued writes to devicePath (or to any file, if devicePath is empty) are committed to disk.
+    void flushWrites(const QString& devicePath = QString()) const;
+    // Returns (and forgets) the EpocError from the most recent queued write to devicePath that failed, or KErrNone.
+    int takeWriteError(const QString& devicePath) const;
+
+    // A file opened with fsop("open"). All access to the QFile (other than its fileName(), which never changes) must be
+    // done with mutex held, since requests for the same handle may be serviced on different threads.
+    struct OpenFile {
+        OpenFile(const QString& path, bool writable) : file(path), writable(writable) {}
+        QFile file;
+        const bool writable;
+        QMutex mutex;
+    };
+    QSharedPointer<OpenFile> openFile(int handle) const;
+    // These return an EpocError code, KErrEof if there's nothing left to read. For requests queued to run later, a write
+    // is skipped (returning KErrIOCancelled) if cancelled() returns true by the time it gets hold of the file.
+    static int readFile(OpenFile& f, qint64 maxLen, QByteArray& result);
+    static int readFileLine(OpenFile& f, QByteArray& result);
+    static int writeFile(OpenFile& f, const QByteArray& data, const std::function<bool()>& cancelled = nullptr);
 
     void makeFsIoHandlerBridge(lua_State *L) const;
     QString getNativePath(const QString& devicePath, bool* writable=nullptr) const;
     QString mappingForDrive(char drive) const;
 
 private:
+    // One node of the per-drive directory cache. The listing is populated lazily the first time a path is resolved
+    // through the directory, and is keyed by case-folded name so that lookups never need to hit the disk. Nodes for
+    // subdirectories hang off their parent, making the whole thing a trie of the drive.
+    struct DirNode {
+        bool populated = false;
+        // lower-cased name -> all the names as they appear on disk (more than one on case-sensitive filesystems)
+        QHash<QString, QStringList> entries;
+        QHash<QString, QSharedPointer<DirNode>> children; // keyed by name as it appears on disk
+    };
+
     struct Drive {
         bool writable;
         mutable bool createChecked;
         QString path;
+        QSharedPointer<DirNode> dirCache;
     };
     static int fsop(lua_State* L);
+    static int fileop(lua_State* L);
     QString getNativePathLocked(const QString& devicePath, const Drive*& mapping) const;
+    bool isOpenForWrite(const QString& nativePath) const;
     QString tolocalstring(lua_State *L, int index) const;
 
+    void populateLocked(DirNode* node, const QString& nativeDirPath) const;
+    QVector<DirNode*> findDirNodesLocked(const QString& nativeDirPath) const;
+    void invalidateLocked(const QString& nativePath, bool includeAncestors=false) const;
+    void invalidateListingLocked(const QString& nativeDirPath) const;
+    void watchLocked(const QString& nativeDirPath) const;
+    void unwatchLocked(const QString& nativeDirPath) const;
+
+    struct PendingWrite {
+        QString nativePath;
+        QByteArray data;
+        bool append;
+    };
+    void queueWrite(const QString& devicePath, const QString& nativePath, const QByteArray& data,
+        bool append = false) const;
+    static QString writeKey(const QString& devicePath);
+    void writerThreadFn();
+    bool commitWrite(const PendingWrite& write);
+
 private:
     mutable QMutex mMutex;
+    QScopedPointer<QFileSystemWatcher> mWatcher;
+    mutable QStringList mWatchedPaths; // Oldest first
     QMap<char, Drive> mPaths;
     QMap<QString, QString> mSimulatedPaths;
     char mSimulatedDrive;
     QTextCodec* mStringCodec;
+    mutable QMap<int, QSharedPointer<OpenFile>> mOpenFiles;
+    mutable int mLastFileHandle;
+
+    // Write-behind queue, guarded by mWriteMutex. Keyed by writeKey() so that later writes to the same file replace
+    // earlier ones which haven't been committed yet, however the path was spelled.
+    mutable QMutex mWriteMutex;
+    mutable QWaitCondition mWriteQueued;
+    mutable QWaitCondition mWriteCommitted;
+    mutable QMap<QString, PendingWrite> mPendingWrites;
+    mutable QMap<QString, int> mWriteErrors; // Failed commits not yet reported by takeWriteError()
+    mutable QString mCommittingPath;
+    bool mStopWriter;
+    QThread* mWriterThread;
 };
 
 #endif // FILESYSTEM_H
@@ -84,6 +84,7 @@ LUA_FILES = \
     ../bin/dumpopo.lua \
     ../bin/dumprsc.lua \
     ../bin/dumpsis.lua \
+    ../bin/importdb.lua \
     ../bin/makesis.lua \
     ../bin/opltotext.lua \
     ../bin/recognize.lua \
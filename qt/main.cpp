@@ -21,12 +21,16 @@
 #include "mainwindow.h"
 #include "oplapplication.h"
 #include "oplruntimegui.h"
+#include "mbmcodec.h"
+#include "pfsdb.h"
 
 static int runCommand(const QStringList& args)
 {
     auto cmdPath = QString(":/lua/") + args[0] + ".lua";
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
+    installPfsDbModule(L);
+    installMbmCodecModule(L);
     OplRuntime::configureLuaResourceSearcher(L);
 
     // Setup arg
@@ -56,6 +60,7 @@ static QStringList validCmds = {
     "dumpopo",
     "dumprsc",
     "dumpsis",
+    "importdb",
     "makesis",
     "opltotext",
     "recognize",
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "mappedbuffer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <string.h>
+
+static const char* KMappedBufferType = "MappedBuffer";
+
+struct MappedBuffer {
+    QFile* file; // Owns the mapping, until the buffer is detached
+    char* copy; // Owns the data once the buffer has been detached
+    const char* data;
+    lua_Integer size;
+};
+
+// Every buffer which is still backed by a mapping, and the path and thread it was mapped on
+struct MappedBufferInfo {
+    QString path;
+    QThread* thread;
+};
+static QMutex gMappedBuffersMutex;
+static QHash<MappedBuffer*, MappedBufferInfo> gMappedBuffers;
+
+static lua_CFunction origSub = nullptr;
+static lua_CFunction origByte = nullptr;
+static lua_CFunction origUnpack = nullptr;
+static lua_CFunction origPacksize = nullptr;
+
+static MappedBuffer* toBuffer(lua_State* L, int idx)
+{
+    if (lua_type(L, idx) != LUA_TUSERDATA) {
+        return nullptr;
+    }
+    return static_cast<MappedBuffer*>(luaL_testudata(L, idx, KMappedBufferType));
+}
+
+// These two follow the index conventions of lstrlib.c
+
+static lua_Integer posrelatI(lua_Integer pos, lua_Integer len)
+{
+    if (pos > 0) {
+        return pos;
+    } else if (pos == 0 || pos < -len) {
+        return 1;
+    } else {
+        return len + pos + 1;
+    }
+}
+
+static lua_Integer getendpos(lua_State* L, int arg, lua_Integer def, lua_Integer len)
+{
+    lua_Integer pos = luaL_optinteger(L, arg, def);
+    if (pos > len) {
+        return len;
+    } else if (pos >= 0) {
+        return pos;
+    } else if (pos < -len) {
+        return 0;
+    } else {
+        return len + pos + 1;
+    }
+}
+
+static int buffer_sub(lua_State* L)
+{
+    MappedBuffer* buf = toBuffer(L, 1);
+    if (!buf) {
+        return origSub(L);
+    }
+    lua_Integer start = posrelatI(luaL_checkinteger(L, 2), buf->size);
+    lua_Integer end = getendpos(L, 3, -1, buf->size);
+    if (start <= end) {
+        lua_pushlstring(L, buf->data + start - 1, (size_t)(end - start + 1));
+    } else {
+        lua_pushliteral(L, "");
+    }
+    return 1;
+}
+
+static int buffer_byte(lua_State* L)
+{
+    MappedBuffer* buf = toBuffer(L, 1);
+    if (!buf) {
+        return origByte(L);
+    }
+    lua_Integer start = posrelatI(luaL_optinteger(L, 2, 1), buf->size);
+    lua_Integer end = getendpos(L, 3, start, buf->size);
+    if (start > end) {
+        return 0;
+    }
+    int n = (int)(end - start) + 1;
+    luaL_checkstack(L, n, "string slice too long");
+    for (int i = 0; i < n; i++) {
+        lua_pushinteger(L, (unsigned char)buf->data[start + i - 1]);
+    }
+    return n;
+}
+
+// Returns the packsize of fmt, or -1 if it contains variable-length items. Results are cached in the table at
+// upvalue 1 since the parsers use a small number of formats many times over.
+static lua_Integer cachedPacksize(lua_State* L, int fmtIdx)
+{
+    lua_pushvalue(L, fmtIdx);
+    if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNUMBER) {
+        lua_Integer result = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        return result;
+    }
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, origPacksize);
+    lua_pushvalue(L, fmtIdx);
+    lua_Integer result = -1;
+    if (lua_pcall(L, 1, 1, 0) == LUA_OK) {
+        result = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, fmtIdx);
+    lua_pushinteger(L, result);
+    lua_rawset(L, lua_upvalueindex(1));
+    return result;
+}
+
+static int buffer_unpack(lua_State* L)
+{
+    MappedBuffer* buf = toBuffer(L, 2);
+    if (!buf) {
+        return origUnpack(L);
+    }
+    luaL_checkstring(L, 1);
+    lua_Integer pos = posrelatI(luaL_optinteger(L, 3, 1), buf->size) - 1;
+    luaL_argcheck(L, pos <= buf->size, 3, "initial position out of string");
+
+    // Rather than reimplementing string.unpack, run the original over a window of the buffer just big enough for the
+    // format. Formats with variable-length items (eg "s1") don't have a packsize, so for those we start small and grow
+    // the window until the unpack succeeds or the window covers the whole of the rest of the buffer. Alignment (the
+    // "!" and "X" options) is relative to the start of the string, so the window starts at the multiple of 16 (the
+    // largest possible alignment) at or before pos, rather than at pos itself. That does mean packsize can be a little
+    // short of what's needed, but if so the window simply grows.
+    const lua_Integer start = pos & ~(lua_Integer)15;
+    const lua_Integer offset = pos - start;
+    const lua_Integer remaining = buf->size - start;
+    lua_Integer packsize = cachedPacksize(L, 1);
+    lua_Integer window = qMin(offset + (packsize >= 0 ? packsize : 256), remaining);
+    while (true) {
+        const int base = lua_gettop(L);
+        lua_pushcfunction(L, origUnpack);
+        lua_pushvalue(L, 1);
+        lua_pushlstring(L, buf->data + start, (size_t)window);
+        lua_pushinteger(L, offset + 1);
+        if (lua_pcall(L, 3, LUA_MULTRET, 0) == LUA_OK) {
+            const int nret = lua_gettop(L) - base;
+            // Last result is the position after the unpacked data, relative to the window
+            lua_Integer next = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            lua_pushinteger(L, next + start);
+            return nret;
+        } else if (window >= remaining) {
+            return lua_error(L);
+        }
+        lua_settop(L, base);
+        window = qMin(window * 4, remaining);
+    }
+}
+
+// buf:unpack(fmt, pos) rather than string.unpack(fmt, buf, pos)
+static int buffer_unpackMethod(lua_State* L)
+{
+    lua_settop(L, 3);
+    lua_rotate(L, 1, 1); // fmt, buf, pos
+    return buffer_unpack(L);
+}
+
+static int buffer_len(lua_State* L)
+{
+    lua_pushinteger(L, static_cast<MappedBuffer*>(luaL_checkudata(L, 1, KMappedBufferType))->size);
+    return 1;
+}
+
+static int buffer_tostring(lua_State* L)
+{
+    auto buf = static_cast<MappedBuffer*>(luaL_checkudata(L, 1, KMappedBufferType));
+    lua_pushlstring(L, buf->data, (size_t)buf->size);
+    return 1;
+}
+
+static int buffer_gc(lua_State* L)
+{
+    auto buf = static_cast<MappedBuffer*>(luaL_checkudata(L, 1, KMappedBufferType));
+    if (buf->file) {
+        QMutexLocker lock(&gMappedBuffersMutex);
+        gMappedBuffers.remove(buf);
+    }
+    delete buf->file;
+    buf->file = nullptr;
+    delete[] buf->copy;
+    buf->copy = nullptr;
+    buf->data = nullptr;
+    buf->size = 0;
+    return 0;
+}
+
+void installMappedBufferSupport(lua_State* L)
+{
+    lua_getglobal(L, LUA_STRLIBNAME);
+    if (!origSub) {
+        lua_getfield(L, -1, "sub");
+        origSub = lua_tocfunction(L, -1);
+        lua_getfield(L, -2, "byte");
+        origByte = lua_tocfunction(L, -1);
+        lua_getfield(L, -3, "unpack");
+        origUnpack = lua_tocfunction(L, -1);
+        lua_getfield(L, -4, "packsize");
+        origPacksize = lua_tocfunction(L, -1);
+        lua_pop(L, 4);
+    }
+
+    // Shared packsize cache for unpack and the unpack method
+    lua_newtable(L);
+    luaL_Reg fns[] = {
+        { "sub", buffer_sub },
+        { "byte", buffer_byte },
+        { "unpack", buffer_unpack },
+        { nullptr, nullptr },
+    };
+    lua_pushvalue(L, -1);
+    lua_rotate(L, -3, 1);
+    luaL_setfuncs(L, fns, 1);
+    lua_pop(L, 1);
+    // Stack is now: cache
+
+    luaL_newmetatable(L, KMappedBufferType);
+    luaL_Reg metamethods[] = {
+        { "__len", buffer_len },
+        { "__tostring", buffer_tostring },
+        { "__gc", buffer_gc },
+        { nullptr, nullptr },
+    };
+    luaL_setfuncs(L, metamethods, 0);
+    lua_newtable(L);
+    luaL_Reg methods[] = {
+        { "sub", buffer_sub },
+        { "byte", buffer_byte },
+        { "unpack", buffer_unpackMethod },
+        { nullptr, nullptr },
+    };
+    lua_pushvalue(L, -3);
+    luaL_setfuncs(L, methods, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 2);
+}
+
+bool pushMappedBuffer(lua_State* L, const QString& path)
+{
+    // Buffers aren't usable in a state which hasn't had installMappedBufferSupport() called on it
+    if (luaL_getmetatable(L, KMappedBufferType) == LUA_TNIL) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pop(L, 1);
+
+    auto file = new QFile(path);
+    uchar* data = nullptr;
+    if (file->open(QFile::ReadOnly) && file->size() > 0) {
+        data = file->map(0, file->size());
+    }
+    if (!data) {
+        delete file;
+        return false;
+    }
+    auto buf = static_cast<MappedBuffer*>(lua_newuserdatauv(L, sizeof(MappedBuffer), 0));
+    buf->file = file;
+    buf->copy = nullptr;
+    buf->data = reinterpret_cast<const char*>(data);
+    buf->size = file->size();
+    luaL_setmetatable(L, KMappedBufferType);
+    QMutexLocker lock(&gMappedBuffersMutex);
+    gMappedBuffers.insert(buf, { QDir::cleanPath(path), QThread::currentThread() });
+    return true;
+}
+
+void detachMappedBuffers(const QString& path)
+{
+    const QString key = QDir::cleanPath(path);
+    QThread* thread = QThread::currentThread();
+    QMutexLocker lock(&gMappedBuffersMutex);
+    for (auto i = gMappedBuffers.begin(); i != gMappedBuffers.end(); ) {
+        if (i->path != key || i->thread != thread) {
+            ++i;
+            continue;
+        }
+        MappedBuffer* buf = i.key();
+        buf->copy = new char[buf->size];
+        memcpy(buf->copy, buf->data, (size_t)buf->size);
+        buf->data = buf->copy;
+        delete buf->file; // Which unmaps it
+        buf->file = nullptr;
+        i = gMappedBuffers.erase(i);
+    }
+}
+
+const char* toBufferData(lua_State* L, int idx, size_t* len)
+{
+    if (lua_type(L, idx) == LUA_TSTRING) {
+        return lua_tolstring(L, idx, len);
+    }
+    MappedBuffer* buf = toBuffer(L, idx);
+    if (!buf) {
+        return nullptr;
+    }
+    *len = (size_t)buf->size;
+    return buf->data;
+}
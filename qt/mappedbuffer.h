@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MAPPEDBUFFER_H
+#define MAPPEDBUFFER_H
+
+#include "luasupport.h"
+
+// A MappedBuffer is an immutable Lua userdata backed by a memory mapping of a file, which supports the subset of the
+// string API used by the file format parsers: #buf, buf:sub(), buf:byte(), buf:unpack(fmt, pos), tostring(buf), and
+// string.sub/byte/unpack(..., buf, ...) once installMappedBufferSupport() has been called.
+//
+// The mapping only stays immutable for as long as nothing changes the file, so anything which is about to write,
+// truncate, rename or delete a file must first call detachMappedBuffers() on it.
+
+// Replaces string.sub, string.byte and string.unpack with versions that also accept mapped buffers. Must be called
+// before any Lua code has a chance to cache the originals. Calls with string arguments go straight through to the
+// original implementations.
+void installMappedBufferSupport(lua_State* L);
+
+// Pushes a mapped buffer for the file at path and returns true, or returns false without pushing anything if the
+// file couldn't be mapped (for example because it is empty, or is a compressed Qt resource).
+bool pushMappedBuffer(lua_State* L, const QString& path);
+
+// Copies the contents of any buffers mapping the file at path into memory and unmaps them, so that the file can safely
+// be modified (touching a mapped page beyond the end of a truncated file raises SIGBUS, and on Windows a mapped file
+// can't be replaced). Only buffers created on the calling thread are detached, since they're used without locking:
+// each runtime maps files from, and modifies them on, its own interpreter thread.
+void detachMappedBuffers(const QString& path);
+
+// Returns the contents of the string or mapped buffer at idx, or nullptr if it is neither. Works whether or not
+// installMappedBufferSupport() has been called.
+const char* toBufferData(lua_State* L, int idx, size_t* len);
+
+#endif // MAPPEDBUFFER_H
@@ -0,0 +1,800 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "mbmcodec.h"
+#include "mappedbuffer.h"
+
+#include <QThreadPool>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+// Header dimensions go up to 0x7FFF, which at 32bpp would be bigger than a QByteArray can hold. Nothing real is
+// anywhere near this.
+static const qint64 KMaxImageDataSize = 256 * 1024 * 1024;
+
+// These are stored as 0x00RRGGBB, as in mbm.lua
+static const quint32 KEpoc4bitPalette[16] = {
+    0x000000, 0x555555, 0x800000, 0x808000, 0x008000, 0xFF0000, 0xFFFF00, 0x00FF00,
+    0xFF00FF, 0x0000FF, 0x00FFFF, 0x800080, 0x000080, 0x008080, 0xAAAAAA, 0xFFFFFF,
+};
+
+// The 8-bit palette is two 6x6x3 colour cubes (blue 00-66, then 99-FF) either side of these 40 entries
+static const quint32 KEpoc8bitPaletteMiddle[40] = {
+    0x111111, 0x222222, 0x444444, 0x555555, 0x777777,
+    0x110000, 0x220000, 0x440000, 0x550000, 0x770000,
+    0x001100, 0x002200, 0x004400, 0x005500, 0x007700,
+    0x000011, 0x000022, 0x000044, 0x000055, 0x000077,
+    0x000088, 0x0000AA, 0x0000BB, 0x0000DD, 0x0000EE,
+    0x008800, 0x00AA00, 0x00BB00, 0x00DD00, 0x00EE00,
+    0x880000, 0xAA0000, 0xBB0000, 0xDD0000, 0xEE0000,
+    0x888888, 0xAAAAAA, 0xBBBBBB, 0xDDDDDD, 0xEEEEEE,
+};
+
+static quint32 epoc8bitPalette(int index)
+{
+    auto cube = [](int i, int blueBase) -> quint32 {
+        return (quint32)((i % 6) * 0x33) << 16 | (quint32)(((i / 6) % 6) * 0x33) << 8 | (blueBase + i / 36) * 0x33;
+    };
+    if (index < 108) {
+        return cube(index, 0);
+    } else if (index < 148) {
+        return KEpoc8bitPaletteMiddle[index - 108];
+    } else {
+        return cube(index - 148, 3);
+    }
+}
+
+// Widening from 1, 2 or 4bpp to 8bpp is done a source byte at a time, by looking up all the output pixels for that
+// byte at once. Pixels are packed least significant bits first.
+struct WidenTables {
+    quint8 bits[2][256][8]; // [invert][byte]
+    quint8 twoBit[256][4];
+    quint8 nibbles[2][256][2]; // [isColor][byte]
+
+    WidenTables()
+    {
+        for (int b = 0; b < 256; b++) {
+            for (int i = 0; i < 8; i++) {
+                const bool set = (b & (1 << i)) != 0;
+                bits[0][b][i] = set ? 0xFF : 0;
+                bits[1][b][i] = set ? 0 : 0xFF;
+            }
+            for (int i = 0; i < 4; i++) {
+                twoBit[b][i] = ((b >> (i * 2)) & 0x3) * 0x55;
+            }
+            for (int i = 0; i < 2; i++) {
+                const int nibble = (b >> (i * 4)) & 0xF;
+                nibbles[0][b][i] = nibble * 17;
+                nibbles[1][b][i] = nibble;
+            }
+        }
+    }
+};
+
+static const WidenTables& widenTables()
+{
+    static const WidenTables tables;
+    return tables;
+}
+
+// As in mbm.lua, runs are decoded until end (the end of the bitmap's data) but may read as far as len (the end of the
+// file) if the last one is truncated.
+static void rleDecode(QByteArray& result, const quint8* data, qint64 len, qint64 pos, qint64 end, int pixelSize)
+{
+    while (pos < end) {
+        const int b = data[pos];
+        if (b < 0x80) {
+            // b+1 repeats of the pixel that follows
+            const qint64 pixelLen = std::min<qint64>(pixelSize, len - (pos + 1));
+            if (pixelLen <= 0) {
+                break;
+            }
+            const char* pixel = reinterpret_cast<const char*>(data + pos + 1);
+            if (pixelLen == 1) {
+                result.append(b + 1, *pixel);
+            } else {
+                for (int i = 0; i <= b; i++) {
+                    result.append(pixel, pixelLen);
+                }
+            }
+            pos += 1 + pixelSize;
+        } else {
+            // 256-b pixels of raw data follow
+            const qint64 n = (256 - b) * pixelSize;
+            const qint64 rawLen = std::min<qint64>(n, len - (pos + 1));
+            if (rawLen > 0) {
+                result.append(reinterpret_cast<const char*>(data + pos + 1), rawLen);
+            }
+            pos += 1 + n;
+        }
+    }
+}
+
+static void rle12Decode(QByteArray& result, const quint8* data, qint64 len, qint64 pos, qint64 end)
+{
+    while (pos < end && pos + 2 <= len) {
+        const quint16 value = qFromLittleEndian<quint16>(data + pos);
+        pos += 2;
+        const int runLength = (value >> 12) + 1;
+        // Written out big-endian, for consistency with rle12decode() in mbm.lua
+        const char pixel[2] = { (char)((value >> 8) & 0xF), (char)(value & 0xFF) };
+        for (int i = 0; i < runLength; i++) {
+            result.append(pixel, 2);
+        }
+    }
+}
+
+// As per GrayBppToMode and ColorBppToMode in mbm.lua, returns -1 for combinations that aren't valid
+static int bppColorToMode(int bpp, bool isColor)
+{
+    if (!isColor) {
+        switch (bpp) {
+        case 1: return 0; // KColorgCreate2GrayMode
+        case 2: return 1; // KColorgCreate4GrayMode
+        case 4: return 2; // KColorgCreate16GrayMode
+        case 8: return 3; // KColorgCreate256GrayMode
+        }
+    } else {
+        switch (bpp) {
+        case 4: return 4; // KColorgCreate16ColorMode
+        case 8: return 5; // KColorgCreate256ColorMode
+        case 12: return 9; // KColorgCreate4KColorMode
+        case 16: return 6; // KColorgCreate64KColorMode
+        case 24: return 7; // KColorgCreate16MColorMode
+        case 32: return 8; // KColorgCreateRGBColorMode
+        }
+    }
+    return -1;
+}
+
+// As per byteWidth() in mbm.lua
+static int byteWidth(int width, int bpp)
+{
+    switch (bpp) {
+    case 1: return 4 * ((width + 31) / 32);
+    case 2: return 4 * ((width + 15) / 16);
+    case 4: return 4 * ((width + 7) / 8);
+    case 8: return 4 * ((width + 3) / 4);
+    case 12:
+    case 16: return 4 * ((width + 1) / 2);
+    case 24: return 4 * (((width * 3 + 11) / 12) * 3);
+    case 32: return 4 * ((width + 15) / 16);
+    default: return 0;
+    }
+}
+
+QVector<MbmBitmapInfo> MbmCodec::parse(const char* data, qint64 len)
+{
+    const quint8* bytes = reinterpret_cast<const quint8*>(data);
+    auto u16 = [bytes](qint64 pos) { return qFromLittleEndian<quint16>(bytes + pos); };
+    auto u32 = [bytes](qint64 pos) { return qFromLittleEndian<quint32>(bytes + pos); };
+    QVector<MbmBitmapInfo> result;
+
+    if (len >= 8 && memcmp(data, "PIC\xDC", 4) == 0) {
+        // Series 3 .PIC file
+        if (bytes[4] != 0x30 || bytes[5] != 0x30) {
+            return result;
+        }
+        const int numBitmaps = u16(6);
+        qint64 pos = 8;
+        for (int i = 0; i < numBitmaps; i++, pos += 12) {
+            if (pos + 12 > len) {
+                return QVector<MbmBitmapInfo>();
+            }
+            MbmBitmapInfo info;
+            info.width = u16(pos + 2);
+            info.height = u16(pos + 4);
+            info.bpp = 1;
+            // PICs round to 16-bit not 32 like 1bpp MBMs
+            info.stride = 2 * ((info.width + 15) / 16);
+            info.invert = true;
+            info.mode = 0; // KColorgCreate2GrayMode
+            info.imgStart = pos + 12 + u32(pos + 8);
+            info.imgLen = (qint64)info.stride * info.height;
+            result.append(info);
+        }
+        return result;
+    }
+
+    if (len < 20 || u32(0) != KUidDirectFileStore || u32(4) == KUidAppInfoFile8) {
+        return result;
+    }
+    const qint64 trailerOffset = u32(16);
+    if (trailerOffset + 4 > len) {
+        return result;
+    }
+    const quint32 numBitmaps = u32(trailerOffset);
+    if (trailerOffset + 4 + (qint64)numBitmaps * 4 > len) {
+        return result;
+    }
+    for (quint32 i = 0; i < numBitmaps; i++) {
+        MbmBitmapInfo info;
+        if (!parseBitmap(data, len, u32(trailerOffset + 4 + i * 4), info)) {
+            return QVector<MbmBitmapInfo>();
+        }
+        result.append(info);
+    }
+    return result;
+}
+
+bool MbmCodec::parseBitmap(const char* data, qint64 len, qint64 headerOffset, MbmBitmapInfo& info)
+{
+    const quint8* bytes = reinterpret_cast<const quint8*>(data);
+    auto u32 = [bytes](qint64 pos) { return qFromLittleEndian<quint32>(bytes + pos); };
+    // struct SEpocBitmapHeader
+    if (headerOffset < 0 || headerOffset + 40 > len) {
+        return false;
+    }
+    const qint64 bitmapLen = u32(headerOffset);
+    const qint64 headerLen = u32(headerOffset + 4);
+    info.width = (int)u32(headerOffset + 8);
+    info.height = (int)u32(headerOffset + 12);
+    info.bpp = (int)u32(headerOffset + 24);
+    info.isColor = u32(headerOffset + 28) == 1;
+    info.invert = false;
+    info.compression = (int)u32(headerOffset + 36);
+    info.mode = bppColorToMode(info.bpp, info.isColor);
+    info.stride = byteWidth(info.width, info.bpp);
+    info.imgStart = headerOffset + headerLen;
+    info.imgLen = bitmapLen - headerLen;
+    return info.mode >= 0 && u32(headerOffset + 8) <= 0x7FFF && u32(headerOffset + 12) <= 0x7FFF;
+}
+
+QByteArray MbmCodec::decode(const MbmBitmapInfo& info, const char* data, qint64 len)
+{
+    const quint8* bytes = reinterpret_cast<const quint8*>(data);
+    const qint64 start = std::min(info.imgStart, len);
+    const qint64 end = std::min(info.imgStart + info.imgLen, len);
+    const qint64 expectedLen = (qint64)info.stride * info.height;
+    QByteArray result;
+    switch (info.compression) {
+    case ENoBitmapCompression:
+        // Some AIFs have a length in the header that doesn't include headerLen, so as in mbm.lua allow for that on
+        // uncompressed bitmaps.
+        return QByteArray(data + start, std::min(std::max(info.imgLen, expectedLen), len - start));
+    case EByteRLECompression:
+        result.reserve(expectedLen);
+        rleDecode(result, bytes, len, start, end, 1);
+        break;
+    case ETwelveBitRLECompression:
+        result.reserve(expectedLen);
+        rle12Decode(result, bytes, len, start, end);
+        break;
+    case ESixteenBitRLECompression:
+        result.reserve(expectedLen);
+        rleDecode(result, bytes, len, start, end, 2);
+        break;
+    case ETwentyFourBitRLECompression:
+        result.reserve(expectedLen);
+        rleDecode(result, bytes, len, start, end, 3);
+        break;
+    default:
+        return QByteArray();
+    }
+    return result;
+}
+
+// Widens one row of 1, 2, 4 or 8bpp pixels to 8bpp. Any pixels missing from the end of the source are left as zero.
+static void widenRow(const MbmBitmapInfo& info, const quint8* src, qint64 srcLen, quint8* dest)
+{
+    const auto& tables = widenTables();
+    const int width = info.width;
+    const int pixelsPerByte = 8 / info.bpp;
+    const int wholeBytes = (int)std::min<qint64>(width / pixelsPerByte, srcLen);
+    int x = 0;
+    switch (info.bpp) {
+    case 1: {
+        const auto& table = tables.bits[info.invert ? 1 : 0];
+        for (int i = 0; i < wholeBytes; i++, x += 8) {
+            memcpy(dest + x, table[src[i]], 8);
+        }
+        break;
+    }
+    case 2:
+        for (int i = 0; i < wholeBytes; i++, x += 4) {
+            memcpy(dest + x, tables.twoBit[src[i]], 4);
+        }
+        break;
+    case 4: {
+        const auto& table = tables.nibbles[info.isColor ? 1 : 0];
+        for (int i = 0; i < wholeBytes; i++, x += 2) {
+            memcpy(dest + x, table[src[i]], 2);
+        }
+        break;
+    }
+    case 8:
+        memcpy(dest, src, wholeBytes);
+        return;
+    }
+    // Partial byte at the end of the row
+    if (x < width && wholeBytes < srcLen) {
+        quint8 last[8];
+        switch (info.bpp) {
+        case 1: memcpy(last, tables.bits[info.invert ? 1 : 0][src[wholeBytes]], 8); break;
+        case 2: memcpy(last, tables.twoBit[src[wholeBytes]], 4); break;
+        case 4: memcpy(last, tables.nibbles[info.isColor ? 1 : 0][src[wholeBytes]], 2); break;
+        }
+        memcpy(dest + x, last, width - x);
+    }
+}
+
+QByteArray MbmCodec::imageData(const MbmBitmapInfo& info, const QByteArray& decoded, int expandToBitDepth,
+    int resultStride)
+{
+    int bytesPerPixel;
+    if (expandToBitDepth == 8) {
+        bytesPerPixel = 1;
+    } else if (expandToBitDepth == 24 || expandToBitDepth == 32) {
+        bytesPerPixel = expandToBitDepth / 8;
+    } else {
+        return QByteArray();
+    }
+    const qint64 stride = std::max<qint64>(resultStride, (qint64)info.width * bytesPerPixel);
+    if (stride * info.height > KMaxImageDataSize) {
+        return QByteArray();
+    }
+    QByteArray result((int)(stride * info.height), 0);
+    if (!imageData(info, decoded, expandToBitDepth, reinterpret_cast<quint8*>(result.data()), (int)stride)) {
+        return QByteArray();
+    }
+    return result;
+}
+
+bool MbmCodec::imageData(const MbmBitmapInfo& info, const QByteArray& decoded, int expandToBitDepth, quint8* dest,
+    int resultStride)
+{
+    const quint8* src = reinterpret_cast<const quint8*>(decoded.constData());
+    const qint64 srcLen = decoded.size();
+    const int width = info.width;
+    const int height = info.height;
+
+    auto rowStart = [&](int y) -> qint64 { return (qint64)y * info.stride; };
+    auto rowAvailable = [&](int y) -> qint64 { return std::max<qint64>(0, srcLen - rowStart(y)); };
+
+    if (expandToBitDepth == 8) {
+        if (info.bpp > 8) {
+            return false;
+        }
+        const qint64 stride = std::max(resultStride, width);
+        for (int y = 0; y < height; y++) {
+            widenRow(info, src + rowStart(y), std::min<qint64>(rowAvailable(y), info.stride), dest + y * stride);
+        }
+        return true;
+    } else if (expandToBitDepth != 24 && expandToBitDepth != 32) {
+        return false;
+    }
+
+    const int bytesPerPixel = expandToBitDepth / 8;
+    const qint64 stride = std::max<qint64>(resultStride, (qint64)width * bytesPerPixel);
+
+    // Writes 0x00RRGGBB as B, G, R (and alpha) bytes
+    auto putPixel = [bytesPerPixel](quint8* p, quint32 rgb) {
+        p[0] = rgb & 0xFF;
+        p[1] = (rgb >> 8) & 0xFF;
+        p[2] = (rgb >> 16) & 0xFF;
+        if (bytesPerPixel == 4) {
+            p[3] = 0xFF;
+        }
+    };
+
+    if (info.bpp <= 8) {
+        quint32 lut[256];
+        for (int i = 0; i < 256; i++) {
+            if (!info.isColor) {
+                lut[i] = i << 16 | i << 8 | i;
+            } else if (info.bpp == 8) {
+                lut[i] = epoc8bitPalette(i);
+            } else if (info.bpp == 4) {
+                lut[i] = KEpoc4bitPalette[i & 0xF];
+            } else {
+                return false;
+            }
+        }
+        const QByteArray wide = imageData(info, decoded, 8, width);
+        if (wide.isEmpty() && width > 0 && height > 0) {
+            return false;
+        }
+        const quint8* widePixels = reinterpret_cast<const quint8*>(wide.constData());
+        for (int y = 0; y < height; y++) {
+            const quint8* s = widePixels + (qint64)y * width;
+            quint8* d = dest + y * stride;
+            for (int x = 0; x < width; x++, d += bytesPerPixel) {
+                putPixel(d, lut[s[x]]);
+            }
+        }
+        return true;
+    }
+
+    const int srcBytesPerPixel = info.bpp == 24 ? 3 : 2;
+    if (info.bpp != 12 && info.bpp != 16 && info.bpp != 24) {
+        return false;
+    }
+    for (int y = 0; y < height; y++) {
+        const quint8* s = src + rowStart(y);
+        const int available = (int)std::min<qint64>(width, rowAvailable(y) / srcBytesPerPixel);
+        quint8* d = dest + y * stride;
+        for (int x = 0; x < available; x++, s += srcBytesPerPixel, d += bytesPerPixel) {
+            quint32 rgb;
+            if (info.bpp == 12) {
+                // Big-endian, see rle12Decode()
+                const int value = s[0] << 8 | s[1];
+                rgb = ((value >> 8) & 0xF) * 17 << 16 | ((value >> 4) & 0xF) * 17 << 8 | (value & 0xF) * 17;
+            } else if (info.bpp == 16) {
+                const int value = s[0] | s[1] << 8;
+                const int r = (value & 0xF800) >> 8;
+                const int g = (value & 0x7E0) >> 3;
+                const int b = (value & 0x1F) << 3;
+                rgb = (r + (r >> 5)) << 16 | (g + (g >> 6)) << 8 | (b + (b >> 5));
+            } else {
+                rgb = s[2] << 16 | s[1] << 8 | s[0];
+            }
+            putPixel(d, rgb);
+        }
+    }
+    return true;
+}
+
+QByteArray MbmCodec::normalizedImageData(const MbmBitmapInfo& info, const char* data, qint64 len)
+{
+    const QByteArray decoded = decode(info, data, len);
+    if (decoded.isNull()) {
+        return decoded;
+    }
+    return imageData(info, decoded, info.isColor ? 32 : 8);
+}
+
+//// Encoding
+
+// For 1-byte pixels, returns the first j in [from, to) for which data[j] == data[j - 1], or to if there isn't one.
+// Compares 8 pixels at a time using the usual has-a-zero-byte trick on the XOR of each word with its neighbour.
+static qint64 findRepeat(const quint8* data, qint64 from, qint64 to)
+{
+    qint64 j = from;
+    for (; j + 8 <= to; j += 8) {
+        quint64 a, b;
+        memcpy(&a, data + j, 8);
+        memcpy(&b, data + j - 1, 8);
+        const quint64 x = a ^ b;
+        if ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+    for (; j < to; j++) {
+        if (data[j] == data[j - 1]) {
+            return j;
+        }
+    }
+    return to;
+}
+
+// For 1-byte pixels, returns the first j in [from, to) for which data[j] != value, or to if there isn't one.
+static qint64 findRunEnd(const quint8* data, qint64 from, qint64 to, quint8 value)
+{
+    const quint64 pattern = 0x0101010101010101ULL * value;
+    qint64 j = from;
+    for (; j + 8 <= to; j += 8) {
+        quint64 a;
+        memcpy(&a, data + j, 8);
+        if (a != pattern) {
+            break;
+        }
+    }
+    for (; j < to; j++) {
+        if (data[j] != value) {
+            return j;
+        }
+    }
+    return to;
+}
+
+// This is a direct port of the state machine in rleEncode() in mbm.lua, including its quirks (such as never starting a
+// run with the pixel immediately after the end of the previous one) since the output must be identical. Indexes are
+// pixel-based and zero-based.
+template <int PixelSize>
+static void rleEncodeImpl(QByteArray& result, const quint8* data, qint64 len)
+{
+    const qint64 n = len / PixelSize;
+    auto pixel = [data](qint64 i) { return reinterpret_cast<const char*>(data + i * PixelSize); };
+    auto same = [data](qint64 a, qint64 b) {
+        return memcmp(data + a * PixelSize, data + b * PixelSize, PixelSize) == 0;
+    };
+    bool inRun = false;
+    qint64 current = 0; // A pixel with the value of the current run, if inRun
+    bool havePrev = false; // Whether pixel i - 1 can start a run with pixel i
+    qint64 start = 0; // Where the current block started
+    for (qint64 i = 0; i < n; i++) {
+        // Skip over anything which just extends the current block
+        if constexpr (PixelSize == 1) {
+            const qint64 limit = std::min(n, start + 0x80);
+            if (inRun) {
+                i = findRunEnd(data, i, limit, data[current]);
+            } else if (havePrev) {
+                i = findRepeat(data, i, limit);
+            }
+            if (i == n) {
+                break;
+            }
+        }
+
+        qint64 blockLen = i - start + 1;
+        if (inRun && same(i, current) && blockLen == 0x81) {
+            // The run can't include pixel i because that won't fit in the 0x80 max repeat count
+            result.append((char)0x7F);
+            result.append(pixel(current), PixelSize);
+            inRun = false;
+            start = i;
+            blockLen = 1;
+        }
+
+        if (inRun) {
+            if (!same(i, current)) {
+                result.append((char)(i - start - 1));
+                result.append(pixel(current), PixelSize);
+                inRun = false;
+                start = i;
+            }
+        } else if (havePrev && same(i, i - 1)) {
+            // Start a run, by first ending the raw block
+            const qint64 rawLen = (i - 1) - start;
+            if (rawLen > 0) {
+                result.append((char)(256 - rawLen));
+                result.append(pixel(start), rawLen * PixelSize);
+            }
+            start = i - 1;
+            current = i;
+            inRun = true;
+            havePrev = false;
+        } else if (blockLen == 0x81) {
+            // The raw block has become too big
+            result.append((char)0x80);
+            result.append(pixel(start), (blockLen - 1) * PixelSize);
+            start = i;
+            havePrev = true;
+        } else {
+            havePrev = true;
+        }
+    }
+    if (start != n) {
+        if (inRun) {
+            result.append((char)(n - start - 1));
+            result.append(pixel(current), PixelSize);
+        } else {
+            // Any trailing partial pixel is included in the final raw block
+            const qint64 blockBytes = len - start * PixelSize;
+            result.append((char)(256 - blockBytes / PixelSize));
+            result.append(pixel(start), blockBytes);
+        }
+    }
+}
+
+QByteArray MbmCodec::rleEncode(const char* data, qint64 len, int pixelSize)
+{
+    const quint8* bytes = reinterpret_cast<const quint8*>(data);
+    QByteArray result;
+    // Worst case is one byte of overhead for every 128 pixels
+    result.reserve(len + len / 128 + 2);
+    switch (pixelSize) {
+    case 1: rleEncodeImpl<1>(result, bytes, len); break;
+    case 2: rleEncodeImpl<2>(result, bytes, len); break;
+    case 3: rleEncodeImpl<3>(result, bytes, len); break;
+    default: return QByteArray();
+    }
+    return result;
+}
+
+MbmEncodedBitmap MbmCodec::encode(const MbmSourceBitmap& bitmap)
+{
+    MbmEncodedBitmap result;
+    const quint8* src = reinterpret_cast<const quint8*>(bitmap.data);
+    const int width = bitmap.width;
+    const int height = bitmap.height;
+    int bpp;
+    switch (bitmap.mode) {
+    case 0: bpp = 1; break; // KColorgCreate2GrayMode
+    case 1: bpp = 2; break; // KColorgCreate4GrayMode
+    case 2: bpp = 4; break; // KColorgCreate16GrayMode
+    case 3: bpp = 8; break; // KColorgCreate256GrayMode
+    default: return result;
+    }
+    const int stride = byteWidth(width, bpp);
+    QByteArray pixels((qint64)stride * height, 0);
+    quint8* dest = reinterpret_cast<quint8*>(pixels.data());
+
+    if (bpp == 8) {
+        // Rows are copied as-is, then padded to stride
+        for (int y = 0; y < height; y++) {
+            const qint64 offset = (qint64)y * width;
+            const qint64 available = std::max<qint64>(0, std::min<qint64>(width, bitmap.len - offset));
+            if (available) {
+                memcpy(dest + (qint64)y * stride, src + offset, available);
+            }
+        }
+    } else {
+        // Greyscale pixels are reduced to bpp bits by dropping their low bits, and packed least significant bits first
+        const int pixelsPerByte = 8 / bpp;
+        const int rshift = 8 - bpp;
+        for (int y = 0; y < height; y++) {
+            const qint64 offset = (qint64)y * width;
+            const int available = (int)std::max<qint64>(0, std::min<qint64>(width, bitmap.len - offset));
+            quint8* d = dest + (qint64)y * stride;
+            for (int x = 0; x < available; x++) {
+                d[x / pixelsPerByte] |= (src[offset + x] >> rshift) << ((x % pixelsPerByte) * bpp);
+            }
+        }
+    }
+
+    result.compression = EByteRLECompression;
+    result.data = rleEncode(pixels.constData(), pixels.size(), 1);
+    result.ok = true;
+    return result;
+}
+
+QVector<MbmEncodedBitmap> MbmCodec::encode(const QVector<MbmSourceBitmap>& bitmaps)
+{
+    QVector<MbmEncodedBitmap> results(bitmaps.count());
+    if (bitmaps.count() == 1) {
+        results[0] = encode(bitmaps[0]);
+        return results;
+    }
+    QThreadPool pool;
+    for (int i = 0; i < bitmaps.count(); i++) {
+        pool.start([&bitmaps, &results, i] {
+            results[i] = encode(bitmaps[i]);
+        });
+    }
+    pool.waitForDone();
+    return results;
+}
+
+//// Lua bindings
+
+static MbmBitmapInfo checkBitmap(lua_State* L, int idx)
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+    MbmBitmapInfo info;
+    info.width = to_int(L, idx, "width");
+    info.height = to_int(L, idx, "height");
+    info.bpp = to_int(L, idx, "bpp");
+    info.stride = to_int(L, idx, "stride");
+    info.isColor = to_bool(L, idx, "isColor");
+    info.invert = to_bool(L, idx, "invert");
+    info.compression = to_int(L, idx, "compression");
+    info.imgStart = to_intt<qint64>(L, idx, "imgStart");
+    info.imgLen = to_intt<qint64>(L, idx, "imgLen");
+    return info;
+}
+
+// Pushes bitmap.data and returns a pointer to it
+static const char* bitmapData(lua_State* L, int idx, size_t* len)
+{
+    rawgetfield(L, idx, "data");
+    const char* data = toBufferData(L, -1, len);
+    if (!data) {
+        luaL_error(L, "Bitmap data must be a string or MappedBuffer");
+    }
+    return data;
+}
+
+// mbmcodec.decode(bitmap) -> string
+//
+// Where bitmap is a Bitmap as returned by mbm.parseMbmHeader(). Equivalent to mbm.decodeBitmap().
+static int mbmcodec_decode(lua_State* L)
+{
+    MbmBitmapInfo info = checkBitmap(L, 1);
+    size_t len = 0;
+    const char* data = bitmapData(L, 1, &len);
+    QByteArray result = MbmCodec::decode(info, data, (qint64)len);
+    if (result.isNull()) {
+        return luaL_error(L, "Unknown compression scheme %d", info.compression);
+    }
+    pushValue(L, result);
+    return 1;
+}
+
+// mbmcodec.getImageData(bitmap, expandToBitDepth, [resultStride]) -> string
+//
+// Equivalent to bitmap:getImageData(expandToBitDepth, resultStride), for expandToBitDepth of 8, 24 or 32.
+static int mbmcodec_getImageData(lua_State* L)
+{
+    MbmBitmapInfo info = checkBitmap(L, 1);
+    const int expandToBitDepth = (int)luaL_checkinteger(L, 2);
+    const int resultStride = (int)luaL_optinteger(L, 3, 0);
+    size_t len = 0;
+    const char* data = bitmapData(L, 1, &len);
+    QByteArray decoded = MbmCodec::decode(info, data, (qint64)len);
+    if (decoded.isNull()) {
+        return luaL_error(L, "Unknown compression scheme %d", info.compression);
+    }
+    QByteArray result = MbmCodec::imageData(info, decoded, expandToBitDepth, resultStride);
+    if (result.isNull()) {
+        return luaL_error(L, "Cannot expand %d bpp bitmap to %d bpp", info.bpp, expandToBitDepth);
+    }
+    pushValue(L, result);
+    return 1;
+}
+
+// mbmcodec.rleEncode(data, pixelSize) -> string
+//
+// Equivalent to mbm.rleEncode(data, pixelSize).
+static int mbmcodec_rleEncode(lua_State* L)
+{
+    size_t len = 0;
+    const char* data = luaL_checklstring(L, 1, &len);
+    const int pixelSize = (int)luaL_checkinteger(L, 2);
+    luaL_argcheck(L, pixelSize >= 1 && pixelSize <= 3, 2, "pixelSize must be 1, 2 or 3");
+    pushValue(L, MbmCodec::rleEncode(data, (qint64)len, pixelSize));
+    return 1;
+}
+
+// mbmcodec.encodeBitmaps(bitmaps) -> array
+//
+// Where bitmaps is an array of { width, height, mode, normalizedImgData } as passed to mbm.makeMbm(). Returns an array
+// of the same length, each element of which is either { compression, data } describing the bitmap's pixels as they
+// should be written to the MBM, or false if the bitmap's mode isn't supported.
+static int mbmcodec_encodeBitmaps(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const int n = (int)luaL_len(L, 1);
+    QVector<MbmSourceBitmap> bitmaps(n);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        auto& bitmap = bitmaps[i];
+        bitmap.width = to_int(L, -1, "width");
+        bitmap.height = to_int(L, -1, "height");
+        bitmap.mode = to_int(L, -1, "mode");
+        rawgetfield(L, -1, "normalizedImgData");
+        size_t len = 0;
+        // Still referenced from the bitmaps table, so remains valid after it's popped
+        bitmap.data = luaL_checklstring(L, -1, &len);
+        bitmap.len = (qint64)len;
+        lua_pop(L, 2); // normalizedImgData, bitmap
+    }
+
+    const auto results = MbmCodec::encode(bitmaps);
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        const auto& result = results[i];
+        if (result.ok) {
+            lua_createtable(L, 0, 2);
+            SET_INT(L, "compression", result.compression);
+            pushValue(L, result.data);
+            lua_setfield(L, -2, "data");
+        } else {
+            lua_pushboolean(L, false);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+void installMbmCodecModule(lua_State* L)
+{
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_newtable(L);
+    luaL_Reg fns[] = {
+        { "decode", mbmcodec_decode },
+        { "encodeBitmaps", mbmcodec_encodeBitmaps },
+        { "getImageData", mbmcodec_getImageData },
+        { "rleEncode", mbmcodec_rleEncode },
+        { nullptr, nullptr },
+    };
+    luaL_setfuncs(L, fns, 0);
+    lua_setfield(L, -2, "mbmcodec");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MBMCODEC_H
+#define MBMCODEC_H
+
+#include "luasupport.h"
+
+#include <QByteArray>
+#include <QVector>
+
+// Decoder for the bitmaps in EPOC MBM files (and SIBO PIC files), and encoder for the former. This is the native
+// equivalent of decodeBitmap(), Bitmap:getImageData(), rleEncode() and makeMbm() in mbm.lua, which uses it in preference
+// to its own implementation when the "mbmcodec" module is available. MbmCodec itself doesn't depend on Lua, so it can
+// also be used directly by the GUI.
+
+struct MbmBitmapInfo {
+    int width = 0;
+    int height = 0;
+    int bpp = 1;
+    int stride = 0; // Bytes per row of the decoded (but not widened) data
+    bool isColor = false;
+    bool invert = false; // For 1bpp bitmaps where a set bit means black rather than white
+    int compression = 0; // One of MbmCodec::Compression
+    int mode = 0; // The equivalent KColorgCreate*Mode value, see OplScreen::BitmapMode
+    qint64 imgStart = 0; // Offset of the pixel data within the file
+    qint64 imgLen = 0;
+};
+
+// The pixel data for one bitmap to be written by MbmCodec::encode(), in the same form as the normalizedImgData of a
+// greyscale bitmap passed to makeMbm(): 8bpp with no padding between rows.
+struct MbmSourceBitmap {
+    int width = 0;
+    int height = 0;
+    int mode = 0; // KColorgCreate*Mode
+    const char* data = nullptr;
+    qint64 len = 0;
+};
+
+struct MbmEncodedBitmap {
+    bool ok = false; // False if the mode isn't one that encode() supports
+    int compression = 0;
+    QByteArray data; // As written after the SEpocBitmapHeader
+};
+
+class MbmCodec {
+public:
+    enum Compression {
+        ENoBitmapCompression = 0,
+        EByteRLECompression = 1,
+        ETwelveBitRLECompression = 2,
+        ESixteenBitRLECompression = 3,
+        ETwentyFourBitRLECompression = 4,
+    };
+
+    static const quint32 KUidDirectFileStore = 0x10000037;
+    static const quint32 KUidAppInfoFile8 = 0x1000006A;
+
+    // Parses the bitmap headers of an EPOC MBM file or SIBO PIC file, like parseMbmHeader() in mbm.lua. Returns an
+    // empty vector if data is anything else (including ROM MBMs and AIFs, which are left to mbm.lua) or is truncated.
+    static QVector<MbmBitmapInfo> parse(const char* data, qint64 len);
+
+    // Parses the SEpocBitmapHeader at headerOffset, like parseBitmap() in mbm.lua. This is how bitmaps are found in
+    // AIFs, where the mask (if any) follows immediately after, at info.imgStart + info.imgLen. Returns false if the
+    // header is truncated or describes something we can't decode.
+    static bool parseBitmap(const char* data, qint64 len, qint64 headerOffset, MbmBitmapInfo& info);
+
+    // Returns the decompressed pixel data of the bitmap described by info, from the file data. The result is in the
+    // bitmap's own bit depth, with info.stride bytes per row. Returns a null QByteArray if the compression scheme isn't
+    // recognised.
+    static QByteArray decode(const MbmBitmapInfo& info, const char* data, qint64 len);
+
+    // Converts the result of decode() to expandToBitDepth bits per pixel, with each row padded to resultStride bytes
+    // (or not at all, if resultStride is smaller than that). 8 is only valid for bitmaps of 8bpp or less, and gives grey
+    // levels or palette indexes; 24 and 32 give B, G, R (and 0xFF) bytes. Returns a null QByteArray if the conversion
+    // isn't supported.
+    static QByteArray imageData(const MbmBitmapInfo& info, const QByteArray& decoded, int expandToBitDepth,
+        int resultStride = 0);
+
+    // As above, but writes directly into dest, which must be at least resultStride * info.height bytes, for example
+    // the bits of a QImage of the right format. Pixels missing from the source data are left untouched. Returns false
+    // if the conversion isn't supported.
+    static bool imageData(const MbmBitmapInfo& info, const QByteArray& decoded, int expandToBitDepth, quint8* dest,
+        int resultStride);
+
+    // Compresses data with the RLE scheme used by EByteRLECompression (pixelSize 1), ESixteenBitRLECompression (2) or
+    // ETwentyFourBitRLECompression (3). The output is identical to rleEncode() in mbm.lua.
+    static QByteArray rleEncode(const char* data, qint64 len, int pixelSize);
+
+    // Packs (and where appropriate compresses) the pixel data for the given bitmaps exactly as makeMbm() in mbm.lua
+    // does. Only the greyscale modes are supported. Bitmaps are independent of each other, so when there's more than
+    // one they're encoded in parallel.
+    static QVector<MbmEncodedBitmap> encode(const QVector<MbmSourceBitmap>& bitmaps);
+    static MbmEncodedBitmap encode(const MbmSourceBitmap& bitmap);
+
+    // Returns the image data in the layout used by normalizedImgData, ie 32bpp for colour bitmaps and 8bpp for
+    // greyscale ones, with no padding between rows.
+    static QByteArray normalizedImageData(const MbmBitmapInfo& info, const char* data, qint64 len);
+};
+
+// Registers the "mbmcodec" module in package.loaded. See mbmcodec.cpp for the API.
+void installMbmCodecModule(lua_State* L);
+
+#endif // MBMCODEC_H
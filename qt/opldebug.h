@@ -65,11 +65,21 @@ struct Drawable
     int rank;
 };
 
+// See BitmapCache:getStats() in mbm.lua
+struct BitmapCacheStats
+{
+    int entries;
+    qint64 size;
+    int hits;
+    int misses;
+};
+
 struct ProgramInfo
 {
     QVector<Frame> frames;
     QVector<Module> modules;
     QVector<Drawable> drawables;
+    std::optional<BitmapCacheStats> bitmapCache;
     bool paused;
     std::optional<int> err;
     QString exitingError;
@@ -20,13 +20,17 @@
 
 #include "filesystem.h"
 #include "luasupport.h"
+#include "mappedbuffer.h"
 #include "oplkeycode.h"
 #include "asynchandle.h"
 #include "oplfns.h"
+#include "mbmcodec.h"
+#include "pfsdb.h"
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QEvent>
+#include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonValue>
 #include <QSysInfo>
@@ -134,9 +138,13 @@ OplRuntime::OplRuntime(QObject *parent)
     , mIgnoreFocusEvents(false)
     , mHasBackgrounded(false)
     , mHeapCheckEnabled(false)
+    , mBitmapCache(16 * 1024)
+    , mBitmapCacheHits(0)
+    , mBitmapCacheMisses(0)
 {
     mStringCodec = QTextCodec::codecForName("Windows-1252");
     mFs.reset(new FileSystemIoHandler(*mStringCodec));
+    mFileIoPool.setMaxThreadCount(2);
     mConfig["locale"] = "en_GB";
     mConfig["clockFormat"] = "0";
     mConfig["machineName"] = "OpoLua Qt";
@@ -152,6 +160,9 @@ OplRuntime::OplRuntime(QObject *parent)
     luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1);
     luaL_requiref(L, LUA_DBLIBNAME, luaopen_debug, 1);
     lua_settop(L, 0);
+    installMappedBufferSupport(L);
+    installPfsDbModule(L);
+    installMbmCodecModule(L);
 
     configureLuaResourceSearcher(L);
 
@@ -188,6 +199,7 @@ void OplRuntime::pushIohandler()
         IOHANDLER_FN(getTime),
         IOHANDLER_FN(graphicsop),
         IOHANDLER_FN(keysDown),
+        IOHANDLER_FN(loadBitmap),
         IOHANDLER_FN(opsync),
         IOHANDLER_FN(system),
         IOHANDLER_FN(setConfig),
@@ -328,6 +340,7 @@ OplRuntime::~OplRuntime()
         delete mThread;
         mThread = nullptr;
     }
+    mFileIoPool.waitForDone();
     lua_close(L);
     delete mEventRequest;
 }
@@ -866,6 +879,9 @@ void OplRuntime::onThreadExited()
     }
     mPendingRequests.clear();
     mEvents.clear();
+    mFileIoPool.waitForDone();
+    mFs->closeAllFiles();
+    mFs->flushWrites();
     // TODO hmm should really clear the Lua registry of pending requests...
     mEventRequest = nullptr;
 
@@ -1012,6 +1028,11 @@ int OplRuntime::graphicsop(lua_State* L)
         }
 
         mScreen->loadPng(drawableId, pngPath);
+        if (lua_toboolean(L, 4)) {
+            // Caller already has the metrics from an earlier load
+            lua_pushboolean(L, true);
+            return 1;
+        }
         lua_newtable(L);
         setValue(L, "name", metrics.name);
         SET_INT(L, "height", metrics.height);
@@ -1383,6 +1404,108 @@ int OplRuntime::createBitmap(lua_State* L)
     return 1;
 }
 
+// Decodes bitmap index of the MBM or PIC at offset within the file at path straight into image, in the same format
+// that OplRuntimeGui::imageFromBitmap() would produce. Returns false if the file isn't one MbmCodec can handle.
+static bool decodeBitmapFile(const QString& path, qint64 offset, int index, QImage& image, OplScreen::BitmapMode& mode)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray contents;
+    const char* data = reinterpret_cast<const char*>(f.map(0, f.size()));
+    qint64 len = f.size();
+    if (!data) {
+        contents = f.readAll();
+        data = contents.constData();
+        len = contents.size();
+    }
+    if (offset < 0 || offset >= len) {
+        return false;
+    }
+    data += offset;
+    len -= offset;
+
+    const auto bitmaps = MbmCodec::parse(data, len);
+    if (index < 0 || index >= bitmaps.count()) {
+        return false;
+    }
+    const MbmBitmapInfo& info = bitmaps[index];
+    if (info.width == 0 || info.height == 0) {
+        return false;
+    }
+    const QByteArray decoded = MbmCodec::decode(info, data, len);
+    if (decoded.isNull()) {
+        return false;
+    }
+    QImage result(info.width, info.height, info.isColor ? QImage::Format_RGB32 : QImage::Format_Grayscale8);
+    result.fill(0);
+    if (!MbmCodec::imageData(info, decoded, info.isColor ? 32 : 8, result.bits(), result.bytesPerLine())) {
+        return false;
+    }
+    image = result;
+    mode = (OplScreen::BitmapMode)info.mode;
+    return true;
+}
+
+int OplRuntime::loadBitmap(lua_State* L)
+{
+    // Unlike createBitmap, the parsing and decoding happens here on the interpreter thread, so that the main thread
+    // only has to wrap the result in a drawable.
+    const int drawableId = lua_tointeger(L, 1);
+    const QString devicePath = tolocalstring(L, 2);
+    const int index = lua_tointeger(L, 3);
+    const qint64 offset = luaL_optinteger(L, 4, 0);
+
+    mFs->flushWrites(devicePath);
+    const QString path = mFs->getNativePath(devicePath);
+    const QFileInfo fileInfo(path);
+    if (path.isEmpty() || !fileInfo.isFile()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const QString key = QString("%1:%2:%3:%4:%5")
+        .arg(path)
+        .arg(fileInfo.size())
+        .arg(fileInfo.lastModified().toMSecsSinceEpoch())
+        .arg(offset)
+        .arg(index);
+
+    QImage image;
+    OplScreen::BitmapMode mode;
+    if (auto cached = mBitmapCache.object(key)) {
+        mBitmapCacheHits++;
+        image = cached->image;
+        mode = cached->mode;
+    } else {
+        if (!decodeBitmapFile(path, offset, index, image, mode)) {
+            // Let the caller fall back to mbm.lua, which knows about more formats and will report any errors
+            lua_pushnil(L);
+            return 1;
+        }
+        mBitmapCacheMisses++;
+        // The image data is shared rather than copied. If it's too big to cache at all, insert() deletes it again.
+        const int cost = (int)std::max<qint64>(1, image.sizeInBytes() / 1024);
+        mBitmapCache.insert(key, new CachedBitmap { image, mode }, cost);
+    }
+
+    int err = call([this, drawableId, &image, mode] {
+        return mScreen->loadBitmap(drawableId, image, mode);
+    });
+    if (err != KErrNone) {
+        lua_pushnil(L);
+        lua_pushinteger(L, err);
+        return 2;
+    }
+    didWritePixels(image.width() * image.height());
+
+    lua_newtable(L);
+    SET_INT(L, "width", image.width());
+    SET_INT(L, "height", image.height());
+    SET_INT(L, "mode", mode);
+    return 1;
+}
+
 void OplRuntime::pressMenuKey()
 {
     keyEvent(QKeyEvent(QEvent::KeyPress, Qt::Key_F1, Qt::NoModifier));
@@ -1650,6 +1773,8 @@ void OplRuntime::callCompletion(lua_State* L, uint32_t ref, int code, const QByt
 // asyncRequest("after", addr, completion, period)
 // asyncRequest("at", addr, completion, time)
 // asyncRequest("playsound", addr, completion, data, [channel])
+// asyncRequest("fileop", addr, completion, "read"|"readline", handle, maxLen)
+// asyncRequest("fileop", addr, completion, "write", handle, data)
 int OplRuntime::asyncRequest(lua_State* L)
 {
     QString requestName(lua_tostring(L, 1));
@@ -1734,6 +1859,43 @@ int OplRuntime::asyncRequest(lua_State* L)
             mScreen->playSound(ev, channel-1, data);
             return 0;
         });
+    } else if (requestName == "fileop") {
+        QString cmd(lua_tostring(L, 4));
+        auto f = mFs->openFile(lua_tointeger(L, 5));
+        qint64 maxLen = 0;
+        QByteArray writeData;
+        if (cmd == "read" || cmd == "readline") {
+            maxLen = lua_tointeger(L, 6);
+        } else if (cmd == "write") {
+            writeData = to_bytearray(L, 6);
+        } else {
+            return luaL_error(L, "Bad fileop request %s", qPrintable(cmd));
+        }
+        // No parent because we're not on the main thread. The completion is always delivered on the main thread.
+        auto ev = new AsyncHandle(nullptr, statAddr, AsyncHandle::fileop);
+        const quint64 requestId = ev->id();
+        mMutex.lock();
+        mPendingRequests.insert(statAddr, ev);
+        mMutex.unlock();
+        mFileIoPool.start([this, requestId, statAddr, f, cmd, maxLen, writeData] {
+            int code = KErrInvalidArgs;
+            QByteArray data;
+            if (!f) {
+                // Handle was closed
+            } else if (cmd == "read") {
+                code = FileSystemIoHandler::readFile(*f, maxLen, data);
+            } else if (cmd == "readline") {
+                code = FileSystemIoHandler::readFileLine(*f, data);
+            } else {
+                // A write which was cancelled while it was queued mustn't happen at all
+                code = FileSystemIoHandler::writeFile(*f, writeData, [this, requestId, statAddr] {
+                    return !isFileRequestPending(requestId, statAddr);
+                });
+            }
+            QMetaObject::invokeMethod(this, [this, requestId, statAddr, code, data] {
+                fileRequestFinished(requestId, statAddr, code, data);
+            }, Qt::QueuedConnection);
+        });
     } else {
         return luaL_error(L, "TODO asyncRequest %s", lua_tostring(L, 1));
     }
@@ -1791,6 +1953,30 @@ void OplRuntime::asyncFinished(AsyncHandle* asyncHandle, int code)
     delete asyncHandle;
 }
 
+// Callable from any thread
+bool OplRuntime::isFileRequestPending(quint64 requestId, uint32_t ref)
+{
+    QMutexLocker lock(&mMutex);
+    AsyncHandle* asyncHandle = mPendingRequests.value(ref, nullptr);
+    return asyncHandle && asyncHandle->id() == requestId;
+}
+
+void OplRuntime::fileRequestFinished(quint64 requestId, uint32_t ref, int code, const QByteArray& data)
+{
+    ASSERT_MAIN_THREAD();
+    mMutex.lock();
+    AsyncHandle* asyncHandle = mPendingRequests.value(ref, nullptr);
+    if (!asyncHandle || asyncHandle->id() != requestId) {
+        // Request was cancelled (which also deletes its handle) or the thread exited while we were busy, and the
+        // statAddr may since have been reused by a new request, possibly with a handle at the same address.
+        mMutex.unlock();
+        return;
+    }
+    asyncFinished_locked(asyncHandle, code, data);
+    unlockAndSignalIfWaiting();
+    delete asyncHandle;
+}
+
 void OplRuntime::eventRequestComplete_locked(const Event* event)
 {
     QByteArray data;
@@ -2196,23 +2382,36 @@ int OplRuntime::textEditor(lua_State *)
 
 QString OplRuntime::getFont(uint32_t uid, OplScreen::FontMetrics& metrics)
 {
-    auto uidStr = QString::number(uid, 16).toUpper();
-    QString fontPath = QString(":/fonts/%1/%1.json").arg(uidStr);
-    QFile f(fontPath);
-    if (!f.open(QFile::ReadOnly)) {
-        return QString();
-    }
-    auto manifest = QJsonDocument::fromJson(f.readAll());
-    f.close();
+    // The built-in fonts never change, so each manifest only needs to be parsed once per process, however many windows
+    // and runtimes use it.
+    static QMutex cacheMutex;
+    static QHash<uint32_t, OplScreen::FontMetrics> cache;
 
-    metrics.name = manifest["name"].toString();
-    metrics.height = manifest["charh"].toInt();
-    metrics.ascent = manifest["ascent"].toInt();
-    metrics.descent = metrics.height - metrics.ascent; // Why do we still have this??
-    metrics.maxwidth = manifest["maxwidth"].toInt();
-    for (int i = 0; i < 256; i++) {
-        metrics.widths[i] = manifest["widths"][i].toInt();
+    auto uidStr = QString::number(uid, 16).toUpper();
+    QMutexLocker lock(&cacheMutex);
+    auto it = cache.constFind(uid);
+    if (it == cache.constEnd()) {
+        QString fontPath = QString(":/fonts/%1/%1.json").arg(uidStr);
+        QFile f(fontPath);
+        if (!f.open(QFile::ReadOnly)) {
+            return QString();
+        }
+        auto manifest = QJsonDocument::fromJson(f.readAll());
+        f.close();
+
+        OplScreen::FontMetrics parsed;
+        parsed.name = manifest["name"].toString();
+        parsed.height = manifest["charh"].toInt();
+        parsed.ascent = manifest["ascent"].toInt();
+        parsed.descent = parsed.height - parsed.ascent; // Why do we still have this??
+        parsed.maxwidth = manifest["maxwidth"].toInt();
+        const auto widths = manifest["widths"].toArray();
+        for (int i = 0; i < 256; i++) {
+            parsed.widths[i] = widths.at(i).toInt();
+        }
+        it = cache.insert(uid, parsed);
     }
+    metrics = *it;
 
     return QString(":/fonts/%1/%1.png").arg(uidStr);
 }
@@ -2414,7 +2613,29 @@ void OplRuntime::updateDebugInfo(lua_State* L, bool errOnStack)
         lua_pop(L, 1); // final nil from lua_rawgeti
     }       
 
-    lua_pop(L, 2); // drawables, info
+    lua_pop(L, 1); // drawables
+
+    if (rawgetfield(L, -1, "bitmapCache") == LUA_TTABLE) {
+        info.bitmapCache = opl::BitmapCacheStats {
+            .entries = to_int(L, -1, "entries"),
+            .size = to_intt<qint64>(L, -1, "size"),
+            .hits = to_int(L, -1, "hits"),
+            .misses = to_int(L, -1, "misses"),
+        };
+    }
+
+    lua_pop(L, 2); // bitmapCache, info
+
+    // Bitmaps loaded via loadBitmap() don't go through the Lua cache
+    if (mBitmapCacheHits || mBitmapCacheMisses) {
+        auto stats = info.bitmapCache.value_or(opl::BitmapCacheStats{});
+        stats.entries += mBitmapCache.count();
+        stats.size += (qint64)mBitmapCache.totalCost() * 1024;
+        stats.hits += mBitmapCacheHits;
+        stats.misses += mBitmapCacheMisses;
+        info.bitmapCache = stats;
+    }
+
     Q_ASSERT(lua_gettop(L) == top); // Make sure stack is left balanced
 
     if (errOnStack) {
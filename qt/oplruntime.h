@@ -19,8 +19,10 @@
 #ifndef OPLRUNTIME_H
 #define OPLRUNTIME_H
 
+#include <QCache>
 #include <QDir>
 #include <QElapsedTimer>
+#include <QImage>
 #include <QKeyEvent>
 #include <QMap>
 #include <QMutex>
@@ -30,6 +32,7 @@
 #include <QSet>
 #include <QTextCodec>
 #include <QThread>
+#include <QThreadPool>
 #include <QVector>
 #include <functional>
 #include <optional>
@@ -265,6 +268,8 @@ private:
     bool completeAnyRequest_locked(lua_State *L);
     void eventRequestComplete_locked(const Event* event);
     void asyncFinished_locked(AsyncHandle* asyncHandle, int code, const QByteArray& data = QByteArray());
+    bool isFileRequestPending(quint64 requestId, uint32_t ref);
+    void fileRequestFinished(quint64 requestId, uint32_t ref, int code, const QByteArray& data);
     void callCompletion(lua_State* L, uint32_t ref, int code, const QByteArray& data = QByteArray(), bool unref = false);
 
     static OplRuntime* getSelf(lua_State *L);
@@ -288,6 +293,7 @@ private:
     DECLARE_IOHANDLER_FN(getTime);
     DECLARE_MAINTHREAD_IOHANDLER_FN(graphicsop);
     DECLARE_IOHANDLER_FN(keysDown);
+    DECLARE_IOHANDLER_FN(loadBitmap);
     DECLARE_IOHANDLER_FN(opsync);
     DECLARE_MAINTHREAD_IOHANDLER_FN(setConfig);
     DECLARE_IOHANDLER_FN(setEra);
@@ -308,6 +314,7 @@ protected:
     QString mDeviceOpoPath; // Of the current executable (or empty if running a custom launcher)
 private:
     QThread* mThread;
+    QThreadPool mFileIoPool; // Services asyncRequest("fileop")
     mutable QMutex mMutex;
     DeviceType mDeviceType;
     bool mIgnoreOpoEra;
@@ -367,6 +374,16 @@ private:
     bool mHasBackgrounded;
     bool mHeapCheckEnabled;
     std::optional<bool> mPendingSetHeapCheck;
+
+    // Bitmaps decoded by loadBitmap(), keyed on the file's native path, size, modification time, offset and bitmap
+    // index. Costs are in KB. Only accessed from the interpreter thread.
+    struct CachedBitmap {
+        QImage image;
+        OplScreen::BitmapMode mode;
+    };
+    QCache<QString, CachedBitmap> mBitmapCache;
+    int mBitmapCacheHits;
+    int mBitmapCacheMisses;
 };
 
 #endif // OPLRUNTIME_H
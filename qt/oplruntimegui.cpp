@@ -18,6 +18,7 @@
 
 #include "oplruntimegui.h"
 
+#include "appindex.h"
 #include "filesystem.h"
 #include "luasupport.h"
 
@@ -25,6 +26,7 @@
 
 OplRuntimeGui::OplRuntimeGui(QObject *parent)
     : OplRuntime(parent)
+    , mAppIndex(new AppIndex(this))
 {
     // Make sure we use direct connection to execute synchronously with respect to the Lua runtime, so that we can call
     // getAppInfo().
@@ -40,88 +42,55 @@ QBitmap OplRuntimeGui::pixToBitmap(const QPixmap& pixmap)
 #endif
 }
 
-OplAppInfo OplRuntimeGui::getAppInfo(const QString& aifPath)
+// If nativePath is an app with an AIF alongside it, returns the path to that instead.
+static QString aifForApp(const QString& nativePath)
 {
-    OplAppInfo result{};
-    QString nativePath = mFs->getNativePath(aifPath);
-    if (nativePath.isEmpty()) {
-        return result;
-    }
     if (nativePath.toLower().endsWith(".app")) {
         auto aif = nativePath.left(nativePath.length() - 4) + ".aif";
         if (QFileInfo(aif).exists()) {
-            nativePath = aif;
+            return aif;
         }
     }
+    return nativePath;
+}
 
-    QFile f(nativePath);
-    if (!f.open(QFile::ReadOnly)) {
-        return result;
-    }
-    auto data = f.readAll();
-    f.close();
-
-    require(L, "aif");
-    lua_getfield(L, -1, "parseAifToNative");
-    lua_remove(L, -2); // aif
-    pushValue(L, data);
-    int ret = lua_pcall(L, 1, 1, 0);
-    if (ret || lua_type(L, -1) != LUA_TTABLE) {
-        qDebug("parseAif failed: %s", luaL_tolstring(L, -1, nullptr));
-        lua_pop(L, 1);
-        return result;
+OplAppInfo OplRuntimeGui::getAppInfo(const QString& aifPath)
+{
+    const QString nativePath = mFs->getNativePath(aifPath);
+    if (nativePath.isEmpty()) {
+        return OplAppInfo{};
     }
+    return getAppInfos({aifPath}, {aifForApp(nativePath)})[0];
+}
 
-    result.uid = (uint32_t)to_int(L, -1, "uid3");
-
-    rawgetfield(L, -1, "captions");
-    if (rawgetfield(L, -1, "en_GB") == LUA_TSTRING) {
-        result.appName = lua_tostring(L, -1);
-        lua_pop(L, 1);
-    } else {
-        lua_pop(L, 1);
-        lua_rawgeti(L, -1, 1); // captions[1]
-        const char* firstLang = lua_tostring(L, -1);
-        rawgetfield(L, -1, firstLang); // captions[captions[1]]
-        result.appName = lua_tostring(L, -1);
-        lua_pop(L, 2); // appName, firstLang
-    }
-    lua_pop(L, 1); // captions
+QString OplRuntimeGui::getDeviceAppPath(const QString& aifPath, const QString& nativePath)
+{
     if (nativePath.toLower().endsWith(".opa")) {
-        result.deviceAppPath = aifPath;
-    } else {
-        auto appDir = QFileInfo(nativePath).dir();
-        auto apps = appDir.entryList({"*.app"}, QDir::Files);
-        if (apps.count() == 1) {
-            result.deviceAppPath = aifPath.left(aifPath.lastIndexOf("\\") + 1) + apps[0];
-        }
+        return aifPath;
     }
+    auto apps = mAppIndex->entryList(QFileInfo(nativePath).path(), {"*.app"}, QDir::Files);
+    if (apps.count() == 1) {
+        return aifPath.left(aifPath.lastIndexOf("\\") + 1) + apps[0];
+    }
+    return QString();
+}
 
-    rawgetfield(L, -1, "icons");
-    for (int i = 1; ; i++) {
-        if (lua_rawgeti(L, -1, i) != LUA_TTABLE) {
-            lua_pop(L, 1);
-            break;
-        }
-
-        rawgetfield(L, -1, "bitmap");
-        QPixmap img = imageFromBitmap(L, -1);
-        lua_pop(L, 1); // bitmap
-        QBitmap mask;
-        if (rawgetfield(L, -1, "mask") == LUA_TTABLE) {
-            mask = pixToBitmap(imageFromBitmap(L, -1));
-        }
-        lua_pop(L, 1); // mask
-
-        if (!img.isNull()) {
-            if (!mask.isNull()) {
-                img.setMask(mask);
-            }
-            result.icon.addPixmap(img);
+// Returns an OplAppInfo for each of aifPaths, leaving those that can't be parsed default-initialised.
+QVector<OplAppInfo> OplRuntimeGui::getAppInfos(const QStringList& aifPaths, const QStringList& nativePaths)
+{
+    QVector<OplAppInfo> result(aifPaths.count());
+    const auto entries = mAppIndex->getEntries(nativePaths);
+    for (int i = 0; i < entries.count(); i++) {
+        const auto& entry = entries[i];
+        if (!entry.valid) {
+            continue;
         }
-        lua_pop(L, 1); // icon
+        auto& info = result[i];
+        info.uid = entry.uid;
+        info.appName = entry.appName;
+        info.deviceAppPath = getDeviceAppPath(aifPaths[i], nativePaths[i]);
+        info.icon = AppIndex::makeIcon(entry);
     }
-    lua_pop(L, 2); // icons, result
     return result;
 }
 
@@ -132,16 +101,19 @@ QVector<OplAppInfo> OplRuntimeGui::getCDriveApps()
     if (path.isEmpty()) {
         return result;
     }
-    QDir appsDir(path);
-    for (const QString& appDirName : appsDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+    QStringList aifPaths, nativePaths;
+    for (const QString& appDirName : mAppIndex->entryList(path, {}, QDir::Dirs | QDir::NoDotAndDotDot)) {
         // qDebug("Entry %s", qPrintable(appDirName));
-        QDir appDir(appsDir.path() + "/" + appDirName, "*.aif", QDir::NoSort, QDir::Files);
-        auto aifs = appDir.entryList();
+        const QString appDirPath = path + "/" + appDirName;
+        auto aifs = mAppIndex->entryList(appDirPath, {"*.aif"}, QDir::Files);
         if (aifs.count() == 1) {
-            auto info = getAppInfo("C:\\System\\Apps\\" + appDirName + "\\" + aifs[0]);
-            if (!info.deviceAppPath.isEmpty()) {
-                result.append(info);
-            }
+            aifPaths.append("C:\\System\\Apps\\" + appDirName + "\\" + aifs[0]);
+            nativePaths.append(appDirPath + "/" + aifs[0]);
+        }
+    }
+    for (const auto& info : getAppInfos(aifPaths, nativePaths)) {
+        if (!info.deviceAppPath.isEmpty()) {
+            result.append(info);
         }
     }
     return result;
@@ -154,10 +126,13 @@ QVector<OplAppInfo> OplRuntimeGui::getMDriveApps()
     if (path.isEmpty()) {
         return result;
     }
-    QDir appsDir(path);
-    for (const QString& appName : appsDir.entryList({"*.OPA", "*.APP"}, QDir::Files)) {
+    QStringList aifPaths, nativePaths;
+    for (const QString& appName : mAppIndex->entryList(path, {"*.OPA", "*.APP"}, QDir::Files)) {
         // qDebug("Entry %s", qPrintable(appName));
-        auto info = getAppInfo("M:\\APP\\" + appName);
+        aifPaths.append("M:\\APP\\" + appName);
+        nativePaths.append(aifForApp(path + "/" + appName));
+    }
+    for (const auto& info : getAppInfos(aifPaths, nativePaths)) {
         if (!info.deviceAppPath.isEmpty()) {
             result.append(info);
         }
@@ -26,6 +26,7 @@
 
 #include "oplruntime.h"
 
+class AppIndex;
 struct OplAppInfo;
 
 class OplRuntimeGui : public OplRuntime
@@ -49,6 +50,13 @@ signals:
 private slots:
 
     void onStartedRunning();
+
+private:
+    QString getDeviceAppPath(const QString& aifPath, const QString& nativePath);
+    QVector<OplAppInfo> getAppInfos(const QStringList& aifPaths, const QStringList& nativePaths);
+
+private:
+    AppIndex* mAppIndex;
 };
 
 struct OplAppInfo {
@@ -29,6 +29,7 @@
 
 class AsyncHandle;
 class OplFontProvider;
+class QImage;
 
 class OplScreen {
 
@@ -180,6 +181,7 @@ public:
     virtual int createWindow(int drawableId, const QRect& rect, BitmapMode mode, int shadow) = 0;
     virtual int createBitmap(int drawableId, const QSize& size, BitmapMode mode) = 0;
     virtual int loadPng(int drawableId, const QString& path) = 0;
+    virtual int loadBitmap(int drawableId, const QImage& image, BitmapMode mode) = 0;
     virtual int setOrder(int drawableId, int order) = 0;
     virtual int getRank(int drawableId) = 0;
     virtual int showWindow(int drawableId, bool flag) = 0;
@@ -23,9 +23,11 @@
 #include "clockwidget.h"
 #include "oplfns.h"
 #include "oplruntimegui.h"
+#include "pixelscaler.h"
 
 #include <QDateTime>
 #include <QPainter>
+#include <QPixmapCache>
 #include <QSet>
 
 #if 0
@@ -65,9 +67,14 @@ void OplScreenWidget::init()
         closeDrawable(drawableId);
     }
     mWindows.clear();
+    mWindowOrder.clear();
     mDrawables.clear();
     Q_ASSERT(findChildren<Window*>().count() == 0);
     delete mStoppedShadow;
+    mSpriteTimer.reset();
+    mSpriteDirty = QRegion();
+    delete mSpriteWidget;
+    mSpriteWidget = nullptr;
 }
 
 void OplScreenWidget::onStopped()
@@ -103,13 +110,20 @@ void OplScreenWidget::setScale(int scale)
     }
     auto sz = sizeHint();
     if (mSpriteWidget) {
+        // Resizing clears the sprite layer, so everything needs redrawing
         mSpriteWidget->resize(sz);
+        QRegion sprites;
+        for (Window* w : mWindows) {
+            sprites += w->spriteBounds();
+        }
+        invalidateSprites(sprites);
     }
     if (mStoppedShadow) {
         mStoppedShadow->resize(sz);
     }
     if (mShadowOverlay) {
         mShadowOverlay->resize(sz);
+        updateShadows();
     }
     updateGeometry();
 }
@@ -180,8 +194,10 @@ void OplScreenWidget::closeDrawable(int drawableId)
 {
     auto win = mWindows.value(drawableId, nullptr);
     if (win) {
+        invalidateSprites(win->spriteBounds());
         delete win;
         mWindows.remove(drawableId);
+        mWindowOrder.removeOne(win);
         updateShadows();
     } else {
         auto drawable = mDrawables.value(drawableId, nullptr);
@@ -198,6 +214,7 @@ int OplScreenWidget::createWindow(int drawableId, const QRect& rect, BitmapMode
     auto win = new Window(this, drawableId, rect, mode, shadowSize);
     win->setScale(mScale);
     mWindows.insert(drawableId, win);
+    mWindowOrder.append(win); // New widgets go on top
     mDrawables.insert(drawableId, win);
     if (mShadowOverlay) {
         updateShadows();
@@ -216,10 +233,15 @@ int OplScreenWidget::createBitmap(int drawableId, const QSize& size, BitmapMode
 
 int OplScreenWidget::loadPng(int drawableId, const QString& path)
 {
+    // These are always resources (font glyph sheets and the like) so are shared between all the drawables that load
+    // them, rather than being decoded again each time. Anything that draws into one gets its own copy at that point.
     QPixmap img;
-    bool ok = img.load(path, "PNG");
-    if (!ok) {
-        return KErrGenFail;
+    if (!QPixmapCache::find(path, &img)) {
+        bool ok = img.load(path, "PNG");
+        if (!ok) {
+            return KErrGenFail;
+        }
+        QPixmapCache::insert(path, img);
     }
 
     auto bmp = new Drawable(drawableId, std::move(img), OplScreen::gray2);
@@ -227,6 +249,13 @@ int OplScreenWidget::loadPng(int drawableId, const QString& path)
     return KErrNone;
 }
 
+int OplScreenWidget::loadBitmap(int drawableId, const QImage& image, BitmapMode mode)
+{
+    auto bmp = new Drawable(drawableId, QPixmap::fromImage(image), mode);
+    mDrawables.insert(drawableId, bmp);
+    return KErrNone;
+}
+
 /**
  N.B. In OPL terms position=1 means the front and position=n means the back, whereas child[0] is at the back and
  child[n-1] the front.
@@ -237,24 +266,20 @@ int OplScreenWidget::setOrder(int drawableId, int order)
     if (!win) {
         return KErrDrawNotOpen;
     }
-    QList<Window*> children = findChildren<Window*>();
-    Q_ASSERT(children.count() == mWindows.count());
-    int orderNorm = qMin(qMax(1, order), mWindows.count());
-    int currentPos = children.indexOf(win);
-    int newPos = mWindows.count() - orderNorm;
-    // qDebug("order %d pos %d -> %d count=%d", order, currentPos, newPos, (int)children.count());
+    const int count = mWindowOrder.count();
+    int orderNorm = qMin(qMax(1, order), count);
+    int currentPos = mWindowOrder.indexOf(win);
+    int newPos = count - orderNorm;
+    // qDebug("order %d pos %d -> %d count=%d", order, currentPos, newPos, count);
+    mWindowOrder.move(currentPos, newPos);
 
-    if (newPos == mWindows.count() - 1) {
+    if (newPos == count - 1) {
         win->raise();
         if (mSpriteWidget) {
             mSpriteWidget->raise();
         }
     } else {
-        if (newPos > currentPos) {
-            // Have to allow for the fact the window is already below the widget we want to stack under
-            newPos++;
-        }
-        win->stackUnder(children[newPos]);
+        win->stackUnder(mWindowOrder[newPos + 1]);
     }
     updateShadows();
     return KErrNone;
@@ -267,10 +292,9 @@ int OplScreenWidget::getRank(int drawableId)
         return KErrDrawNotOpen;
     }
 
-    QList<Window*> children = findChildren<Window*>();
-    int uipos = children.indexOf(win);
+    int uipos = mWindowOrder.indexOf(win);
     Q_ASSERT(uipos > -1);
-    return children.count() - uipos;
+    return mWindowOrder.count() - uipos;
 }
 
 int OplScreenWidget::showWindow(int drawableId, bool flag)
@@ -304,10 +328,12 @@ int OplScreenWidget::setWindowRect(int drawableId, const QPoint& position, const
     if (!win) {
         return KErrDrawNotOpen;
     }
+    QRegion sprites = win->spriteBounds();
     win->setPos(position);
     if (size) {
         win->setSize(*size);
     }
+    invalidateSprites(sprites + win->spriteBounds());
     updateShadows();
     return KErrNone;
 }
@@ -506,36 +532,68 @@ void OplScreenWidget::playSound(AsyncHandle* handle, int channel, const QByteArr
 
 void OplScreenWidget::sprite(int drawableId, int spriteId, const OplScreen::Sprite* sprite)
 {
+    if (sprite && !mSpriteTimer) {
+        mSpriteTimer.reset(new QTimer());
+        mSpriteTimer->setTimerType(Qt::PreciseTimer);
+        mSpriteTimer->setSingleShot(true);
+        connect(mSpriteTimer.get(), &QTimer::timeout, this, &OplScreenWidget::spriteTimerTick);
+        if (!mSpriteClock.isValid()) {
+            mSpriteClock.start();
+        }
+        if (!mSpriteWidget) {
+            mSpriteWidget = new SpriteWidget(this);
+        }
+    }
+
     Window* w = mWindows.value(drawableId);
     if (w) {
-        w->setSprite(spriteId, sprite);
+        invalidateSprites(w->setSprite(spriteId, sprite, spriteTime()));
     } else {
         qDebug("No window found for sprite drawable %d!", drawableId);
     }
+}
 
-    if (sprite && !mSpriteTimer) {
-        mSpriteTimer.reset(new QTimer());
-        mSpriteTimer->setTimerType(Qt::PreciseTimer);
-        mLastSpriteTick = QDateTime::currentMSecsSinceEpoch();
-        connect(mSpriteTimer.get(), &QTimer::timeout, this, &OplScreenWidget::spriteTimerTick);
-        mSpriteWidget = new SpriteWidget(this);
-        mSpriteTimer->start(50);
+int64_t OplScreenWidget::spriteTime() const
+{
+    return mSpriteClock.isValid() ? mSpriteClock.nsecsElapsed() / 1000 : 0;
+}
+
+// Repaints of the sprite layer are coalesced, by deferring them to the next spriteTimerTick().
+void OplScreenWidget::invalidateSprites(const QRegion& region)
+{
+    if (region.isEmpty() || !mSpriteTimer) {
+        return;
+    }
+    mSpriteDirty += region;
+    if (!mSpriteTimer->isActive() || mSpriteTimer->remainingTime() > 0) {
+        mSpriteTimer->start(0);
     }
 }
 
 void OplScreenWidget::spriteTimerTick()
 {
-    int64_t now = QDateTime::currentMSecsSinceEpoch();
-    int64_t delta = now - mLastSpriteTick;
+    const int64_t now = spriteTime();
+    int64_t next = -1;
     for (Window* w : mWindows) {
-        w->animateSprites(delta * 1000);
+        mSpriteDirty += w->animateSprites(now);
+        const int64_t deadline = w->nextSpriteDeadline();
+        if (deadline >= 0 && (next < 0 || deadline < next)) {
+            next = deadline;
+        }
     }
-    mLastSpriteTick = now;
 
     // An oddity of the sprite API is that they can appear anywhere on the screen, ie are not cropped to the Window they
     // are associated with. For that reason, we need to keep a separate fullscreen transparent pixmap around to render
     // them in to.
-    mSpriteWidget->renderSprites(mWindows.values(), mScale);
+    if (!mSpriteDirty.isEmpty()) {
+        mSpriteWidget->renderSprites(mWindows.values(), mScale, mSpriteDirty);
+        mSpriteDirty = QRegion();
+    }
+
+    // Nothing to do until the next frame change, if there is one
+    if (next >= 0) {
+        mSpriteTimer->start((int)qMax<int64_t>(0, (next - now + 999) / 1000));
+    }
 }
 
 QByteArray OplScreenWidget::peekLine(int drawableId, const QPoint& position, int numPixels, OplScreen::PeekMode mode)
@@ -545,8 +603,7 @@ QByteArray OplScreenWidget::peekLine(int drawableId, const QPoint& position, int
         qDebug("Bad drawableId %d to peekLine", drawableId);
         return QByteArray();
     }
-    auto img = src->getPixmap().toImage();
-    img.convertTo(QImage::Format_Grayscale8); // Simplifies logic
+    const QImage& img = src->getImage();
     QByteArray result;
     int bitIdx = 0;
     uint8_t currentByte = 0;
@@ -584,7 +641,15 @@ QByteArray OplScreenWidget::peekLine(int drawableId, const QPoint& position, int
         numValidPixels = 0;
     }
     if (numValidPixels > 0) {
-        auto bits = img.constScanLine(position.y()) + position.x();
+        // Grayscale simplifies the logic, and colour drawables only need the one line converting
+        QImage line;
+        const uchar* bits;
+        if (img.format() == QImage::Format_Grayscale8) {
+            bits = img.constScanLine(position.y()) + position.x();
+        } else {
+            line = img.copy(position.x(), position.y(), numValidPixels, 1).convertToFormat(QImage::Format_Grayscale8);
+            bits = line.constScanLine(0);
+        }
         auto endPtr = bits + numValidPixels;
         while (bits < endPtr) {
             addPixel(*bits++);
@@ -609,8 +674,7 @@ QByteArray OplScreenWidget::getImageData(int drawableId, const QRect& rect)
     }
 
     const bool isColor = src->getMode() >= OplScreen::color16;
-    auto img = src->getPixmap().toImage().copy(rect);
-    img.convertTo(isColor ? QImage::Format_RGB32 : QImage::Format_Grayscale8);
+    auto img = src->getImage().copy(rect); // Already in the right format
     QByteArray result;
     for (int i = 0; i < img.height(); i++) {
         auto ptr = img.constScanLine(i);
@@ -623,7 +687,7 @@ void OplScreenWidget::updateShadows()
 {
     if (mShadowOverlay) {
         mShadowOverlay->raise();
-        mShadowOverlay->update();
+        mShadowOverlay->updateShadowRegion();
     }
 }
 
@@ -653,9 +717,41 @@ void Drawable::update()
     // For subclass
 }
 
+// Returns the area that cmd can touch, erring on the side of too big.
+static QRect drawCmdBounds(const OplScreen::DrawCmd& cmd, const QSize& size)
+{
+    const int pen = qMax(1, cmd.penWidth);
+    switch (cmd.type) {
+    case OplScreen::fill:
+        return QRect(cmd.origin, cmd.fill.size);
+    case OplScreen::line:
+        return QRect(cmd.origin, cmd.line.endPoint).normalized().adjusted(-pen, -pen, pen, pen);
+    case OplScreen::circle: {
+        int r = cmd.circle.radius + pen;
+        return QRect(cmd.origin.x() - r, cmd.origin.y() - r, 2 * r + 1, 2 * r + 1);
+    }
+    case OplScreen::ellipse: {
+        int hr = cmd.ellipse.hRadius + pen;
+        int vr = cmd.ellipse.vRadius + pen;
+        return QRect(cmd.origin.x() - hr, cmd.origin.y() - vr, 2 * hr + 1, 2 * vr + 1);
+    }
+    case OplScreen::box:
+        return QRect(cmd.origin, cmd.box.size).adjusted(-pen, -pen, pen, pen);
+    case OplScreen::scroll:
+        return cmd.scroll.rect.united(cmd.scroll.rect.translated(cmd.scroll.dx, cmd.scroll.dy));
+    case OplScreen::border:
+        return cmd.border.rect;
+    case OplScreen::cmdInvert:
+        return QRect(cmd.origin, cmd.invert.size);
+    default:
+        return QRect(QPoint(), size);
+    }
+}
+
 void Drawable::draw(const OplScreen::DrawCmd& cmd)
 {
     invalidateMask();
+    invalidateImage(drawCmdBounds(cmd, size()));
     PAINTER_BEGIN(painter, &mPixmap);
     QPen pen(cmd.mode == OplScreen::clear ? cmd.bgcolor : cmd.color);
     pen.setWidth(cmd.penWidth);
@@ -760,6 +856,7 @@ void Drawable::setSize(const QSize& size)
     newPixmap.fill(QColorConstants::White);
     mPixmap.swap(newPixmap);
     invalidateMask();
+    invalidateImage(QRect(QPoint(), size));
 }
 
 QPixmap& Drawable::getPixmap()
@@ -783,6 +880,37 @@ void Drawable::invalidateMask()
     }
 }
 
+const QImage& Drawable::getImage()
+{
+    const auto format = mode >= OplScreen::color16 ? QImage::Format_RGB32 : QImage::Format_Grayscale8;
+    if (mImage.size() != mPixmap.size() || mImage.format() != format) {
+        mImage = mPixmap.toImage().convertToFormat(format);
+        mImageDirty = QRegion();
+    } else if (!mImageDirty.isEmpty()) {
+        if (mImageDirty.rectCount() > 16) {
+            // Not worth converting lots of little bits separately
+            mImageDirty = mImageDirty.boundingRect();
+        }
+        const int bytesPerPixel = mImage.depth() / 8;
+        for (const QRect& rect : mImageDirty) {
+            QImage part = mPixmap.copy(rect).toImage().convertToFormat(format);
+            for (int y = 0; y < rect.height(); y++) {
+                memcpy(mImage.scanLine(rect.y() + y) + rect.x() * bytesPerPixel, part.constScanLine(y),
+                    rect.width() * bytesPerPixel);
+            }
+        }
+        mImageDirty = QRegion();
+    }
+    return mImage;
+}
+
+void Drawable::invalidateImage(const QRect& rect)
+{
+    if (!mImage.isNull()) {
+        mImageDirty += rect.intersected(QRect(QPoint(), mPixmap.size()));
+    }
+}
+
 Drawable* Drawable::getGreyPlane() const
 {
     // Bitmaps never have a grey plane.
@@ -791,6 +919,7 @@ Drawable* Drawable::getGreyPlane() const
 
 void Drawable::drawSetPixels(const OplScreen::CopyMultipleCmd& cmd, Drawable& src, const QRect& srcRect, const QRect& destRect)
 {
+    invalidateImage(destRect);
     PAINTER_BEGIN(painter, &mPixmap);
     painter.setPen(cmd.color);
     if (cmd.invert) {
@@ -819,6 +948,7 @@ void Drawable::drawCopy(const OplScreen::DrawCmd& cmd, Drawable& src, Drawable*
     } else {
         destRect = QRect(cmd.origin, cmd.copy.srcRect.size());
     }
+    invalidateImage(destRect);
     if (mask) {
         QPixmap maskedSource(src.mPixmap);
         QBitmap pixmask = mask->getMask();
@@ -892,10 +1022,52 @@ void Drawable::drawCopy(const OplScreen::DrawCmd& cmd, Drawable& src, Drawable*
 void Drawable::loadFromBitmap(bool color, int width, int height, const QByteArray& data)
 {
     invalidateMask();
+    invalidateImage(QRect(0, 0, width, height));
     // qDebug("loadFromBitmap color=%d width=%d height=%d datalen=%d", color, width, height, data.size());
     mPixmap = OplRuntimeGui::imageFromBitmap(color, width, height, data);
 }
 
+// Sprite frames shorter than this are shown for this long instead, so that zero-length frames can't keep the sprite
+// timer spinning.
+static const int64_t KMinSpriteFrameTime = 20000; // microseconds
+
+// Sprites are only redrawn from their bitmaps when they're (re)created or updated, so this does the masking up front.
+static QPixmap compositeSpriteFrame(OplScreenWidget* screen, const OplScreen::SpriteFrame& frame)
+{
+    Drawable* src = screen->getBitmap(frame.bitmap);
+    if (!src) {
+        return QPixmap();
+    }
+    if (!frame.mask) {
+        return src->getPixmap();
+    }
+    Drawable* mask = screen->getBitmap(frame.mask);
+    if (!mask) {
+        return QPixmap();
+    }
+    QPixmap maskedSource(src->getPixmap());
+    QBitmap m = mask->getMask();
+    if (!frame.invertMask) {
+        // Sprite masks are backwards by default, so we have to flip the colours if invertMask is _not_ set
+        PAINTER_BEGIN(inverter, &m);
+        inverter.setCompositionMode(QPainter::RasterOp_SourceAndNotDestination);
+        inverter.fillRect(m.rect(), Qt::color0);
+    }
+    maskedSource.setMask(m);
+    return maskedSource;
+}
+
+// Returns where the sprite's current frame is drawn, in unscaled screen coordinates. There can be a lack of a current
+// frame if the sprite has not yet got any frames with valid bitmaps set, in which case this returns an empty rect.
+static QRect spriteFrameBounds(const WindowSprite& sprite, const QPoint& windowPos)
+{
+    if (sprite.currentFrame >= sprite.images.count() || sprite.images[sprite.currentFrame].isNull()) {
+        return QRect();
+    }
+    const auto& frame = sprite.frames[sprite.currentFrame];
+    return QRect(windowPos + sprite.origin + frame.offset, sprite.images[sprite.currentFrame].size());
+}
+
 Window::Window(OplScreenWidget* screen, int drawableId, const QRect& rect, OplScreen::BitmapMode mode, int shadowSize)
     : QLabel(screen)
     , Drawable(drawableId, rect.size(), mode)
@@ -972,10 +1144,31 @@ void Window::drawCopy(const OplScreen::DrawCmd& cmd, Drawable& src, Drawable* ma
     }
 }
 
+void Window::invalidateImage(const QRect& rect)
+{
+    Drawable::invalidateImage(rect);
+    if (mDamage.rectCount() >= 16) {
+        // Keep the cost of adding to the region bounded when there are lots of little draws
+        mDamage = mDamage.boundingRect();
+    }
+    mDamage += rect;
+}
+
 void Window::update()
 {
+    const QRect bounds(QPoint(), mPixmap.size());
+    const QSize scaledSize = bounds.size() * mScale;
+    QRegion damage;
+    damage.swap(mDamage);
+    if (mScaled.size() != scaledSize) {
+        mScaled = QImage(scaledSize, QImage::Format_RGB32);
+        damage = bounds;
+    }
+
     QPixmap unscaledPixmap;
     if (mGreyPlane) {
+        // Changes to the grey plane aren't tracked, so recomposite everything
+        damage = bounds;
         unscaledPixmap = QPixmap(mPixmap.size());
         PAINTER_BEGIN(painter, &unscaledPixmap);
         painter.drawPixmap(QPoint(), mGreyPlane->getPixmap());
@@ -987,14 +1180,29 @@ void Window::update()
         unscaledPixmap = mPixmap;
     }
 
-    if (mScale == 1) {
-        setPixmap(unscaledPixmap);
-    } else {
-        auto scaled = unscaledPixmap.scaled(scaledRect().size());
-        setPixmap(scaled);
+    if (damage.rectCount() > 16) {
+        // Not worth scaling lots of little bits separately
+        damage = damage.boundingRect();
+    }
+    for (const QRect& damagedRect : damage) {
+        const QRect rect = damagedRect.intersected(bounds);
+        if (rect.isEmpty()) {
+            continue;
+        }
+        const QImage src = unscaledPixmap.copy(rect).toImage().convertToFormat(QImage::Format_RGB32);
+        auto dest = reinterpret_cast<quint32*>(mScaled.scanLine(rect.y() * mScale)) + rect.x() * mScale;
+        PixelScaler::scale(reinterpret_cast<const quint32*>(src.constBits()), src.bytesPerLine() / 4, rect.width(),
+            rect.height(), dest, mScaled.bytesPerLine() / 4, mScale);
+        QWidget::update(QRect(rect.topLeft() * mScale, rect.size() * mScale));
     }
 }
 
+void Window::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(this);
+    painter.drawImage(event->rect(), mScaled, event->rect());
+}
+
 Drawable& Window::greyPlane()
 {
     Q_ASSERT(getMode() == OplScreen::monochromeWithGreyPlane);
@@ -1006,33 +1214,12 @@ Drawable* Window::getGreyPlane() const
     return mGreyPlane.get();
 }
 
-void Window::updateSprites(QPainter& painter)
+void Window::updateSprites(QPainter& painter, const QRect& clip)
 {
-    auto screen = static_cast<OplScreenWidget*>(parent());
     for (const auto& sprite : mSprites) {
-        if (sprite.currentFrame >= sprite.frames.count()) {
-            // There can be a lack of a current frame if the sprite has not yet got any frames with valid bitmaps set
-            continue;
-        }
-        auto& frame = sprite.frames[sprite.currentFrame];
-        QPoint pos(this->pos() + sprite.origin + frame.offset);
-        Drawable* src = screen->getBitmap(frame.bitmap);
-        if (!src) continue;
-        if (frame.mask) {
-            Drawable* mask = screen->getBitmap(frame.mask);
-            if (!mask) continue;
-            QPixmap maskedSource(src->getPixmap());
-            QBitmap m = mask->getMask();
-            if (!frame.invertMask) {
-                // Sprite masks are backwards by default, so we have to flip the colours if invertMask is _not_ set
-                PAINTER_BEGIN(inverter, &m);
-                inverter.setCompositionMode(QPainter::RasterOp_SourceAndNotDestination);
-                inverter.fillRect(m.rect(), Qt::color0);
-            }
-            maskedSource.setMask(m);
-            painter.drawPixmap(pos, maskedSource);
-        } else {
-            painter.drawPixmap(pos, src->getPixmap());
+        QRect bounds = spriteFrameBounds(sprite, getPos());
+        if (bounds.intersects(clip)) {
+            painter.drawPixmap(bounds.topLeft(), sprite.images[sprite.currentFrame]);
         }
     }
 }
@@ -1085,6 +1272,7 @@ void Window::setSize(const QSize& size)
     if (mHighlight) {
         mHighlight->resize(scaledSize);
     }
+    update();
 }
 
 void Window::setScale(int scale)
@@ -1109,34 +1297,71 @@ QRect Window::scaledRect() const
         mUnscaledRect.width() * mScale, mUnscaledRect.height() * mScale);
 }
 
-void Window::setSprite(int spriteId, const OplScreen::Sprite* sprite)
+QRegion Window::setSprite(int spriteId, const OplScreen::Sprite* sprite, int64_t now_us)
 {
+    QRegion dirty;
+    auto existing = mSprites.constFind(spriteId);
+    if (existing != mSprites.constEnd()) {
+        dirty += spriteFrameBounds(*existing, getPos());
+    }
     if (!sprite) {
         mSprites.remove(spriteId);
-        return;
+        return dirty;
     }
+    auto screen = static_cast<OplScreenWidget*>(parent());
     WindowSprite s{};
     s.origin = sprite->origin;
     s.frames = sprite->frames;
-    if (sprite->frames.count()) {
-        s.remainingFrameTime = sprite->frames[0].time;
+    s.frameDeadline = -1;
+    for (const auto& frame : s.frames) {
+        s.images.append(compositeSpriteFrame(screen, frame));
     }
+    if (s.frames.count() > 1) {
+        s.frameDeadline = now_us + qMax<int64_t>(s.frames[0].time, KMinSpriteFrameTime);
+    }
+    dirty += spriteFrameBounds(s, getPos());
     mSprites[spriteId] = s;
-    update();
+    return dirty;
 }
 
-void Window::animateSprites(int64_t interval_us)
+QRegion Window::animateSprites(int64_t now_us)
 {
-    if (mSprites.isEmpty()) {
-        return;
-    }
+    QRegion dirty;
     for (auto& sprite : mSprites) {
-        sprite.remainingFrameTime = sprite.remainingFrameTime - interval_us;
-        if (sprite.remainingFrameTime <= 0) {
-            sprite.currentFrame = (sprite.currentFrame + 1) % sprite.frames.count();
-            sprite.remainingFrameTime = sprite.frames[sprite.currentFrame].time;
+        if (sprite.frameDeadline < 0 || sprite.frameDeadline > now_us) {
+            continue;
+        }
+        dirty += spriteFrameBounds(sprite, getPos());
+        sprite.currentFrame = (sprite.currentFrame + 1) % sprite.frames.count();
+        const int64_t frameTime = qMax<int64_t>(sprite.frames[sprite.currentFrame].time, KMinSpriteFrameTime);
+        // Keep to the sprite's own cadence, unless we've fallen so far behind that we'd have to skip frames
+        sprite.frameDeadline += frameTime;
+        if (sprite.frameDeadline <= now_us) {
+            sprite.frameDeadline = now_us + frameTime;
         }
+        dirty += spriteFrameBounds(sprite, getPos());
     }
+    return dirty;
+}
+
+QRegion Window::spriteBounds() const
+{
+    QRegion result;
+    for (const auto& sprite : mSprites) {
+        result += spriteFrameBounds(sprite, getPos());
+    }
+    return result;
+}
+
+int64_t Window::nextSpriteDeadline() const
+{
+    int64_t result = -1;
+    for (const auto& sprite : mSprites) {
+        if (sprite.frameDeadline >= 0 && (result < 0 || sprite.frameDeadline < result)) {
+            result = sprite.frameDeadline;
+        }
+    }
+    return result;
 }
 
 void Window::setHighlighted(bool flag)
@@ -1156,32 +1381,43 @@ void Window::setHighlighted(bool flag)
 //
 
 SpriteWidget::SpriteWidget(OplScreenWidget* screen)
-    : QLabel(screen)
+    : QWidget(screen)
 {
     setAttribute(Qt::WA_TransparentForMouseEvents);
     resize(screen->size()); // This will configure mPixmap via resizeEvent
     show();
 }
 
-void SpriteWidget::renderSprites(const QList<Window*>& windows, int scale)
+void SpriteWidget::renderSprites(const QList<Window*>& windows, int scale, const QRegion& region)
 {
     // The sprite widget follows the Qt size of OplScreenWidget (ie scaled)
-    mPixmap.fill(Qt::transparent);
+    const QRegion scaledRegion = QTransform::fromScale(scale, scale).map(region);
     PAINTER_BEGIN(painter, &mPixmap);
+    painter.setClipRegion(scaledRegion);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.fillRect(scaledRegion.boundingRect(), Qt::transparent);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     painter.scale(scale, scale);
+    const QRect clip = region.boundingRect();
     for (Window* w : windows) {
-        w->updateSprites(painter);
+        w->updateSprites(painter, clip);
     }
     painter.end();
-    setPixmap(mPixmap);
+    update(scaledRegion);
+}
+
+void SpriteWidget::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(this);
+    painter.drawPixmap(event->rect(), mPixmap, event->rect());
 }
 
 void SpriteWidget::resizeEvent(QResizeEvent *event)
 {
-    QLabel::resizeEvent(event);
+    QWidget::resizeEvent(event);
     mPixmap = QPixmap(size());
     mPixmap.fill(Qt::transparent);
-    setPixmap(mPixmap);
+    update();
 }
 
 //
@@ -1204,15 +1440,24 @@ void WindowShadow::paintEvent(QPaintEvent* event)
 
 //
 
-ShadowOverlay::ShadowOverlay(QWidget* parent)
+ShadowOverlay::ShadowOverlay(OplScreenWidget* parent)
     : QWidget(parent)
 {
     setAttribute(Qt::WA_TransparentForMouseEvents);
     setGeometry(0, 0, parent->width(), parent->height());
     show();
+    updateShadowRegion();
 }
 
-void ShadowOverlay::paintEvent(QPaintEvent* event)
+void ShadowOverlay::updateShadowRegion()
+{
+    QRegion shadow = calculateShadowRegion();
+    // Only the areas which have gained or lost shadow need repainting
+    update(shadow.xored(mShadow));
+    mShadow.swap(shadow);
+}
+
+QRegion ShadowOverlay::calculateShadowRegion() const
 {
     // This is the union of everywhere on screen that a shadow should be drawn to.
     QRegion shadow;
@@ -1221,22 +1466,24 @@ void ShadowOverlay::paintEvent(QPaintEvent* event)
     // list). Occluded areas should not get shadows from windows later down in the order.
     QRegion occludedi;
 
-    auto screen = qobject_cast<OplScreenWidget*>(parent());
+    auto screen = static_cast<OplScreenWidget*>(parent());
     const int scale = screen->getScale();
 
-    QList<Window*> windows = screen->findChildren<Window*>();
-    // windows is ordered back-to-front
-    std::reverse(windows.begin(), windows.end());
+    QVector<const Window*> windows;
+    const auto& order = screen->getWindowOrder();
+    // order is back-to-front
+    for (auto i = order.crbegin(); i != order.crend(); ++i) {
+        windows.append(*i);
+    }
     // windows is now ordered front-to-back
     const int n = windows.count();
     // For each window, iterate the windows below it and work out where shadows should fall on each window
     // Note, windows without shadow do not cause shadow depth to increase.
     for (int i = 0; i < n; i++) {
-        Window& window = *windows[i];
+        const Window& window = *windows[i];
         const auto shadowSize = window.getShadowSize();
-        QRegion windowRegion(window.geometry());
-        occludedi += windowRegion;
-        if (shadowSize == 0 || !window.isVisible()) {
+        occludedi += window.geometry();
+        if (shadowSize == 0 || window.isHidden()) {
             continue;
         }
         QRegion occludedj(occludedi);
@@ -1248,30 +1495,31 @@ void ShadowOverlay::paintEvent(QPaintEvent* event)
             if (j == n) {
                 jrect = screen->rect();
             } else {
-                if (!windows[j]->isVisible()) {
+                // isHidden() rather than !isVisible(), because the latter also depends on whether the screen itself is
+                // currently shown, which we don't want baked in to the cached region
+                if (windows[j]->isHidden()) {
                     continue;
                 }
                 jrect = windows[j]->geometry();
             }
             int shadowOffset = shadowSize * scale * shadowDepth;
-            QRegion winShadowRegion(
-                window.x() + shadowOffset,
-                window.y() + shadowOffset,
-                window.width(),
-                window.height()
-            );
-            auto region = winShadowRegion.subtracted(occludedj).intersected(jrect);
-            shadow |= region;
+            QRect winShadowRect = window.geometry().translated(shadowOffset, shadowOffset);
+            if (winShadowRect.intersects(jrect)) {
+                shadow |= QRegion(winShadowRect).subtracted(occludedj).intersected(jrect);
+            }
             occludedj += jrect;
             if (j < n && windows[j]->getShadowSize()) {
                 shadowDepth++;
             }
         }
     }
+    return shadow;
+}
 
+void ShadowOverlay::paintEvent(QPaintEvent* event)
+{
     QPainter painter(this);
     QBrush brush(QColor(128, 128, 128, 128)); // 50% transparent grey
-    painter.setClipRegion(shadow);
+    painter.setClipRegion(mShadow);
     painter.fillRect(event->rect(), brush);
 }
-
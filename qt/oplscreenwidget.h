@@ -20,12 +20,14 @@
 #define OPLSCREENWIDGET_H
 
 #include <QBitmap>
+#include <QElapsedTimer>
 #include <QImage>
 #include <QKeyEvent>
 #include <QLabel>
 #include <QMap>
 #include <QPainter>
 #include <QPointer>
+#include <QRegion>
 #include <QScopedPointer>
 #include <QSet>
 #include <QTimer>
@@ -44,7 +46,8 @@ class ShadowOverlay;
 struct WindowSprite : public OplScreen::Sprite
 {
     int currentFrame;
-    int64_t remainingFrameTime;
+    int64_t frameDeadline; // In OplScreenWidget::spriteTime() microseconds, or -1 if the sprite never changes frame
+    QVector<QPixmap> images; // Each frame's bitmap with its mask applied, null if the bitmap wasn't found
 };
 
 class OplScreenWidget : public QWidget, public OplScreen
@@ -57,6 +60,7 @@ public:
 
     int getScale() const { return mScale; }
     void setScale(int scale);
+    const QList<Window*>& getWindowOrder() const { return mWindowOrder; } // Back to front
     QSize sizeHint() const override;
 
     void mouseEvent(QMouseEvent* event, Window* window);
@@ -77,6 +81,7 @@ protected:
     int createWindow(int drawableId, const QRect& rect, BitmapMode mode, int shadow) override;
     int createBitmap(int drawableId, const QSize& size, BitmapMode mode) override;
     int loadPng(int drawableId, const QString& path) override;
+    int loadBitmap(int drawableId, const QImage& image, BitmapMode mode) override;
     int setOrder(int drawableId, int order) override;
     int getRank(int drawableId) override;
     int showWindow(int drawableId, bool flag) override;
@@ -93,6 +98,8 @@ protected:
     QByteArray peekLine(int drawableId, const QPoint& position, int numPixels, PeekMode mode) override;
     QByteArray getImageData(int drawableId, const QRect& rect) override;
     void updateShadows();
+    int64_t spriteTime() const;
+    void invalidateSprites(const QRegion& region);
 
 private slots:
     void spriteTimerTick();
@@ -108,6 +115,7 @@ signals:
 private:
     OplRuntimeGui* mRuntime;
     QMap<int, Window*> mWindows;
+    QList<Window*> mWindowOrder; // Back to front, ie the same order as the Window widgets are stacked in
     QMap<int, Drawable*> mDrawables;
     QSet<Drawable*> mBatchSeenDrawables;
     int mScale;
@@ -115,8 +123,9 @@ private:
     QPointer<WindowShadow> mStoppedShadow;
     QScopedPointer<Drawable> mDitherPattern;
     SpriteWidget* mSpriteWidget;
-    QScopedPointer<QTimer> mSpriteTimer;
-    int64_t mLastSpriteTick;
+    QScopedPointer<QTimer> mSpriteTimer; // Single shot, armed for the next sprite frame change or pending repaint
+    QElapsedTimer mSpriteClock;
+    QRegion mSpriteDirty; // Unscaled screen coordinates
     QScopedPointer<QTimer> mClockTimer;
     QPointer<ShadowOverlay> mShadowOverlay;
     AudioPlayer* mAudioChannels[2];
@@ -140,6 +149,10 @@ public:
     QPixmap& getPixmap();
     QBitmap& getMask();
     void invalidateMask();
+    // A CPU-side copy of mPixmap, in Format_Grayscale8 or Format_RGB32 depending on the mode, for reading pixels back.
+    // It's brought up to date lazily, only for the areas passed to invalidateImage() since the last call.
+    const QImage& getImage();
+    virtual void invalidateImage(const QRect& rect);
     virtual Drawable* getGreyPlane() const;
 
     virtual void update();
@@ -149,6 +162,8 @@ protected:
     QPixmap mPixmap;
     OplScreen::BitmapMode mode;
     QBitmap mMask;
+    QImage mImage;
+    QRegion mImageDirty;
 };
 
 class Window : public QLabel, public Drawable
@@ -168,13 +183,19 @@ public:
     void drawCopy(const OplScreen::DrawCmd& cmd, Drawable& src, Drawable* mask) override;
     Drawable* getGreyPlane() const override;
     void update() override;
-    void setSprite(int spriteId, const OplScreen::Sprite* sprite);
-    void animateSprites(int64_t interval_us);
-    void updateSprites(QPainter& painter);
+    // These return the area (in unscaled screen coordinates) that needs repainting as a result.
+    QRegion setSprite(int spriteId, const OplScreen::Sprite* sprite, int64_t now_us);
+    QRegion animateSprites(int64_t now_us);
+    QRegion spriteBounds() const;
+    // Returns the time at which the next sprite frame change is due, or -1 if there isn't one.
+    int64_t nextSpriteDeadline() const;
+    void updateSprites(QPainter& painter, const QRect& clip);
 
     void setHighlighted(bool flag);
 
 protected:
+    void invalidateImage(const QRect& rect) override;
+    void paintEvent(QPaintEvent *event) override;
     virtual void mousePressEvent(QMouseEvent *event) override;
     virtual void mouseMoveEvent(QMouseEvent *event) override;
     virtual void mouseReleaseEvent(QMouseEvent *event) override;
@@ -193,18 +214,22 @@ private:
     int mShadowSize;
     QScopedPointer<Drawable> mGreyPlane;
     WindowShadow* mHighlight;
+    QImage mScaled; // What's actually shown, ie the window contents at mScale
+    QRegion mDamage; // Areas changed since the last update(), in unscaled coordinates
 };
 
-class SpriteWidget : public QLabel
+class SpriteWidget : public QWidget
 {
     Q_OBJECT
 
 public:
     explicit SpriteWidget(OplScreenWidget* screen);
-    void renderSprites(const QList<Window*>& windows, int scale);
+    // Redraws just the given region (in unscaled screen coordinates) of the sprite layer.
+    void renderSprites(const QList<Window*>& windows, int scale, const QRegion& region);
 
 protected:
-    void resizeEvent(QResizeEvent *event);
+    void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
 
 private:
     QPixmap mPixmap;
@@ -231,11 +256,19 @@ class ShadowOverlay : public QWidget
 
 public:
 
-    explicit ShadowOverlay(QWidget* parent);
+    explicit ShadowOverlay(OplScreenWidget* parent);
+    // Recalculates where shadows fall, and repaints wherever that has changed. Must be called whenever any window is
+    // created, closed, moved, resized, reordered, shown or hidden.
+    void updateShadowRegion();
 
 protected:
     void paintEvent(QPaintEvent *event) override;
 
+private:
+    QRegion calculateShadowRegion() const;
+
+private:
+    QRegion mShadow; // In screen (ie scaled) coordinates
 };
 
 #endif // OPLSCREENWIDGET_H
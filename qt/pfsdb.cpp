@@ -0,0 +1,965 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "pfsdb.h"
+#include "mappedbuffer.h"
+
+#include <QtEndian>
+#include <cstring>
+
+// A permanent file store is a 0x1E byte header followed by a sequence of frames, each of which starts with a 16-bit
+// descriptor giving the frame type (top 2 bits) and the length of its data (bottom 14 bits). Every KPageSize bytes
+// starting from KFrameDataStart there is an anchor descriptor, which either starts a new frame or continues the frame
+// that ran into it. A stream is made up of one frame plus however many continuation frames it needs. Stream offsets in
+// the table of contents (TOC) are the offset of the stream's data not counting the anchors, which is why we strip
+// those out before parsing (see also depageBinary() in database.lua).
+
+static const quint32 KPermanentFileStoreLayoutUid = 0x10000050;
+static const quint32 KDbmsStoreDatabase = 0x10000069;
+
+static const int KStoreHeaderLen = 0x1E;
+static const int KFrameDataStart = 0x20;
+static const int KPageSize = 0x4000;
+static const int KTocHeaderLen = 12;
+static const int KTocEntryLen = 5;
+
+enum FrameType : quint16 {
+    EFrameFree = 0x0000,
+    EFrameData = 0x4000,
+    EFrameDescriptive = 0x8000,
+    EFrameContinuation = 0xC000,
+};
+
+// Stream ids of the fixed streams at the start of every database we write
+static const quint32 KDbTokenStreamId = 1;
+static const quint32 KSchemaStreamId = 2;
+static const quint32 KRootStreamId = 3;
+
+static const int KClusterMaxRecords = 16; // Limited by the size of the membership bitmask
+static const int KClusterMaxLen = 0x1000;
+static const int KClustering = 16; // What DBMS always seems to write in the table definition
+
+static bool hasMaxLen(quint8 type)
+{
+    return type == PfsDatabase::EDbColText8 || type == PfsDatabase::EDbColText16 || type == PfsDatabase::EDbColBinary;
+}
+
+// CRC-CCITT, as per Mem::Crc() and crc.lua
+static quint16 crc16(const char* data, int len, quint16 crc = 0)
+{
+    for (int i = 0; i < len; i++) {
+        crc ^= (quint16)((quint8)data[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (quint16)((crc << 1) ^ 0x1021) : (quint16)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+quint32 PfsDatabase::uidsChecksum(const char* uids)
+{
+    char even[6], odd[6];
+    for (int i = 0; i < 6; i++) {
+        even[i] = uids[i * 2];
+        odd[i] = uids[i * 2 + 1];
+    }
+    return ((quint32)crc16(odd, 6) << 16) | crc16(even, 6);
+}
+
+namespace {
+
+// Bounds-checked little-endian reader. Once a read has failed, all subsequent reads return zero and ok() is false.
+class Reader {
+public:
+    Reader(const QByteArray& data, qint64 pos)
+        : mData(data), mPos(pos), mOk(pos >= 0 && pos <= data.size())
+    {}
+
+    bool ok() const { return mOk; }
+    qint64 pos() const { return mPos; }
+    void setPos(qint64 pos) { mPos = pos; mOk = mOk && pos >= 0 && pos <= mData.size(); }
+
+    bool skip(qint64 n)
+    {
+        if (!check(n)) {
+            return false;
+        }
+        mPos += n;
+        return true;
+    }
+
+    quint8 u8() { return check(1) ? (quint8)mData.constData()[mPos++] : 0; }
+    quint16 u16() { return get<quint16>(); }
+    quint32 u32() { return get<quint32>(); }
+    qint16 i16() { return get<qint16>(); }
+    qint32 i32() { return get<qint32>(); }
+    double real64()
+    {
+        const quint64 bits = get<quint64>();
+        double result;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    // TCardinality, see readCardinality() in init.lua
+    quint32 cardinality()
+    {
+        quint32 val = u8();
+        if ((val & 1) == 0) {
+            return val >> 1;
+        } else if ((val & 2) == 0) {
+            return (val | ((quint32)u8() << 8)) >> 2;
+        } else if ((val & 4) == 0) {
+            val |= (quint32)u8() << 8;
+            val |= (quint32)u16() << 16;
+            return val >> 3;
+        } else {
+            mOk = false;
+            return 0;
+        }
+    }
+
+    // The length prefix of a descriptor, see readSpecialEncoding() in init.lua
+    quint32 descriptorLength()
+    {
+        quint32 val = u8();
+        if ((val & 3) == 2) {
+            return val >> 2;
+        } else if ((val & 7) == 6) {
+            return (val | ((quint32)u8() << 8)) >> 3;
+        } else {
+            mOk = false;
+            return 0;
+        }
+    }
+
+    QByteArray descriptor()
+    {
+        quint32 len = descriptorLength();
+        if (!check(len)) {
+            return QByteArray();
+        }
+        QByteArray result(mData.constData() + mPos, (int)len);
+        mPos += len;
+        return result;
+    }
+
+    // Returns a reference to the next n bytes, rather than a copy
+    QByteArray rawData(qint64 n)
+    {
+        if (!check(n)) {
+            return QByteArray();
+        }
+        QByteArray result = QByteArray::fromRawData(mData.constData() + mPos, (int)n);
+        mPos += n;
+        return result;
+    }
+
+private:
+    bool check(qint64 n)
+    {
+        mOk = mOk && n >= 0 && mPos + n <= mData.size();
+        return mOk;
+    }
+
+    template <typename T>
+    T get()
+    {
+        if (!check(sizeof(T))) {
+            return 0;
+        }
+        T result = qFromLittleEndian<T>(mData.constData() + mPos);
+        mPos += sizeof(T);
+        return result;
+    }
+
+private:
+    const QByteArray& mData;
+    qint64 mPos;
+    bool mOk;
+};
+
+class Writer {
+public:
+    QByteArray& data() { return mData; }
+
+    void u8(quint8 val) { mData.append((char)val); }
+    void u16(quint16 val) { put(val); }
+    void u32(quint32 val) { put(val); }
+    void i16(qint16 val) { put(val); }
+    void i32(qint32 val) { put(val); }
+    void real64(double val)
+    {
+        quint64 bits;
+        memcpy(&bits, &val, sizeof(bits));
+        put(bits);
+    }
+
+    void cardinality(quint32 val)
+    {
+        if (val < 0x80) {
+            u8((quint8)(val << 1));
+        } else if (val < 0x4000) {
+            u16((quint16)((val << 2) | 1));
+        } else {
+            u32((val << 3) | 3);
+        }
+    }
+
+    void descriptor(const QByteArray& str)
+    {
+        if (str.size() < 0x40) {
+            u8((quint8)((str.size() << 2) | 2));
+        } else {
+            u16((quint16)((str.size() << 3) | 6));
+        }
+        mData.append(str);
+    }
+
+private:
+    template <typename T>
+    void put(T val)
+    {
+        char buf[sizeof(T)];
+        qToLittleEndian<T>(val, buf);
+        mData.append(buf, sizeof(T));
+    }
+
+private:
+    QByteArray mData;
+};
+
+// Lays streams out into frames, inserting anchors as necessary
+class StoreWriter {
+public:
+    StoreWriter()
+        : mPos(0)
+    {
+        mData.fill('\0', KStoreHeaderLen);
+    }
+
+    // Returns the offset of the stream, for the TOC
+    quint32 writeStream(FrameType type, const QByteArray& data)
+    {
+        // A frame can't end 1 or 2 bytes short of an anchor, because there wouldn't be room for the next descriptor
+        // (and the data it describes). If that would happen, insert a small free frame first to move things along.
+        if (!fits(mPos, data.size())) {
+            for (int pad = 1; pad < 8; pad++) {
+                if (fits(mPos, pad) && fits(frameEnd(mPos, pad), data.size())) {
+                    writeFrame(EFrameFree, QByteArray(pad, '\0'));
+                    break;
+                }
+            }
+        }
+        return writeFrame(type, data);
+    }
+
+    // Fills in the store header given the offset of the TOC stream
+    QByteArray finish(quint32 uid2, quint32 uid3, quint32 tocOffset)
+    {
+        char* header = mData.data();
+        qToLittleEndian<quint32>(KPermanentFileStoreLayoutUid, header);
+        qToLittleEndian<quint32>(uid2, header + 4);
+        qToLittleEndian<quint32>(uid3, header + 8);
+        qToLittleEndian<quint32>(PfsDatabase::uidsChecksum(header), header + 12);
+        // The reference points at the TOC entries rather than the start of the TOC
+        const quint32 ref = tocOffset + KTocHeaderLen;
+        qToLittleEndian<quint32>(ref << 1, header + 16); // Backup TOC
+        qToLittleEndian<qint32>(0, header + 20); // Handle
+        qToLittleEndian<quint32>(ref, header + 24);
+        qToLittleEndian<quint16>(crc16(header + 16, 12), header + 28);
+        return mData;
+    }
+
+private:
+    static bool atAnchor(qint64 pos)
+    {
+        return pos % KPageSize == 0;
+    }
+
+    static qint64 frameEnd(qint64 pos, qint64 len)
+    {
+        return pos + (atAnchor(pos) ? 0 : 2) + len;
+    }
+
+    static bool fits(qint64 pos, qint64 len)
+    {
+        return KPageSize - frameEnd(pos, len) % KPageSize > 2;
+    }
+
+    quint32 writeFrame(FrameType type, const QByteArray& data)
+    {
+        const quint32 offset = (quint32)(atAnchor(mPos) ? mPos : mPos + 2);
+        const char* ptr = data.constData();
+        qint64 remaining = data.size();
+        quint16 frameType = type;
+        do {
+            const qint64 avail = KPageSize - mPos % KPageSize - (atAnchor(mPos) ? 0 : 2);
+            const qint64 n = qMin(remaining, avail);
+            // A length of zero means the frame runs up to the next anchor
+            const quint16 len = n == avail ? 0 : (quint16)n;
+            char desc[2];
+            qToLittleEndian<quint16>(frameType | len, desc);
+            mData.append(desc, 2);
+            if (!atAnchor(mPos)) {
+                mPos += 2;
+            }
+            mData.append(ptr, (int)n);
+            mPos += n;
+            ptr += n;
+            remaining -= n;
+            frameType = EFrameContinuation;
+        } while (remaining > 0);
+        return offset;
+    }
+
+private:
+    QByteArray mData;
+    qint64 mPos; // Not counting anchors
+};
+
+} // namespace
+
+bool PfsDatabase::fail(const QString& err)
+{
+    mError = err;
+    return false;
+}
+
+qint64 PfsDatabase::streamPos(quint32 streamId) const
+{
+    if (streamId == 0 || streamId > (quint32)mToc.count()) {
+        return -1;
+    }
+    const quint32 offset = mToc[streamId - 1];
+    // Zero entries are (as far as we can tell) unused, rather than pointing at the first frame
+    if (offset == 0 || offset + KFrameDataStart > (quint32)mData.size()) {
+        return -1;
+    }
+    return offset + KFrameDataStart;
+}
+
+bool PfsDatabase::open(const char* data, qint64 len)
+{
+    mData.clear();
+    mToc.clear();
+    mTables.clear();
+    if (len < KFrameDataStart) {
+        return fail("Database file too short");
+    }
+
+    // Strip the anchors
+    mData.reserve((int)len);
+    mData.append(data, KFrameDataStart);
+    for (qint64 pos = KFrameDataStart; pos < len; pos += KPageSize + 2) {
+        mData.append(data + pos, (int)qMin<qint64>(KPageSize, len - pos));
+    }
+
+    Reader r(mData, 0);
+    const quint32 uid1 = r.u32();
+    if (uid1 != KPermanentFileStoreLayoutUid) {
+        return fail(QString("Bad DB UID1 %1").arg(uid1));
+    }
+    mUid2 = r.u32();
+    mUid3 = r.u32();
+    r.skip(4); // UID checksum
+
+    // TPermanentStoreHeader
+    const quint32 backup = r.u32();
+    const qint32 handle = r.i32();
+    const qint32 ref = r.i32();
+    qint64 tocPos;
+    if (handle == 0) {
+        if (ref + KFrameDataStart - KTocHeaderLen >= mData.size()) {
+            tocPos = (backup >> 1) + KFrameDataStart - KTocHeaderLen;
+        } else {
+            tocPos = ref + KFrameDataStart - KTocHeaderLen;
+        }
+    } else {
+        tocPos = mData.size() - KTocHeaderLen - KTocEntryLen * (qint64)handle;
+    }
+
+    Reader toc(mData, tocPos);
+    const quint32 rootStreamId = toc.u32();
+    toc.skip(4);
+    const quint32 tocCount = toc.u32();
+    if (!toc.ok() || tocCount > (quint32)(mData.size() / KTocEntryLen)) {
+        return fail("Bad TOC");
+    }
+    mToc.reserve((int)tocCount);
+    for (quint32 i = 0; i < tocCount; i++) {
+        toc.skip(1);
+        mToc.append(toc.u32());
+    }
+    if (!toc.ok()) {
+        return fail("Bad TOC");
+    }
+
+    // TOplDocRootStream
+    Reader root(mData, streamPos(rootStreamId));
+    mAppUid = root.u32();
+    const quint32 schemaStreamId = root.u32();
+    if (!root.ok()) {
+        return fail("Bad root stream");
+    }
+
+    Reader schema(mData, streamPos(schemaStreamId));
+    if (schema.u32() != KDbmsStoreDatabase) {
+        return fail("Root stream does not point to a table definition");
+    }
+    schema.skip(5); // Version byte and database token stream id
+    const quint32 numTables = schema.cardinality();
+    for (quint32 i = 0; i < numTables && schema.ok(); i++) {
+        PfsTable table;
+        table.name = schema.descriptor();
+        const quint32 numFields = schema.cardinality();
+        for (quint32 j = 0; j < numFields && schema.ok(); j++) {
+            PfsField field;
+            field.name = schema.descriptor();
+            field.type = schema.u8();
+            schema.u8(); // Column attributes
+            if (hasMaxLen(field.type)) {
+                field.maxLen = schema.u8();
+            }
+            table.fields.append(field);
+        }
+        schema.cardinality(); // Clustering
+        table.tokenId = schema.u32();
+        // We don't know how to parse index definitions, so can't find the next table if there are any
+        if (schema.cardinality() != 0 && i + 1 < numTables) {
+            return fail(QString("Table %1 has indexes, which are not supported").arg(QString(table.name)));
+        }
+        mTables.append(table);
+    }
+    if (!schema.ok()) {
+        return fail("Bad table definition");
+    }
+    return true;
+}
+
+bool PfsDatabase::readRecords(int tableIndex, QVector<PfsRecord>& records)
+{
+    if (tableIndex < 0 || tableIndex >= mTables.count()) {
+        return fail("Bad table index");
+    }
+    const PfsTable& table = mTables[tableIndex];
+    const int numFields = table.fields.count();
+
+    // TDbStoreRecords::TToken
+    Reader token(mData, streamPos(table.tokenId));
+    quint32 clusterId = token.u32();
+    token.skip(4); // Next record id
+    const quint32 count = token.cardinality();
+    if (!token.ok()) {
+        return fail(QString("Bad record token for table %1").arg(QString(table.name)));
+    }
+    records.reserve(records.count() + (int)qMin<quint32>(count, (quint32)mData.size()));
+
+    // Guard against cycles in a corrupt cluster chain
+    int maxClusters = mToc.count();
+    while (clusterId != 0 && maxClusters-- > 0) {
+        const qint64 clusterPos = streamPos(clusterId);
+        if (clusterPos < 0) {
+            // Sometimes the next cluster id points to a zero TOC entry rather than simply being zero
+            break;
+        }
+        Reader r(mData, clusterPos);
+        const quint32 nextClusterId = r.u32();
+        const quint16 membership = r.u16();
+        quint32 lengths[KClusterMaxRecords];
+        int numRecords = 0;
+        for (int bit = 0; bit < KClusterMaxRecords; bit++) {
+            if (membership & (1 << bit)) {
+                lengths[numRecords++] = r.cardinality();
+            }
+        }
+
+        const int before = records.count();
+        for (int i = 0; i < numRecords && r.ok(); i++) {
+            const qint64 end = r.pos() + lengths[i];
+            PfsRecord rec(numFields);
+
+            // Each column has a presence bit, and some types have additional bits. Bits are read from a byte at a
+            // time, with each byte immediately followed by the values for the columns whose bits are in it.
+            quint8 mask = 0;
+            int bitsLeft = 0;
+            auto nextBit = [&]() -> bool {
+                if (bitsLeft == 0) {
+                    mask = r.u8();
+                    bitsLeft = 8;
+                }
+                const bool result = mask & 1;
+                mask >>= 1;
+                bitsLeft--;
+                return result;
+            };
+
+            for (int f = 0; f < numFields && r.ok(); f++) {
+                if (bitsLeft == 0 && r.pos() >= end) {
+                    // Any remaining columns are null
+                    break;
+                }
+                if (!nextBit()) {
+                    continue;
+                }
+                PfsValue& val = rec[f];
+                switch (table.fields[f].type) {
+                case EDbColBit:
+                    nextBit(); // The value, which OPL can't represent
+                    break;
+                case EDbColInt16:
+                    val.type = PfsValue::Integer;
+                    val.integer = r.i16();
+                    break;
+                case EDbColInt32:
+                    val.type = PfsValue::Integer;
+                    val.integer = r.i32();
+                    break;
+                case EDbColReal64:
+                    val.type = PfsValue::Real;
+                    val.real = r.real64();
+                    break;
+                case EDbColDateTime:
+                    r.skip(8);
+                    break;
+                case EDbColText8:
+                    val.type = PfsValue::Text;
+                    val.text = r.rawData(r.u8());
+                    break;
+                case EDbColLongText8:
+                    if (nextBit()) {
+                        r.skip(r.descriptorLength()); // Inline
+                    } else {
+                        r.skip(8); // Stream id and length
+                    }
+                    break;
+                case EDbColLongBinary:
+                    if (nextBit()) {
+                        r.skip(r.descriptorLength());
+                    } else {
+                        r.skip(4);
+                    }
+                    break;
+                default:
+                    return fail(QString("Unhandled field type %1").arg(table.fields[f].type));
+                }
+            }
+
+            if (!r.ok() || r.pos() > end) {
+                break;
+            }
+            r.setPos(end);
+            records.append(rec);
+        }
+        if (!r.ok() || records.count() - before < numRecords) {
+            return fail(QString("Bad data cluster %1 in table %2").arg(clusterId).arg(QString(table.name)));
+        }
+        clusterId = nextClusterId;
+    }
+    return true;
+}
+
+static QByteArray encodeRecord(const PfsTable& table, const PfsRecord& rec)
+{
+    Writer w;
+    int maskPos = 0;
+    int bit = 8;
+    for (int i = 0; i < table.fields.count(); i++) {
+        if (bit == 8) {
+            maskPos = w.data().size();
+            w.u8(0);
+            bit = 0;
+        }
+        const PfsValue val = i < rec.count() ? rec[i] : PfsValue();
+        bool present = true;
+        switch (table.fields[i].type) {
+        case PfsDatabase::EDbColInt16:
+            present = val.type == PfsValue::Integer || val.type == PfsValue::Real;
+            if (present) {
+                w.i16((qint16)(val.type == PfsValue::Integer ? val.integer : (qint64)val.real));
+            }
+            break;
+        case PfsDatabase::EDbColInt32:
+            present = val.type == PfsValue::Integer || val.type == PfsValue::Real;
+            if (present) {
+                w.i32((qint32)(val.type == PfsValue::Integer ? val.integer : (qint64)val.real));
+            }
+            break;
+        case PfsDatabase::EDbColReal64:
+            present = val.type == PfsValue::Integer || val.type == PfsValue::Real;
+            if (present) {
+                w.real64(val.type == PfsValue::Real ? val.real : (double)val.integer);
+            }
+            break;
+        case PfsDatabase::EDbColText8:
+            present = val.type == PfsValue::Text;
+            if (present) {
+                const int len = qMin(val.text.size(), 255);
+                w.u8((quint8)len);
+                w.data().append(val.text.constData(), len);
+            }
+            break;
+        default:
+            // Anything OPL can't represent is written as null, which only takes the one bit
+            present = false;
+            break;
+        }
+        if (present) {
+            w.data()[maskPos] = (char)(w.data()[maskPos] | (1 << bit));
+        }
+        bit++;
+    }
+    return w.data();
+}
+
+QByteArray PfsDatabase::write(const QVector<PfsTable>& tables, quint32 uid2, quint32 uid3, quint32 appUid)
+{
+    // Work out which records go in which clusters first, because the schema needs to know the stream ids of the tokens
+    // that come after them. Stream ids are allocated in the order the streams are written, after the fixed ones. Like
+    // DBMS, the first cluster of each table comes immediately before its token (which Db:loadTable() relies on) and
+    // any further clusters come after it.
+    struct Cluster {
+        QVector<QByteArray> records;
+        int len = 0;
+    };
+    QVector<QVector<Cluster>> tableClusters;
+    QVector<quint32> tokenIds;
+    quint32 nextStreamId = KRootStreamId + 1;
+    for (const PfsTable& table : tables) {
+        QVector<Cluster> clusters;
+        for (const PfsRecord& rec : table.records) {
+            QByteArray data = encodeRecord(table, rec);
+            if (clusters.isEmpty() || clusters.last().records.count() == KClusterMaxRecords
+                || (clusters.last().len + data.size() > KClusterMaxLen && !clusters.last().records.isEmpty())) {
+                clusters.append(Cluster());
+            }
+            clusters.last().len += data.size();
+            clusters.last().records.append(data);
+        }
+        // The token's next record id has to point to a free slot in the last cluster, so make sure there is one. This
+        // also means that an empty table gets an empty cluster, which is what DBMS does.
+        if (clusters.isEmpty() || clusters.last().records.count() == KClusterMaxRecords) {
+            clusters.append(Cluster());
+        }
+        tokenIds.append(nextStreamId + 1);
+        nextStreamId += clusters.count() + 1;
+        tableClusters.append(clusters);
+    }
+
+    StoreWriter store;
+    QVector<quint32> toc;
+
+    // The database token, which is always all zeros
+    toc.append(store.writeStream(EFrameData, QByteArray(9, '\0')));
+
+    Writer schema;
+    schema.u32(KDbmsStoreDatabase);
+    schema.u8(0);
+    schema.u32(KDbTokenStreamId);
+    schema.cardinality(tables.count());
+    for (int i = 0; i < tables.count(); i++) {
+        const PfsTable& table = tables[i];
+        schema.descriptor(table.name);
+        schema.cardinality(table.fields.count());
+        for (const PfsField& field : table.fields) {
+            schema.descriptor(field.name);
+            schema.u8(field.type);
+            schema.u8(0); // Attributes
+            if (hasMaxLen(field.type)) {
+                schema.u8(field.maxLen);
+            }
+        }
+        schema.cardinality(KClustering);
+        schema.u32(tokenIds[i]);
+        schema.cardinality(0); // Indexes
+    }
+    toc.append(store.writeStream(EFrameData, schema.data()));
+
+    Writer root;
+    root.u32(appUid);
+    root.u32(KSchemaStreamId);
+    toc.append(store.writeStream(EFrameData, root.data()));
+
+    for (int i = 0; i < tables.count(); i++) {
+        const QVector<Cluster>& clusters = tableClusters[i];
+        const quint32 tokenId = tokenIds[i];
+        auto clusterId = [tokenId](int c) -> quint32 {
+            return c == 0 ? tokenId - 1 : tokenId + c;
+        };
+        for (int c = 0; c < clusters.count(); c++) {
+            const Cluster& cluster = clusters[c];
+            Writer w;
+            w.u32(c + 1 < clusters.count() ? clusterId(c + 1) : 0);
+            w.u16((quint16)((1 << cluster.records.count()) - 1));
+            for (const QByteArray& rec : cluster.records) {
+                w.cardinality(rec.size());
+            }
+            for (const QByteArray& rec : cluster.records) {
+                w.data().append(rec);
+            }
+            toc.append(store.writeStream(EFrameData, w.data()));
+
+            if (c == 0) {
+                // TDbStoreRecords::TToken
+                Writer token;
+                token.u32(clusterId(0));
+                // The next record id is the next free slot in the last cluster
+                token.u32((clusterId(clusters.count() - 1) << 4) | clusters.last().records.count());
+                token.cardinality(tables[i].records.count());
+                token.u32(0); // Auto-increment
+                toc.append(store.writeStream(EFrameData, token.data()));
+                Q_ASSERT(toc.count() == (int)tokenId);
+            }
+        }
+    }
+
+    Writer tocStream;
+    tocStream.u32(KRootStreamId);
+    tocStream.u32(0);
+    tocStream.u32(toc.count());
+    for (quint32 offset : toc) {
+        tocStream.u8(0);
+        tocStream.u32(offset);
+    }
+    const quint32 tocOffset = store.writeStream(EFrameDescriptive, tocStream.data());
+    return store.finish(uid2, uid3, tocOffset);
+}
+
+//// Lua bindings
+
+static const char* KPfsStoreType = "PfsStore";
+
+static PfsDatabase* checkStore(lua_State* L, int idx)
+{
+    return *static_cast<PfsDatabase**>(luaL_checkudata(L, idx, KPfsStoreType));
+}
+
+// pfsdb.open(data) -> store
+//
+// Where data is a string or mapped buffer containing the database file. Errors if it cannot be parsed.
+static int pfsdb_open(lua_State* L)
+{
+    size_t len = 0;
+    const char* data = toBufferData(L, 1, &len);
+    luaL_argexpected(L, data, 1, "string or MappedBuffer");
+    auto ud = static_cast<PfsDatabase**>(lua_newuserdatauv(L, sizeof(PfsDatabase*), 0));
+    *ud = new PfsDatabase;
+    luaL_setmetatable(L, KPfsStoreType);
+    if (!(*ud)->open(data, (qint64)len)) {
+        pushValue(L, (*ud)->errorString());
+        return lua_error(L);
+    }
+    return 1;
+}
+
+// store:info() -> { uid2 = ..., uid3 = ..., appUid = ... }
+static int store_info(lua_State* L)
+{
+    PfsDatabase* db = checkStore(L, 1);
+    lua_createtable(L, 0, 3);
+    SET_INT(L, "uid2", db->uid2());
+    SET_INT(L, "uid3", db->uid3());
+    SET_INT(L, "appUid", db->appUid());
+    return 1;
+}
+
+// store:tables() -> array of { name = ..., fields = array of { name = ..., rawType = ..., maxLen = ... } }
+static int store_tables(lua_State* L)
+{
+    PfsDatabase* db = checkStore(L, 1);
+    const auto& tables = db->tables();
+    lua_createtable(L, tables.count(), 0);
+    for (int i = 0; i < tables.count(); i++) {
+        const PfsTable& table = tables[i];
+        lua_createtable(L, 0, 2);
+        setValue(L, "name", table.name);
+        lua_createtable(L, table.fields.count(), 0);
+        for (int j = 0; j < table.fields.count(); j++) {
+            const PfsField& field = table.fields[j];
+            lua_createtable(L, 0, 3);
+            setValue(L, "name", field.name);
+            SET_INT(L, "rawType", field.type);
+            if (hasMaxLen(field.type)) {
+                SET_INT(L, "maxLen", field.maxLen);
+            }
+            lua_rawseti(L, -2, j + 1);
+        }
+        lua_setfield(L, -2, "fields");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+// store:readRecords(tableIndex, tbl) -> count
+//
+// Appends the records of the given (1-based) table to tbl, which must be laid out as per newTable() in database.lua,
+// ie with an array of values per field in tbl.columns and the number of records in tbl.count. As with Db:loadTable(),
+// fields that are null are given their default value, and fields that OPL cannot represent are left empty.
+static int store_readRecords(lua_State* L)
+{
+    PfsDatabase* db = checkStore(L, 1);
+    const int tableIndex = (int)luaL_checkinteger(L, 2) - 1;
+    luaL_checktype(L, 3, LUA_TTABLE);
+    QVector<PfsRecord> records;
+    if (!db->readRecords(tableIndex, records)) {
+        pushValue(L, db->errorString());
+        return lua_error(L);
+    }
+
+    const auto& fields = db->tables()[tableIndex].fields;
+    rawgetfield(L, 3, "count");
+    const lua_Integer count = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    rawgetfield(L, 3, "columns");
+    const int columnsIdx = lua_gettop(L);
+    luaL_checktype(L, columnsIdx, LUA_TTABLE);
+    for (int i = 0; i < fields.count(); i++) {
+        lua_rawgeti(L, columnsIdx, i + 1);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        const quint8 type = fields[i].type;
+        lua_Integer row = count;
+        for (const PfsRecord& rec : records) {
+            const PfsValue& val = rec[i];
+            if (type == PfsDatabase::EDbColInt16 || type == PfsDatabase::EDbColInt32) {
+                lua_pushinteger(L, val.type == PfsValue::Integer ? val.integer : 0);
+            } else if (type == PfsDatabase::EDbColReal64) {
+                lua_pushnumber(L, val.type == PfsValue::Real ? val.real : 0.0);
+            } else if (type == PfsDatabase::EDbColText8) {
+                lua_pushlstring(L, val.text.constData(), val.text.size());
+            } else {
+                break;
+            }
+            lua_rawseti(L, -2, ++row);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushinteger(L, count + records.count());
+    lua_setfield(L, 3, "count");
+
+    lua_pushinteger(L, records.count());
+    return 1;
+}
+
+static int store_gc(lua_State* L)
+{
+    auto ud = static_cast<PfsDatabase**>(luaL_checkudata(L, 1, KPfsStoreType));
+    delete *ud;
+    *ud = nullptr;
+    return 0;
+}
+
+// pfsdb.save(tables, [info]) -> string
+//
+// Where tables is in the format of Db.tables, with each field additionally having a rawType (and optionally maxLen),
+// and info is as returned by store:info().
+static int pfsdb_save(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    QVector<PfsTable> tables;
+    const lua_Integer numTables = luaL_len(L, 1);
+    for (lua_Integer i = 1; i <= numTables; i++) {
+        lua_rawgeti(L, 1, i);
+        const int tblIdx = lua_gettop(L);
+        PfsTable table;
+        table.name = to_bytearray(L, tblIdx, "name");
+
+        rawgetfield(L, tblIdx, "fields");
+        const int fieldsIdx = lua_gettop(L);
+        const lua_Integer numFields = luaL_len(L, fieldsIdx);
+        for (lua_Integer j = 1; j <= numFields; j++) {
+            lua_rawgeti(L, fieldsIdx, j);
+            PfsField field;
+            field.name = to_bytearray(L, -1, "name");
+            field.type = to_intt<quint8>(L, -1, "rawType");
+            const int maxLen = to_int(L, -1, "maxLen");
+            if (maxLen > 0) {
+                field.maxLen = (quint8)maxLen;
+            }
+            table.fields.append(field);
+            lua_pop(L, 1);
+        }
+
+        rawgetfield(L, tblIdx, "count");
+        const lua_Integer numRecords = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        table.records.fill(PfsRecord(table.fields.count()), (int)numRecords);
+        rawgetfield(L, tblIdx, "columns");
+        for (int f = 0; f < table.fields.count(); f++) {
+            lua_rawgeti(L, -1, f + 1);
+            for (lua_Integer j = 1; j <= numRecords; j++) {
+                PfsValue& val = table.records[(int)j - 1][f];
+                lua_rawgeti(L, -1, j);
+                if (lua_isinteger(L, -1)) {
+                    val.type = PfsValue::Integer;
+                    val.integer = lua_tointeger(L, -1);
+                } else if (lua_type(L, -1) == LUA_TNUMBER) {
+                    val.type = PfsValue::Real;
+                    val.real = lua_tonumber(L, -1);
+                } else if (lua_type(L, -1) == LUA_TSTRING) {
+                    val.type = PfsValue::Text;
+                    val.text = to_bytearray(L, -1);
+                }
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        tables.append(table);
+        lua_settop(L, tblIdx - 1);
+    }
+
+    QByteArray result;
+    if (lua_istable(L, 2)) {
+        result = PfsDatabase::write(tables, to_intt<quint32>(L, 2, "uid2"), to_intt<quint32>(L, 2, "uid3"),
+            to_intt<quint32>(L, 2, "appUid"));
+    } else {
+        result = PfsDatabase::write(tables);
+    }
+    pushValue(L, result);
+    return 1;
+}
+
+void installPfsDbModule(lua_State* L)
+{
+    luaL_newmetatable(L, KPfsStoreType);
+    luaL_Reg metamethods[] = {
+        { "__gc", store_gc },
+        { nullptr, nullptr },
+    };
+    luaL_setfuncs(L, metamethods, 0);
+    lua_newtable(L);
+    luaL_Reg methods[] = {
+        { "info", store_info },
+        { "tables", store_tables },
+        { "readRecords", store_readRecords },
+        { nullptr, nullptr },
+    };
+    luaL_setfuncs(L, methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_newtable(L);
+    luaL_Reg fns[] = {
+        { "open", pfsdb_open },
+        { "save", pfsdb_save },
+        { nullptr, nullptr },
+    };
+    luaL_setfuncs(L, fns, 0);
+    lua_setfield(L, -2, "pfsdb");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PFSDB_H
+#define PFSDB_H
+
+#include "luasupport.h"
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// Reader and writer for databases in the EPOC permanent file store format, as written by DBMS (and therefore OPL) on
+// ER5 devices. This is the native equivalent of Db:loadBinary() in database.lua, which uses it in preference to its
+// own parser when the "pfsdb" module is available, and which can then save binary databases back in the same format.
+// PfsDatabase itself doesn't depend on Lua, so it can be benchmarked independently of the interpreter.
+
+struct PfsValue {
+    enum Type {
+        Null,
+        Integer,
+        Real,
+        Text,
+    };
+    Type type = Null;
+    qint64 integer = 0;
+    double real = 0;
+    QByteArray text;
+};
+
+typedef QVector<PfsValue> PfsRecord;
+
+struct PfsField {
+    QByteArray name;
+    quint8 type = 0; // One of PfsDatabase::ColumnType
+    quint8 maxLen = 255; // Only meaningful for text and binary columns
+};
+
+struct PfsTable {
+    QByteArray name;
+    QVector<PfsField> fields;
+    quint32 tokenId = 0; // Stream id of the table's record token, only set by open()
+    QVector<PfsRecord> records; // Only used by write()
+};
+
+class PfsDatabase {
+public:
+    // The subset of TDbColType that we know how to find our way past. Only Int16, Int32, Real64 and Text8 have values
+    // representable in OPL; everything else is read as null, and written as null. Because that would erase whatever
+    // was there, Db:saveBinary() refuses to rewrite databases with any such columns.
+    enum ColumnType {
+        EDbColBit = 0x0,
+        EDbColInt16 = 0x3,
+        EDbColInt32 = 0x5,
+        EDbColReal64 = 0x9,
+        EDbColDateTime = 0xA,
+        EDbColText8 = 0xB,
+        EDbColText16 = 0xC,
+        EDbColBinary = 0xD,
+        EDbColLongText8 = 0xE,
+        EDbColLongBinary = 0x10,
+    };
+
+    static const quint32 KUidOplFile = 0x1000008A;
+    static const quint32 KUidOplInterpreter = 0x10000168;
+
+    // Parses the store header, table of contents and schema. Records aren't decoded until readRecords() is called.
+    // Returns false if data isn't a database we understand, in which case errorString() says why.
+    bool open(const char* data, qint64 len);
+    QString errorString() const { return mError; }
+
+    quint32 uid2() const { return mUid2; }
+    quint32 uid3() const { return mUid3; }
+    quint32 appUid() const { return mAppUid; }
+    const QVector<PfsTable>& tables() const { return mTables; }
+
+    // Decodes the records of the given table and appends them to records. Text values refer directly to the data held
+    // by this object, so must not outlive it.
+    bool readRecords(int tableIndex, QVector<PfsRecord>& records);
+
+    // Returns a complete database file containing tables (including their records).
+    static QByteArray write(const QVector<PfsTable>& tables, quint32 uid2 = KUidOplFile, quint32 uid3 = 0,
+        quint32 appUid = KUidOplInterpreter);
+
+    // Returns the checksum of the 12 bytes of UIDs at uids, as stored after them at the start of any EPOC file (and as
+    // per getUidsChecksum() in crc.lua).
+    static quint32 uidsChecksum(const char* uids);
+
+private:
+    qint64 streamPos(quint32 streamId) const;
+    bool fail(const QString& err);
+
+private:
+    QByteArray mData; // Depaged, see depage()
+    QVector<quint32> mToc; // Stream offsets, indexed by stream id - 1
+    QVector<PfsTable> mTables;
+    quint32 mUid2 = 0;
+    quint32 mUid3 = 0;
+    quint32 mAppUid = 0;
+    QString mError;
+};
+
+// Registers the "pfsdb" module in package.loaded. See pfsdb.cpp for the API.
+void installPfsDbModule(lua_State* L);
+
+#endif // PFSDB_H
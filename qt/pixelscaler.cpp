@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "pixelscaler.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIXELSCALER_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXELSCALER_NEON
+#endif
+
+// Widens one row, writing each pixel Factor times.
+template <int Factor>
+static void scaleRow(const quint32* src, int width, quint32* dest)
+{
+    for (int x = 0; x < width; x++) {
+        const quint32 pixel = src[x];
+        for (int i = 0; i < Factor; i++) {
+            *dest++ = pixel;
+        }
+    }
+}
+
+// The common cases get vector versions which duplicate 4 pixels at a time.
+template <>
+void scaleRow<2>(const quint32* src, int width, quint32* dest)
+{
+    int x = 0;
+#if defined(PIXELSCALER_SSE2)
+    for (; x + 4 <= width; x += 4, dest += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_unpacklo_epi32(v, v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), _mm_unpackhi_epi32(v, v));
+    }
+#elif defined(PIXELSCALER_NEON)
+    for (; x + 4 <= width; x += 4, dest += 8) {
+        const uint32x4_t v = vld1q_u32(src + x);
+        const uint32x4x2_t pairs = vzipq_u32(v, v);
+        vst1q_u32(dest, pairs.val[0]);
+        vst1q_u32(dest + 4, pairs.val[1]);
+    }
+#endif
+    for (; x < width; x++, dest += 2) {
+        dest[0] = dest[1] = src[x];
+    }
+}
+
+template <>
+void scaleRow<4>(const quint32* src, int width, quint32* dest)
+{
+    int x = 0;
+#if defined(PIXELSCALER_SSE2)
+    for (; x + 4 <= width; x += 4, dest += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_shuffle_epi32(v, 0x00));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), _mm_shuffle_epi32(v, 0x55));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), _mm_shuffle_epi32(v, 0xAA));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 12), _mm_shuffle_epi32(v, 0xFF));
+    }
+#elif defined(PIXELSCALER_NEON)
+    for (; x + 4 <= width; x += 4, dest += 16) {
+        const uint32x4_t v = vld1q_u32(src + x);
+        vst1q_u32(dest, vdupq_n_u32(vgetq_lane_u32(v, 0)));
+        vst1q_u32(dest + 4, vdupq_n_u32(vgetq_lane_u32(v, 1)));
+        vst1q_u32(dest + 8, vdupq_n_u32(vgetq_lane_u32(v, 2)));
+        vst1q_u32(dest + 12, vdupq_n_u32(vgetq_lane_u32(v, 3)));
+    }
+#endif
+    for (; x < width; x++, dest += 4) {
+        dest[0] = dest[1] = dest[2] = dest[3] = src[x];
+    }
+}
+
+// Each source row is widened once, and then copied to the other Factor - 1 destination rows.
+template <int Factor>
+static void scaleRows(const quint32* src, int srcStride, int width, int height, quint32* dest, int destStride)
+{
+    const size_t rowBytes = (size_t)width * Factor * sizeof(quint32);
+    for (int y = 0; y < height; y++, src += srcStride) {
+        scaleRow<Factor>(src, width, dest);
+        const quint32* first = dest;
+        dest += destStride;
+        for (int i = 1; i < Factor; i++, dest += destStride) {
+            memcpy(dest, first, rowBytes);
+        }
+    }
+}
+
+void PixelScaler::scale(const quint32* src, int srcStride, int width, int height, quint32* dest, int destStride,
+    int factor)
+{
+    switch (factor) {
+    case 1:
+        for (int y = 0; y < height; y++, src += srcStride, dest += destStride) {
+            memcpy(dest, src, (size_t)width * sizeof(quint32));
+        }
+        break;
+    case 2:
+        scaleRows<2>(src, srcStride, width, height, dest, destStride);
+        break;
+    case 3:
+        scaleRows<3>(src, srcStride, width, height, dest, destStride);
+        break;
+    case 4:
+        scaleRows<4>(src, srcStride, width, height, dest, destStride);
+        break;
+    default:
+        for (int y = 0; y < height * factor; y++, dest += destStride) {
+            const quint32* srcRow = src + (y / factor) * srcStride;
+            for (int x = 0; x < width * factor; x++) {
+                dest[x] = srcRow[x / factor];
+            }
+        }
+        break;
+    }
+}
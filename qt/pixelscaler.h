@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PIXELSCALER_H
+#define PIXELSCALER_H
+
+#include <QtGlobal>
+
+// Integer nearest-neighbour scaling of 32bpp pixels, as used to present windows at 2x, 3x and 4x. Equivalent to
+// QImage::scaled() with Qt::FastTransformation for integer factors, but writes into an existing image (so only the
+// damaged parts of a window need rescaling) and uses SIMD where available. Doesn't depend on anything else, so can be
+// benchmarked independently.
+namespace PixelScaler {
+
+// Scales the width x height pixels at src (with srcStride pixels per row) by factor in both directions, writing the
+// result to dest (with destStride pixels per row), which must have room for width * factor by height * factor pixels.
+void scale(const quint32* src, int srcStride, int width, int height, quint32* dest, int destStride, int factor);
+
+}
+
+#endif // PIXELSCALER_H
@@ -1,9 +1,20 @@
 // Copyright (C) 2021-2026 Jason Morley, Tom Sutcliffe
 // See LICENSE file for license information.
 
+#include <QSemaphore>
+#include <QTemporaryDir>
 #include <QTest>
+#include <QTextCodec>
+#include <QThreadPool>
 
+#include "appindex.h"
+#include "filesystem.h"
 #include "luasupport.h"
+#include "mappedbuffer.h"
+#include "mbmcodec.h"
+#include "pfsdb.h"
+#include "pixelscaler.h"
+#include "opldefs.h"
 #include "oplruntime.h"
 
 class OpoLuaTests: public QObject
@@ -13,6 +24,12 @@ class OpoLuaTests: public QObject
 private slots:
     void run_unittest();
     void run_tcompiler();
+    void importdb();
+    void resolvePaths();
+    void truncateMappedFile();
+    void cancelQueuedWrite();
+    void parseAif();
+    void scalePixels();
 };
 
 // We want test failures that call os.exit(false) (due to cmdline.lua) to instead error
@@ -31,6 +48,8 @@ static int runCommand(const QStringList& args)
     auto cmdPath = QString(":/lua/") + args[0] + ".lua";
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
+    installPfsDbModule(L);
+    installMbmCodecModule(L);
     OplRuntime::configureLuaResourceSearcher(L);
 
     // Setup arg
@@ -67,5 +86,224 @@ void OpoLuaTests::run_tcompiler()
     QCOMPARE(runCommand({ "tcompiler" }), 0);
 }
 
+// Smoke test for bin/importdb.lua, which otherwise isn't run by anything
+void OpoLuaTests::importdb()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString csvPath = dir.filePath("test.csv");
+    QFile csv(csvPath);
+    QVERIFY(csv.open(QFile::WriteOnly));
+    csv.write("Name$,Count%\nalpha,1\nbeta,2\n");
+    csv.close();
+
+    const QString dbPath = dir.filePath("test.db");
+    QCOMPARE(runCommand({ "importdb", csvPath, dbPath }), 0);
+    QFile db(dbPath);
+    QVERIFY(db.open(QFile::ReadOnly));
+    const QByteArray data = db.readAll();
+    QVERIFY(data.contains(":TABLE Table1"));
+    QVERIFY(data.contains("alpha"));
+    QVERIFY(data.contains("beta"));
+}
+
+// Checks the directory cache FileSystemIoHandler uses to resolve device paths case-insensitively, including that it
+// notices changes made behind its back.
+void OpoLuaTests::resolvePaths()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QDir root(dir.path());
+    QVERIFY(root.mkdir("Sub"));
+    auto touch = [](const QString& path) {
+        QFile f(path);
+        return f.open(QFile::WriteOnly);
+    };
+    QVERIFY(touch(root.filePath("Sub/File.txt")));
+
+    FileSystemIoHandler fs(*QTextCodec::codecForName("Windows-1252"));
+    fs.addMapping('C', root);
+    fs.addMapping('D', QDir(root.filePath("Sub")));
+
+    QCOMPARE(fs.getNativePath("C:\\SUB\\FILE.TXT"), root.filePath("Sub/File.txt"));
+    QCOMPARE(fs.getNativePath("D:\\file.txt"), root.filePath("Sub/File.txt"));
+    // Anything which doesn't exist is used as-is
+    QCOMPARE(fs.getNativePath("C:\\SUB\\NEW.TXT"), root.filePath("Sub/NEW.TXT"));
+
+    // The directory is cached under both drives, and both must see the change
+    QVERIFY(touch(root.filePath("Sub/New.txt")));
+    QTRY_COMPARE(fs.getNativePath("C:\\SUB\\NEW.TXT"), root.filePath("Sub/New.txt"));
+    QTRY_COMPARE(fs.getNativePath("D:\\NEW.TXT"), root.filePath("Sub/New.txt"));
+
+    // On case-sensitive filesystems, names which differ only by case must all be found
+    QVERIFY(touch(root.filePath("Sub/new.txt")));
+    if (QDir(root.filePath("Sub")).entryList(QDir::Files).count() == 3) {
+        QTRY_COMPARE(fs.getNativePath("D:\\new.txt"), root.filePath("Sub/new.txt"));
+        QCOMPARE(fs.getNativePath("D:\\New.txt"), root.filePath("Sub/New.txt"));
+    }
+}
+
+// A mapped buffer must keep its contents (rather than raising SIGBUS) when the file is truncated underneath it
+void OpoLuaTests::truncateMappedFile()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QFile f(dir.filePath("big.bin"));
+    QVERIFY(f.open(QFile::WriteOnly));
+    QByteArray contents(256 * 1024, 'x');
+    contents[contents.size() - 1] = 'y';
+    QCOMPARE(f.write(contents), contents.size());
+    f.close();
+
+    FileSystemIoHandler fs(*QTextCodec::codecForName("Windows-1252"));
+    fs.addMapping('C', QDir(dir.path()), true);
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    installMappedBufferSupport(L);
+    fs.makeFsIoHandlerBridge(L);
+    lua_setglobal(L, "ioh");
+    const char* script = R"(
+        local buf = ioh.fsop("read", "C:\\BIG.BIN", "map")
+        assert(type(buf) == "userdata", "File wasn't mapped")
+        local h = assert(ioh.fsop("open", "C:\\BIG.BIN", "w+"))
+        assert(ioh.fileop("close", h) == 0)
+        assert(#buf == 256 * 1024)
+        assert(buf:sub(-2) == "xy")
+        assert(string.byte(buf, 128 * 1024) == 120)
+        -- And a file which is open for writing isn't mapped in the first place
+        assert(ioh.fsop("write", "C:\\BIG.BIN", tostring(buf)) == 0)
+        h = assert(ioh.fsop("open", "C:\\BIG.BIN", "r+"))
+        assert(type(ioh.fsop("read", "C:\\BIG.BIN", "map")) == "string")
+        ioh.fileop("close", h)
+    )";
+    const bool ok = luaL_dostring(L, script) == LUA_OK;
+    QString err = ok ? QString() : QString(lua_tostring(L, -1));
+    lua_close(L);
+    QVERIFY2(ok, qPrintable(err));
+    QCOMPARE(QFileInfo(dir.filePath("big.bin")).size(), contents.size());
+}
+
+// An IOA write which is cancelled while it's still waiting for a worker thread must never reach the file
+void OpoLuaTests::cancelQueuedWrite()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("file.txt");
+    FileSystemIoHandler::OpenFile f(path, true);
+    QVERIFY(f.file.open(QFile::ReadWrite));
+    QCOMPARE(f.file.write("original"), 8);
+    QVERIFY(f.file.seek(0));
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    QSemaphore blocker;
+    pool.start([&blocker] { blocker.acquire(); });
+    QAtomicInt cancelled(0);
+    int result = KErrNone;
+    pool.start([&] {
+        result = FileSystemIoHandler::writeFile(f, "changed", [&cancelled] { return cancelled.loadAcquire() != 0; });
+    });
+    cancelled.storeRelease(1);
+    blocker.release();
+    pool.waitForDone();
+    QCOMPARE(result, (int)KErrIOCancelled);
+
+    f.file.close();
+    QVERIFY(f.file.open(QFile::ReadOnly));
+    QCOMPARE(f.file.readAll(), QByteArray("original"));
+}
+
+// AppIndex::parseAif() must agree with parseAifToNative() in aif.lua, which it replaces for listing apps
+void OpoLuaTests::parseAif()
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    installMbmCodecModule(L);
+    OplRuntime::configureLuaResourceSearcher(L);
+    QCOMPARE(dofile(L, ":/lua/init.lua"), 0);
+    const char* script = R"(
+        local aif = require("aif")
+        local mbm = require("mbm")
+        local img, mask = {}, {}
+        for i = 0, 8 * 4 - 1 do
+            img[1 + i] = string.char(i * 8)
+            mask[1 + i] = i % 3 == 0 and "\255" or "\0"
+        end
+        local icons = mbm.parseMbmHeader(mbm.makeMbm(KUidMultiBitmapFileImage, {
+            { width = 8, height = 4, mode = KColorgCreate256GrayMode, normalizedImgData = table.concat(img) },
+            { width = 8, height = 4, mode = KColorgCreate2GrayMode, normalizedImgData = table.concat(mask) },
+        }))
+        local data = aif.makeAif({
+            uid3 = 0x10001234,
+            captions = { "fr_FR", "en_GB", fr_FR = "Bonjour", en_GB = "Hello" },
+            icons = icons,
+        })
+        local parsed = aif.parseAifToNative(data)
+        return data, parsed.captions.en_GB, parsed.uid3, parsed.icons[1].bitmap.normalizedImgData,
+            parsed.icons[1].mask.normalizedImgData
+    )";
+    const bool ok = luaL_dostring(L, script) == LUA_OK;
+    const QString err = ok ? QString() : QString(lua_tostring(L, -1));
+    QByteArray data, bitmap, mask;
+    QString appName;
+    quint32 uid = 0;
+    if (ok) {
+        data = to_bytearray(L, 1);
+        appName = QString::fromLatin1(to_bytearray(L, 2));
+        uid = (quint32)lua_tointeger(L, 3);
+        bitmap = to_bytearray(L, 4);
+        mask = to_bytearray(L, 5);
+    }
+    lua_close(L);
+    QVERIFY2(ok, qPrintable(err));
+
+    AppIndexEntry entry;
+    QVERIFY(AppIndex::parseAif(data, entry));
+    QVERIFY(entry.valid);
+    QCOMPARE(entry.appName, appName);
+    QCOMPARE(entry.uid, uid);
+    QCOMPARE(entry.icons.count(), 1);
+    auto pixels = [](const QImage& img) {
+        QByteArray result;
+        for (int y = 0; y < img.height(); y++) {
+            result.append(reinterpret_cast<const char*>(img.constScanLine(y)), img.width());
+        }
+        return result;
+    };
+    QCOMPARE(entry.icons[0].first.format(), QImage::Format_Grayscale8);
+    QCOMPARE(pixels(entry.icons[0].first), bitmap);
+    QCOMPARE(pixels(entry.icons[0].second), mask);
+
+    // As in aif.lua, a bad UID checksum means it isn't an AIF
+    data[12] = (char)(data[12] ^ 1);
+    QVERIFY(!AppIndex::parseAif(data, entry));
+}
+
+// Checks PixelScaler::scale() (including any SIMD paths) against the obvious loop, for each factor and for widths that
+// don't fill a whole vector. The source and destination rows are padded to make sure nothing outside them is touched.
+void OpoLuaTests::scalePixels()
+{
+    const int height = 3;
+    for (int factor = 1; factor <= 5; factor++) {
+        for (int width : { 1, 2, 3, 4, 5, 7, 8, 13 }) {
+            const int srcStride = width + 2;
+            QVector<quint32> src(srcStride * height);
+            for (int i = 0; i < src.count(); i++) {
+                src[i] = 0xFF000000 | (quint32)(i * 0x010203);
+            }
+            const int destStride = width * factor + 3;
+            QVector<quint32> dest(destStride * height * factor, 0xDEADBEEF);
+            QVector<quint32> expected = dest;
+            for (int y = 0; y < height * factor; y++) {
+                for (int x = 0; x < width * factor; x++) {
+                    expected[y * destStride + x] = src[(y / factor) * srcStride + x / factor];
+                }
+            }
+            PixelScaler::scale(src.constData(), srcStride, width, height, dest.data(), destStride, factor);
+            QVERIFY2(dest == expected, qPrintable(QString("factor %1 width %2").arg(factor).arg(width)));
+        }
+    }
+}
+
 QTEST_GUILESS_MAIN(OpoLuaTests)
 #include "test.moc"
@@ -17,17 +17,23 @@ TARGET = opolua-unittest
 INCLUDEPATH += ../core/shared/include ../dependencies/LuaSwift/Sources/CLua/lua
 
 HEADERS += \
+    appindex.h \
     asynchandle.h \
     oplruntime.h
 
 SOURCES = \
     ../core/shared/src/oplfns.c \
+    appindex.cpp \
     asynchandle.cpp \
     filesystem.cpp \
     lua.cpp \
     luasupport.cpp \
+    mappedbuffer.cpp \
+    mbmcodec.cpp \
     oplkeycode.cpp \
     oplruntime.cpp \
+    pfsdb.cpp \
+    pixelscaler.cpp \
     test.cpp
 
 # Generated by luafiles.pro
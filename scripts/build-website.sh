@@ -65,6 +65,7 @@ generate_command_usage "dumpopo"
 generate_command_usage "dumprsc"
 generate_command_usage "dumpsis"
 generate_command_usage "fscomp"
+generate_command_usage "importdb"
 generate_command_usage "makesis"
 generate_command_usage "opltotext"
 generate_command_usage "recognize"